@@ -0,0 +1,103 @@
+#ifndef NP_BATCH_H
+#define NP_BATCH_H
+
+#include <sys/types.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "np_core.h"
+#include "np_builtin.h"
+
+using namespace std;
+
+/*
+ * Batch scripts
+ *
+ * The batch builtin of np_single_proc takes the lines that follow, up to a
+ * line of BATCH_END, as one script. Every line is parsed before the first
+ * one runs. Commands are still spawned in script order, so number pipes
+ * count lines as they do interactively, but a command does not wait for
+ * the ones before it to exit: up to BATCH_WINDOW pipelines run at once,
+ * each writing into an anonymous file of its own, and their output is sent
+ * in script order, a prompt after every line, as if typed one by one.
+ *
+ * Only independent pipelines overlap. A builtin, a redirection or a user
+ * pipe runs alone, the commands before it have finished and the ones after
+ * it wait for it. A command writing into a number pipe waits for the ones
+ * before it, since the client gets its errors directly.
+ */
+#define BATCH_END           "end"
+#define BATCH_WINDOW        16          // Pipelines running at once
+#define BATCH_MAX_LINES     65536
+
+enum { BATCH_PARALLEL, BATCH_SERIAL, BATCH_DETACHED };
+
+typedef struct batch_step {
+    size_t line;            // Index in the script
+    Command command;
+    int mode;
+    bool is_line_end;       // Last command of its line, the prompt follows
+} BatchStep;
+
+typedef struct batch_job {
+    size_t line;
+    pid_t pid;              // Final process, -1 if there is none to wait for
+    int pidfd;              // From the zygote, -1 to open one
+    int capture_fd;         // Output of the pipeline, -1 if it went to the client
+    long start_ns;
+    bool is_line_end;
+} BatchJob;
+
+namespace batch_space {
+    unsigned long scripts = 0, lines = 0, overlapped = 0;
+
+    bool is_batch(const string &input) {
+        BuiltinCall call;
+        return builtin_space::parse(input, call) && call.id == BUILTIN_batch;
+    }
+
+    int classify(const Command &command) {
+        BuiltinCall call;
+
+        if (command.number != 0) {
+            return BATCH_DETACHED;
+        }
+        if (command.cmds.size() == 1 && builtin_space::parse(command.cmds[0], call)) {
+            return BATCH_SERIAL;
+        }
+        for (auto &cmd: command.cmds) {
+            // Redirection and user pipes
+            if (cmd.find_first_of("<>") != string::npos) return BATCH_SERIAL;
+        }
+        return BATCH_PARALLEL;
+    }
+
+    vector<BatchStep> plan(const vector<string> &script) {
+        // An empty line is a step without stages, only its prompt is sent
+        vector<BatchStep> steps;
+
+        for (size_t x = 0; x < script.size(); ++x) {
+            vector<Command> commands(1);
+
+            if (!script[x].empty()) commands = parse_number_pipe(script[x]);
+            if (commands.empty()) commands.resize(1);
+            for (size_t y = 0; y < commands.size(); ++y) {
+                steps.push_back(BatchStep{x, commands[y], classify(commands[y]), y == commands.size() - 1});
+                if (steps.back().mode == BATCH_PARALLEL && !commands[y].cmds.empty()) ++overlapped;
+            }
+        }
+        ++scripts;
+        lines += script.size();
+        return steps;
+    }
+
+    void report() {
+        if (scripts > 0) {
+            cerr << "Batch: " << scripts << " scripts, " << lines << " lines, "
+                 << overlapped << " pipelines overlapped" << endl;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,412 @@
+/* Core benchmark */
+/* Times the shared core without a server */
+
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "np_core.h"
+#include "np_trace.h"
+#include "np_builtin.h"
+#include "np_number_pipe.h"
+#include "np_telnet.h"
+#include "np_compress.h"
+#include "np_format.h"
+#include "np_zygote.h"
+
+using namespace std;
+
+#define BENCH_ROUNDS    20000
+#define BENCH_STREAM    64      // Lines in a telnet stream
+#define BENCH_LONG      64      // Stages of the long command line
+#define BENCH_BULK      1024    // Lines of pipelined input
+#define BENCH_OUTPUT    2048    // Lines of command output to compress
+#define BENCH_USERS     10000   // Rows of who
+#define BENCH_SPAWNS    200     // Children per server size
+#define BENCH_PENDING   1000    // Outstanding number pipes, as |1000 on every line leaves
+#define BENCH_WRITES    8       // Commands per redirection case
+#define BENCH_WRITE_BYTES   (4 << 20)   // Written by each command
+#define BENCH_WRITE_BLOCK   65536
+
+/* The user table of np_single_proc, sized for BENCH_USERS */
+#define USER_LIMIT      BENCH_USERS
+#include "np_single_proc.h"
+
+/* Sink, keeps the optimizer from dropping the measured work */
+volatile size_t bench_sink;
+
+template <typename F>
+void bench(const char *name, long rounds, F f, size_t bytes = 0) {
+    // With bytes, the throughput of an op over that many bytes is shown too
+    long start = trace_space::now_ns();
+
+    for (long i = 0; i < rounds; i++) {
+        f();
+    }
+    long dur = trace_space::now_ns() - start;
+
+    cout << left << setw(32) << name << right << setw(10) << fixed << setprecision(1)
+         << (double)dur / rounds << " ns/op";
+    if (bytes > 0) {
+        cout << setw(10) << (double)bytes * rounds / dur * 1000 << " MB/s";
+    }
+    cout << endl;
+}
+
+const char *command_mix_line(int i) {
+    // A line of pipelined input, as a client pasting a script sends it
+    const char *lines[] = {
+        "ls", "cat test.html | number", "removetag test.html |2", "printenv PATH",
+        "ls | number |1", "cat test.html | removetag | number | wc -l", "ls !1 > out.txt",
+        "yell hello everyone", "cat <2 | number >1", "cat test.html |1+1",
+    };
+    return lines[i % (sizeof(lines) / sizeof(lines[0]))];
+}
+
+string telnet_stream(bool is_mixed) {
+    // Lines of a session, with a client's negotiation and editing if mixed
+    const string iac(1, (char)TELNET_IAC);
+    string stream;
+
+    if (is_mixed) {
+        stream += iac + (char)TELNET_WILL + (char)TELNET_OPT_NAWS;
+        stream += iac + (char)TELNET_DO + (char)TELNET_OPT_SGA;
+        stream += iac + (char)TELNET_WILL + (char)TELNET_OPT_LINEMODE;
+    }
+    for (int i = 0; i < BENCH_STREAM; i++) {
+        if (!is_mixed) {
+            stream += "cat test.html | number | number | removetag\n";
+            continue;
+        }
+        stream += "cat test.html | numbrr\b\ber | number | removetag\r\n";
+        if (i % 8 == 0) {
+            const char naws[] = {(char)TELNET_IAC, (char)TELNET_SB, TELNET_OPT_NAWS,
+                                 0, 80, 0, 24, (char)TELNET_IAC, (char)TELNET_SE};
+            stream.append(naws, sizeof(naws));
+            stream += "yell " + iac + iac + string("\r\0", 2);
+        }
+    }
+    return stream;
+}
+
+int main(int argc, char const *argv[]) {
+    long rounds = (argc > 1) ? atol(argv[1]) : BENCH_ROUNDS;
+
+    if (rounds <= 0) {
+        cout << "Usage: prog [rounds]" << endl;
+        exit(0);
+    }
+
+    // Forked while the process is small, as np_single_proc does at boot
+    setenv(ZYGOTE_ENV, "on", 1);
+    zygote_space::init();
+
+    string simple  = "ls -l";
+    string piped   = "cat test.html | number | number | removetag";
+    string numbered = "ls |2 cat test.html !1 number | number |1000+1000 removetag test.html";
+    string builtin = "tell 3 hello world";
+
+    /* Parser */
+    bench("parse_normal_pipe (1 stage)", rounds, [&]() {
+        bench_sink = parse_normal_pipe(simple).size();
+    });
+    bench("parse_normal_pipe (4 stages)", rounds, [&]() {
+        bench_sink = parse_normal_pipe(piped).size();
+    });
+    bench("parse_number_pipe (plain)", rounds, [&]() {
+        bench_sink = parse_number_pipe(piped).size();
+    });
+    bench("parse_number_pipe (numbered)", rounds, [&]() {
+        bench_sink = parse_number_pipe(numbered).size();
+    });
+
+    /* Builtin dispatch */
+    bench("builtin parse (hit)", rounds, [&]() {
+        BuiltinCall call;
+        bench_sink = builtin_space::parse(builtin, call);
+    });
+    bench("builtin parse (miss)", rounds, [&]() {
+        BuiltinCall call;
+        bench_sink = builtin_space::parse(piped, call);
+    });
+
+    /* Pipe manager, one |1 per line */
+    NumberPipeWheel wheel;
+    bench("number pipe wheel (|1 per line)", rounds, [&]() {
+        wheel.advance();
+        if (wheel.current()) wheel.release_current();
+        bench_sink = (size_t)wheel.get(1);
+    });
+
+    /* Pipe manager, BENCH_PENDING pipes outstanding */
+    struct rlimit nofile;
+    getrlimit(RLIMIT_NOFILE, &nofile);
+    nofile.rlim_cur = nofile.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &nofile);
+    if (nofile.rlim_cur < BENCH_PENDING * 2 + 64) {
+        cout << "number pipe wheel skipped, RLIMIT_NOFILE " << nofile.rlim_cur << " too low" << endl;
+    } else {
+        NumberPipeWheel full_wheel;
+        for (int i = 1; i <= BENCH_PENDING; i++) {
+            full_wheel.get(i);
+        }
+        bench("number pipe wheel (|1000)", rounds, [&]() {
+            // The oldest pipe is read, a new one opened 1000 lines ahead
+            full_wheel.advance();
+            if (full_wheel.current()) full_wheel.release_current();
+            bench_sink = (size_t)full_wheel.get(BENCH_PENDING);
+        });
+        long i = 0;
+        bench("number pipe lookup (1000 open)", rounds, [&]() {
+            // Writers joining a pipe already pending
+            bench_sink = (size_t)full_wheel.get(1 + i++ * 7919 % BENCH_PENDING);
+        });
+        bench_sink = full_wheel.size();
+    }
+
+    /* Scanner, every kernel the CPU runs */
+    string long_line = "cat test.html";
+    for (int i = 1; i < BENCH_LONG; i++) {
+        long_line += (i % 8 == 0) ? " |1 number" : " | number -n " + to_string(i);
+    }
+    string bulk;
+    for (int i = 0; i < BENCH_BULK; i++) {
+        bulk += string(command_mix_line(i)) + "\n";
+    }
+    ScanResult scan;
+    for (const char *kernel: {"avx2", "sse2", "scalar"}) {
+        if (!set_scan_kernel(kernel)) continue;
+
+        string name = string("scan_text long line (") + kernel + ")";
+        bench(name.c_str(), rounds, [&]() {
+            scan_text(long_line.data(), long_line.size(), scan);
+            bench_sink = scan.tokens.size();
+        }, long_line.size());
+        name = string("scan_text bulk input (") + kernel + ")";
+        bench(name.c_str(), rounds / 16, [&]() {
+            scan_text(bulk.data(), bulk.size(), scan);
+            bench_sink = scan.newlines.size();
+        }, bulk.size());
+    }
+    set_scan_kernel("avx2") || set_scan_kernel("sse2");
+    bench("split_args (long line)", rounds, [&]() {
+        bench_sink = split_args(long_line).size();
+    }, long_line.size());
+    bench("parse_number_pipe (long line)", rounds / 16, [&]() {
+        bench_sink = parse_number_pipe(long_line).size();
+    }, long_line.size());
+    bench("line cut with find (bulk input)", rounds / 16, [&]() {
+        size_t lines = 0;
+        for (size_t pos = 0; (pos = bulk.find('\n', pos)) != string::npos; pos++) ++lines;
+        bench_sink = lines;
+    }, bulk.size());
+
+    /* Telnet input layer, a fresh connection per stream */
+    string plain = telnet_stream(false);
+    string mixed = telnet_stream(true);
+    string line_buf, reply;
+    bench("telnet filter (plain lines)", rounds, [&]() {
+        TelnetState st;
+        line_buf.clear();
+        reply.clear();
+        telnet_space::filter(&st, plain.data(), plain.size(), line_buf, reply);
+        bench_sink = line_buf.size();
+    }, plain.size());
+    bench("telnet filter (mixed stream)", rounds, [&]() {
+        TelnetState st;
+        line_buf.clear();
+        reply.clear();
+        telnet_space::filter(&st, mixed.data(), mixed.size(), line_buf, reply);
+        bench_sink = line_buf.size() + reply.size();
+    }, mixed.size());
+
+    /* Output compression, bandwidth saved against CPU per level */
+    string output;
+    for (int i = 0; i < BENCH_OUTPUT; i++) {
+        output += to_string(1000 + i) + " <tr><td class=\"name\">file" + to_string(i * 7919 % 1000)
+                + ".html</td><td>" + to_string(i * 31 % 4096) + " bytes</td></tr>\n";
+    }
+    for (int level: {COMPRESS_MIN_LEVEL, COMPRESS_LEVEL, COMPRESS_MAX_LEVEL}) {
+        string compressed;
+        {
+            compress_space::Codec codec(level);
+            codec.feed(output.data(), output.size(), Z_FINISH, compressed);
+        }
+        string name = "deflate level " + to_string(level) + " ("
+                    + to_string(100 - compressed.size() * 100 / output.size()) + "% saved)";
+        bench(name.c_str(), rounds / 64, [&]() {
+            compress_space::Codec codec(level);
+            compressed.clear();
+            codec.feed(output.data(), output.size(), Z_SYNC_FLUSH, compressed);
+            bench_sink = compressed.size();
+        }, output.size());
+    }
+
+    /* Message formatting, iostream against FormatBuffer and cached rows */
+    vector<UserDisplay> users(BENCH_USERS);
+    vector<sockaddr_storage> addrs(BENCH_USERS);
+    for (int i = 0; i < BENCH_USERS; i++) {
+        sockaddr_in *addr4 = (sockaddr_in *)&addrs[i];
+        addr4->sin_family = AF_INET;
+        addr4->sin_addr.s_addr = htonl(0x0a000000 + i);
+        addr4->sin_port = htons(40000 + i % 20000);
+        format_space::init_display(&users[i], i + 1, "user" + to_string(i), addrs[i]);
+    }
+    string text = "hello everyone, the build is green again";
+
+    bench("yell (ostringstream)", rounds, [&]() {
+        ostringstream oss;
+        oss << "*** " << users[7].name << " yelled ***: " << text << endl;
+        bench_sink = oss.str().size();
+    });
+    bench("yell (FormatBuffer)", rounds, [&]() {
+        FormatBuffer<> fmt;
+        fmt.add("*** ").add(users[7].name).add(" yelled ***: ").add(text).add('\n');
+        bench_sink = fmt.str().size();
+    });
+    bench("tell error (ostringstream)", rounds, [&]() {
+        ostringstream oss;
+        oss << "*** Error: user #" << 12345 << " does not exist yet. ***" << endl;
+        bench_sink = oss.str().size();
+    });
+    bench("tell error (FormatBuffer)", rounds, [&]() {
+        FormatBuffer<> fmt;
+        fmt.add("*** Error: user #").num(12345).add(" does not exist yet. ***\n");
+        bench_sink = fmt.str().size();
+    });
+
+    string who_name = "who " + to_string(BENCH_USERS) + " users";
+    bench((who_name + " (ostringstream)").c_str(), rounds / 256, [&]() {
+        // As who used to, the address formatted again for every row
+        ostringstream oss;
+        oss << "<ID>\t<nickname>\t<IP:port>\t<indicate me>" << endl;
+        for (int i = 0; i < BENCH_USERS; i++) {
+            struct in_addr ip = {htonl(0x0a000000 + i)};
+            oss << i + 1 << "\t" << users[i].name << "\t" << inet_ntoa(ip) << ":" << 40000 + i % 20000
+                << "\t" << ((i == 7) ? "<-me" : "") << endl;
+        }
+        bench_sink = oss.str().size();
+    });
+    static FormatBuffer<BENCH_USERS * 64> who_buf;
+    bench((who_name + " (cached rows)").c_str(), rounds / 256, [&]() {
+        who_buf.clear();
+        who_buf.add(format_space::WHO_HEADER);
+        for (int i = 0; i < BENCH_USERS; i++) {
+            who_buf.add(*users[i].row).add((i == 7) ? format_space::WHO_ME : "\n");
+        }
+        bench_sink = who_buf.str().size();
+    });
+    vector<struct iovec> iov(BENCH_USERS * 2 + 1);
+    bench((who_name + " (row iovecs)").c_str(), rounds / 256, [&]() {
+        // np_single_proc queues the rows themselves
+        static const char newline[] = "\n";
+        iov[0] = {(void *)format_space::WHO_HEADER.data(), format_space::WHO_HEADER.size()};
+        for (int i = 0; i < BENCH_USERS; i++) {
+            iov[2 * i + 1] = {(void *)users[i].row->data(), users[i].row->size()};
+            iov[2 * i + 2] = (i == 7) ? iovec{(void *)format_space::WHO_ME.data(), format_space::WHO_ME.size()}
+                                      : iovec{(void *)newline, 1};
+        }
+        bench_sink = iov.size();
+    });
+
+    /* User table, the lookups behind every tell, yell and received line */
+    user_space::UserTable &table = user_space::user_table;
+    for (int i = 0; i < BENCH_USERS; i++) {
+        // Fake sockets, the table never touches them
+        int uid = table.create_user(BENCH_USERS + i, addrs[i]);
+        table.set_name(table.get_user_by_id(uid), users[i].name);
+    }
+    string table_size = " (" + to_string(table.size()) + ")";
+    long n = 0;
+    bench(("user table by sockfd" + table_size).c_str(), rounds, [&]() {
+        bench_sink = (size_t)table.get_user_by_sockfd(BENCH_USERS + n++ * 7919 % BENCH_USERS);
+    });
+    bench(("user table by name" + table_size).c_str(), rounds, [&]() {
+        bench_sink = (size_t)table.get_user_by_name(users[n++ * 7919 % BENCH_USERS].name);
+    });
+    bench(("user table has uid" + table_size).c_str(), rounds, [&]() {
+        bench_sink = table.has_user((int)(1 + n++ * 7919 % BENCH_USERS));
+    });
+    bench(("user table has name" + table_size).c_str(), rounds, [&]() {
+        bench_sink = table.has_user(users[n++ * 7919 % BENCH_USERS].name);
+    });
+    bench(("user table name scan" + table_size).c_str(), rounds / 256, [&]() {
+        // As get_user_by_name used to, every slot compared
+        const string &peer = users[n++ * 7919 % BENCH_USERS].name;
+        user_space::UserInfo *found = NULL;
+        for (auto user: table.slots) {
+            if (user && user->get_name() == peer) {
+                found = user;
+                break;
+            }
+        }
+        bench_sink = (size_t)found;
+    });
+
+    /* Redirection, a command writing its log through > and >> under each NP_FSYNC policy */
+    string log_path = "np_bench_redirect.txt";
+    vector<char> block(BENCH_WRITE_BLOCK, 'x');
+    vector<pair<string, int>> policies = {{"none", FSYNC_NONE}, {"dsync", FSYNC_DSYNC}, {"exit", FSYNC_EXIT}};
+    for (auto &policy: policies) {
+        redirect_space::fsync_policy = policy.second;
+        for (string op: {">", ">>"}) {
+            vector<string> cmds = {"log " + op + " " + log_path};
+
+            bench(("file write " + op + " (" + policy.first + ")").c_str(), BENCH_WRITES, [&]() {
+                // As main_executor: open before the fork, release in the parent, sync once waited
+                vector<Redirection> redirs;
+                vector<int> sync_fds;
+                string error;
+
+                if (!redirect_space::open_all(cmds, redirs, error)) {
+                    cerr << error;
+                    exit(1);
+                }
+                pid_t pid = fork();
+                if (pid == 0) {
+                    redirect_space::apply(redirs[0]);
+                    for (size_t n = 0; n < BENCH_WRITE_BYTES; n += block.size()) {
+                        if (write(STDOUT_FILENO, block.data(), block.size()) < 0) _exit(1);
+                    }
+                    _exit(0);
+                }
+                redirect_space::release(redirs[0], sync_fds);
+                bench_sink = waitpid(pid, NULL, 0);
+                redirect_space::sync(sync_fds);
+            }, BENCH_WRITE_BYTES);
+            unlink(log_path.c_str());
+        }
+    }
+    redirect_space::fsync_policy = FSYNC_NONE;
+
+    /* Spawner, fork against the zygote as the server grows */
+    vector<string> true_args = {"true"};
+    vector<char> ballast;
+    for (size_t mb: {10, 100, 1000}) {
+        ballast.resize(mb << 20, 1);    // Touched, so it is resident
+        string size = to_string(mb) + " MB server)";
+
+        bench(("fork+exec (" + size).c_str(), BENCH_SPAWNS, [&]() {
+            pid_t pid = fork();
+            if (pid == 0) {
+                exec_args(true_args);
+                _exit(127);
+            }
+            bench_sink = waitpid(pid, NULL, 0);
+        });
+        bench(("zygote spawn (" + size).c_str(), BENCH_SPAWNS, [&]() {
+            const int stdio[3] = {-1, -1, -1};
+            int pidfd = -1;
+            pid_t pid = zygote_space::spawn(true_args, stdio, STDERR_FILENO, "", &pidfd);
+            bench_sink = waitpid(pid, NULL, 0);
+            if (pidfd >= 0) close(pidfd);
+        });
+    }
+
+    return 0;
+}
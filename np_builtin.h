@@ -0,0 +1,132 @@
+#ifndef NP_BUILTIN_H
+#define NP_BUILTIN_H
+
+#include <stdint.h>
+#include <string_view>
+#include <array>
+
+using namespace std;
+
+/*
+ * Builtin command dispatch
+ *
+ * Every builtin of every server is registered once in NP_BUILTINS as
+ * X(name, number of space separated arguments, whether the last argument
+ * takes the rest of the line). The names go into a perfect hash table built
+ * at compile time, so recognizing a builtin costs one hash of the first word
+ * and one comparison, and its arguments are string_views into the line.
+ * A server handles the ids it supports and treats the rest as programs.
+ */
+#define NP_BUILTINS(X)          \
+    X(setenv,   2, false)       \
+    X(printenv, 1, false)       \
+    X(exit,     0, false)       \
+    X(usage,    0, false)       \
+    X(who,      0, false)       \
+    X(tell,     1, true)        \
+    X(yell,     0, true)        \
+    X(name,     1, false)       \
+    X(compress, 0, false)       \
+    X(batch,    0, false)
+
+#define BUILTIN_TABLE_SIZE  16  // Must be power of 2
+#define BUILTIN_MAX_ARGS    3
+
+#define BUILTIN_ENUM(name, argc, rest)  BUILTIN_##name,
+enum BuiltinId { BUILTIN_NONE, NP_BUILTINS(BUILTIN_ENUM) BUILTIN_COUNT };
+#undef BUILTIN_ENUM
+
+typedef struct builtin_spec {
+    string_view name;
+    BuiltinId id;
+    int argc;
+    bool rest;
+} BuiltinSpec;
+
+typedef struct builtin_call {
+    BuiltinId id;
+    string_view args[BUILTIN_MAX_ARGS];    // Missing arguments are empty
+} BuiltinCall;
+
+namespace builtin_space {
+    #define BUILTIN_SPEC(name, argc, rest)  BuiltinSpec{#name, BUILTIN_##name, argc, rest},
+    constexpr BuiltinSpec specs[] = { NP_BUILTINS(BUILTIN_SPEC) };
+    #undef BUILTIN_SPEC
+
+    constexpr uint32_t hash(string_view name, uint32_t seed) {
+        uint32_t h = seed;
+
+        for (char c: name) {
+            h = (h ^ (unsigned char)c) * 16777619u;
+        }
+        // Low bits of a product only depend on low bits, fold the high ones in
+        return (h ^ (h >> 16)) & (BUILTIN_TABLE_SIZE - 1);
+    }
+
+    constexpr bool is_perfect(uint32_t seed) {
+        bool used[BUILTIN_TABLE_SIZE] = {};
+
+        for (auto &spec: specs) {
+            uint32_t h = hash(spec.name, seed);
+            if (used[h]) return false;
+            used[h] = true;
+        }
+        return true;
+    }
+
+    constexpr uint32_t find_seed() {
+        uint32_t seed = 2166136261u;
+
+        while (!is_perfect(seed)) ++seed;
+        return seed;
+    }
+
+    constexpr uint32_t seed = find_seed();
+
+    constexpr array<BuiltinSpec, BUILTIN_TABLE_SIZE> make_table() {
+        array<BuiltinSpec, BUILTIN_TABLE_SIZE> table = {};
+
+        for (auto &spec: specs) {
+            table[hash(spec.name, seed)] = spec;
+        }
+        return table;
+    }
+
+    constexpr array<BuiltinSpec, BUILTIN_TABLE_SIZE> table = make_table();
+
+    static_assert(sizeof(specs) / sizeof(specs[0]) < BUILTIN_TABLE_SIZE, "Enlarge BUILTIN_TABLE_SIZE");
+    static_assert(table[hash("setenv", seed)].id == BUILTIN_setenv, "Builtin table is not perfect");
+
+    constexpr const BuiltinSpec *lookup(string_view name) {
+        const BuiltinSpec *spec = &table[hash(name, seed)];
+        return (spec->id != BUILTIN_NONE && spec->name == name) ? spec : nullptr;
+    }
+
+    string_view next_word(string_view &line) {
+        // Words are separated by one space, as getline(iss, word, ' ') did
+        size_t pos = line.find(' ');
+        string_view word = line.substr(0, pos);
+
+        line = (pos == string_view::npos) ? string_view() : line.substr(pos + 1);
+        return word;
+    }
+
+    bool parse(string_view line, BuiltinCall &call) {
+        const BuiltinSpec *spec = lookup(next_word(line));
+
+        if (spec == nullptr) {
+            return false;
+        }
+
+        call = BuiltinCall{spec->id, {}};
+        for (int x = 0; x < spec->argc; ++x) {
+            call.args[x] = next_word(line);
+        }
+        if (spec->rest) {
+            call.args[spec->argc] = line;
+        }
+        return true;
+    }
+}
+
+#endif
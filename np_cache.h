@@ -0,0 +1,175 @@
+#ifndef NP_CACHE_H
+#define NP_CACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+
+#include "np_trace.h"
+
+using namespace std;
+
+/*
+ * Command result cache
+ *
+ * Output of read-only pipelines is cached under a key made of the
+ * normalized command line, PATH, the identity of every resolved program
+ * and the (inode, mtime, size) of every file argument. If any of them
+ * changes the key changes, so stale entries are never hit and simply age
+ * out. Only programs in CACHE_PURE_COMMANDS are considered pure.
+ * Enabled by starting the server with NP_CMD_CACHE set.
+ */
+#define CACHE_ENV           "NP_CMD_CACHE"
+#define CACHE_LIMIT         (64 << 20)  // Total cached bytes
+#define CACHE_ENTRY_LIMIT   (1 << 20)   // Larger outputs are not cached
+#define CACHE_PURE_COMMANDS {"cat", "number", "removetag", "removetag0", "wc"}
+
+typedef struct cache_entry {
+    string output;
+    long cost_ns;   // Time the pipeline took when it was captured
+} CacheEntry;
+
+namespace cache_space {
+    bool enabled = false;
+    unordered_map<string, CacheEntry> entries;
+    deque<string> order;    // Insertion order for eviction
+    size_t total_bytes = 0;
+    unsigned long hits = 0, misses = 0;
+    long saved_ns = 0;
+
+    void init() {
+        enabled = (getenv(CACHE_ENV) != NULL);
+    }
+
+    bool is_pure(string prog) {
+        for (string pure: CACHE_PURE_COMMANDS) {
+            if (prog == pure) return true;
+        }
+        return false;
+    }
+
+    void put_identity(ostream &os, struct stat &st) {
+        os << st.st_dev << ":" << st.st_ino << ":"
+           << st.st_mtim.tv_sec << "." << st.st_mtim.tv_nsec << ":" << st.st_size;
+    }
+
+    bool resolve_program(string prog, string path, ostream &os) {
+        // Same lookup as execvp
+        istringstream iss(path);
+        string dir;
+        struct stat st;
+
+        while (getline(iss, dir, ':')) {
+            string full = (dir.empty() ? "." : dir) + "/" + prog;
+            if (stat(full.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+                os << full << "@";
+                put_identity(os, st);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool make_key(vector<vector<string>> &stages, string &key) {
+        /*
+         * Each stage is its argument list. The first stage must read a file,
+         * otherwise it would read the server's stdin.
+         */
+        ostringstream oss;
+        char *path = getenv("PATH");
+        bool has_file = false;
+
+        if (!enabled || stages.empty() || path == NULL) {
+            return false;
+        }
+
+        oss << "PATH=" << path << "\n";
+        for (size_t i = 0; i < stages.size(); i++) {
+            if (stages[i].empty() || !is_pure(stages[i][0])) {
+                return false;
+            }
+            if (!resolve_program(stages[i][0], path, oss)) {
+                return false;
+            }
+            for (size_t j = 1; j < stages[i].size(); j++) {
+                struct stat st;
+
+                oss << " " << stages[i][j];
+                if (stat(stages[i][j].c_str(), &st) == 0) {
+                    if (!S_ISREG(st.st_mode)) return false;
+                    oss << "@";
+                    put_identity(oss, st);
+                    if (i == 0) has_file = true;
+                }
+            }
+            oss << "\n";
+        }
+
+        key = oss.str();
+        return has_file;
+    }
+
+    CacheEntry *lookup(string &key) {
+        auto iter = entries.find(key);
+
+        if (iter == entries.end()) {
+            ++misses;
+            return NULL;
+        }
+        ++hits;
+        saved_ns += iter->second.cost_ns;
+        return &iter->second;
+    }
+
+    void store(string &key, string &output, long cost_ns) {
+        if (output.length() > CACHE_ENTRY_LIMIT || entries.find(key) != entries.end()) {
+            return;
+        }
+
+        while (total_bytes + output.length() > CACHE_LIMIT && !order.empty()) {
+            total_bytes -= entries[order.front()].output.length();
+            entries.erase(order.front());
+            order.pop_front();
+        }
+
+        entries[key] = CacheEntry{output, cost_ns};
+        order.push_back(key);
+        total_bytes += output.length();
+    }
+
+    int open_capture() {
+        // Anonymous file, writes never block the pipeline
+        return memfd_create("np_cmd_cache", MFD_CLOEXEC);
+    }
+
+    string read_capture(int fd) {
+        string output;
+        char buf[4096];
+        int n;
+
+        lseek(fd, 0, SEEK_SET);
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            output.append(buf, n);
+        }
+        return output;
+    }
+
+    void report() {
+        unsigned long total = hits + misses;
+
+        cerr << "Command cache: " << hits << "/" << total << " hits ("
+             << (total ? hits * 100 / total : 0) << "%), "
+             << entries.size() << " entries, " << total_bytes << " bytes, "
+             << saved_ns / 1000 << " us saved" << endl;
+    }
+}
+
+#endif
@@ -0,0 +1,82 @@
+#!/bin/bash
+# Command cache replay benchmark of np_single_proc, driven by np_loadgen --replay
+#
+# usage: np_cache_replay.sh    record a journal and replay it with the cache off and on
+#
+# np_loadgen clients run the command mix against a server recording NP_JOURNAL.
+# The journal is then replayed against a fresh server without NP_CMD_CACHE and
+# against one with it, and each reports the replay latency. The cached server
+# reports its hits and the latency they saved through SIGUSR2.
+# NP_WORKDIR is where the servers run. It needs bin/ with the shell commands
+# and test.html, a scratch directory with system stand-ins is made if unset.
+# NP_PORT, NP_CLIENTS and NP_LINES tune the recorded load, NP_SPEED the replay
+# (0, the default, sends every line as soon as the previous one is answered).
+
+REPO=$(cd "$(dirname "$0")" && pwd)
+PORT=${NP_PORT:-7201}
+CLIENTS=${NP_CLIENTS:-8}
+LINES=${NP_LINES:-200}
+SPEED=${NP_SPEED:-0}
+
+setup_workdir() {
+    if [ -n "$NP_WORKDIR" ]; then
+        WORK=$NP_WORKDIR
+        return
+    fi
+    WORK=$(mktemp -d /tmp/np_cache_replay.XXXXXX)
+    trap 'rm -rf "$WORK"' EXIT
+    mkdir -p "$WORK/bin"
+    for prog in ls cat wc; do
+        ln -s "$(command -v $prog)" "$WORK/bin/$prog"
+    done
+    # The servers set PATH to bin:., so the stand-ins use absolute paths
+    printf '#!/bin/sh\nexec %s '\''{printf "%%4d %%s\\n", NR, $0}'\''\n' "$(command -v awk)" > "$WORK/bin/number"
+    printf '#!/bin/sh\nexec %s -e '\''s/<[^>]*>//g'\'' "$@"\n' "$(command -v sed)" > "$WORK/bin/removetag"
+    printf '#!/bin/sh\n' > "$WORK/bin/noop"
+    chmod +x "$WORK/bin/number" "$WORK/bin/removetag" "$WORK/bin/noop"
+    cp "$REPO/test.html" "$WORK/"
+}
+
+start_server() {
+    # usage: start_server env..., sets pid, the server's stderr goes to $WORK/server.log
+    (cd "$WORK" && exec env NP_RATELIMIT=off "$@" "$REPO/np_single_proc" "$PORT" > /dev/null 2> "$WORK/server.log") &
+    pid=$!
+    sleep 0.5
+}
+
+stop_server() {
+    # SIGINT flushes the journal
+    kill -INT $pid 2> /dev/null
+    sleep 0.5
+    kill -KILL $pid 2> /dev/null
+    wait $pid 2> /dev/null
+    PORT=$((PORT + 1))
+}
+
+replay() {
+    # usage: replay label env..., prints the np_loadgen report
+    local label=$1 result
+    shift
+
+    start_server "$@"
+    result=$("$REPO/np_loadgen" 127.0.0.1 "$PORT" --replay "$WORK/journal.bin" "$SPEED" | tail -n 1)
+    printf "%-10s %s\n" "$label" "$result"
+    if [ "$label" = "cache on" ]; then
+        kill -USR2 $pid
+        sleep 0.5
+        grep '^Command cache:' "$WORK/server.log" | tail -n 1 | sed 's/^/           /'
+    fi
+    stop_server
+}
+
+setup_workdir
+rm -f "$WORK/journal.bin"
+
+echo "Recording $CLIENTS clients x $LINES lines"
+start_server NP_JOURNAL="$WORK/journal.bin"
+"$REPO/np_loadgen" 127.0.0.1 "$PORT" "$CLIENTS" "$LINES" > /dev/null || exit 1
+sleep 1     # Let the sessions log out
+stop_server
+
+replay "cache off"
+replay "cache on" NP_CMD_CACHE=on
@@ -0,0 +1,215 @@
+#ifndef NP_COMPRESS_H
+#define NP_COMPRESS_H
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <zlib.h>
+#include <string>
+#include <thread>
+
+#include "np_trace.h"
+#include "np_telnet.h"
+
+using namespace std;
+
+/*
+ * Output compression (MCCP2)
+ *
+ * A session opts in with the compress builtin or a telnet DO COMPRESS2.
+ * From then on every writer of the session, the server as well as the
+ * stdout and stderr of its commands, writes into a socketpair, and a
+ * compressor stage in front of the client socket sends IAC SB COMPRESS2
+ * IAC SE followed by one zlib stream until the session ends. The stream is
+ * flushed whenever the writers fall quiet, so a prompt is never held back.
+ *
+ * The level follows the bottleneck: every COMPRESS_WINDOW input bytes it
+ * goes up while the stage mostly waits for the client's link, and down
+ * while deflate takes longer than the link.
+ */
+#define COMPRESS_BUF_SIZE   16384
+#define COMPRESS_LEVEL      6
+#define COMPRESS_MIN_LEVEL  1
+#define COMPRESS_MAX_LEVEL  9
+#define COMPRESS_WINDOW     (256 * 1024)
+
+typedef struct compress_stats {
+    size_t in_bytes = 0;
+    long deflate_ns = 0;        // CPU spent compressing
+    long link_ns = 0;           // Spent sending to the client
+} CompressStats;
+
+namespace compress_space {
+    class Codec {
+    public:
+        z_stream zs;
+        int level;
+        CompressStats stats;
+
+        Codec(int level) {
+            memset(&this->zs, 0, sizeof(this->zs));
+            this->level = level;
+            deflateInit(&this->zs, level);
+        }
+        ~Codec() { deflateEnd(&this->zs); }
+
+        void feed(const char *buf, size_t len, int flush, string &out) {
+            // Append the output for len more bytes, flush is a zlib flush mode
+            char chunk[COMPRESS_BUF_SIZE];
+            long start = trace_space::now_ns();
+
+            this->zs.next_in = (Bytef *)buf;
+            this->zs.avail_in = len;
+            do {
+                this->zs.next_out = (Bytef *)chunk;
+                this->zs.avail_out = sizeof(chunk);
+                deflate(&this->zs, flush);
+                out.append(chunk, sizeof(chunk) - this->zs.avail_out);
+            } while (this->zs.avail_out == 0);
+
+            this->stats.in_bytes += len;
+            this->stats.deflate_ns += trace_space::now_ns() - start;
+        }
+
+        void set_level(int level, string &out) {
+            // Input so far is finished with the old level into out
+            char chunk[COMPRESS_BUF_SIZE];
+            int ret;
+
+            this->zs.next_in = NULL;
+            this->zs.avail_in = 0;
+            do {
+                this->zs.next_out = (Bytef *)chunk;
+                this->zs.avail_out = sizeof(chunk);
+                ret = deflateParams(&this->zs, level, Z_DEFAULT_STRATEGY);
+                out.append(chunk, sizeof(chunk) - this->zs.avail_out);
+            } while (ret == Z_BUF_ERROR);
+
+            if (ret == Z_OK) this->level = level;
+        }
+    };
+
+    bool send_all(int sock, const string &buf, CompressStats &stats) {
+        // The client socket may be non-blocking, it is shared with the server
+        long start = trace_space::now_ns();
+        size_t sent = 0;
+
+        while (sent < buf.length()) {
+            ssize_t n = send(sock, buf.c_str() + sent, buf.length() - sent, MSG_NOSIGNAL);
+
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                struct pollfd pfd = {sock, POLLOUT, 0};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) return false;
+            sent += n;
+        }
+        stats.link_ns += trace_space::now_ns() - start;
+        return true;
+    }
+
+    void adapt(Codec &codec, CompressStats &window, string &out) {
+        if (codec.stats.in_bytes - window.in_bytes < COMPRESS_WINDOW) return;
+
+        long cpu_ns  = codec.stats.deflate_ns - window.deflate_ns;
+        long link_ns = codec.stats.link_ns - window.link_ns;
+
+        if (link_ns > 2 * cpu_ns && codec.level < COMPRESS_MAX_LEVEL) {
+            codec.set_level(codec.level + 1, out);
+        } else if (cpu_ns > link_ns && codec.level > COMPRESS_MIN_LEVEL) {
+            codec.set_level(codec.level - 1, out);
+        }
+        window = codec.stats;
+    }
+
+    void pump(int in_fd, int sock) {
+        // Until every writer closed in_fd or the client is gone
+        const char start[] = {(char)TELNET_IAC, (char)TELNET_SB, TELNET_OPT_COMPRESS2,
+                              (char)TELNET_IAC, (char)TELNET_SE};
+        Codec codec(COMPRESS_LEVEL);
+        CompressStats window;
+        char buf[COMPRESS_BUF_SIZE];
+        string out(start, sizeof(start));
+
+        while (true) {
+            ssize_t n = read(in_fd, buf, sizeof(buf));
+
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                codec.feed(NULL, 0, Z_FINISH, out);
+                send_all(sock, out, codec.stats);
+                break;
+            }
+
+            struct pollfd pfd = {in_fd, POLLIN, 0};
+            bool is_quiet = (poll(&pfd, 1, 0) == 0);
+
+            codec.feed(buf, n, is_quiet ? Z_SYNC_FLUSH : Z_NO_FLUSH, out);
+            adapt(codec, window, out);
+            if (!out.empty() && !send_all(sock, out, codec.stats)) break;
+            out.clear();
+        }
+        close(in_fd);
+        close(sock);
+    }
+
+    int spawn(int sock) {
+        /*
+         * Fork the stage, for the servers made of processes. Returns the end
+         * the session writes to, close-on-exec so only dup2 hands it on.
+         */
+        int fds[2];
+
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+            perror("Compress socketpair");
+            return -1;
+        }
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("Compress fork");
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+        if (pid == 0) {
+            // Keep only the two ends, the sockets of other users must close with them
+            int in  = fcntl(fds[1], F_DUPFD, STDERR_FILENO + 1);
+            int out = fcntl(sock, F_DUPFD, STDERR_FILENO + 1);
+
+            dup2(in, STDIN_FILENO);
+            dup2(out, STDOUT_FILENO);
+            close_range(STDERR_FILENO + 1, ~0U, 0);
+            for (int sig = 1; sig < NSIG; sig++) {
+                signal(sig, SIG_DFL);
+            }
+            pump(STDIN_FILENO, STDOUT_FILENO);
+            _exit(0);
+        }
+        close(fds[1]);
+        return fds[0];
+    }
+
+    int spawn_thread(int sock) {
+        // The stage as a thread, for the thread-per-core server
+        int fds[2];
+        int out = fcntl(sock, F_DUPFD_CLOEXEC, 0);
+
+        if (out < 0 || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+            perror("Compress socketpair");
+            if (out >= 0) close(out);
+            return -1;
+        }
+        thread(pump, fds[1], out).detach();
+        return fds[0];
+    }
+}
+
+#endif
@@ -0,0 +1,492 @@
+/* Core library shared by the three servers */
+
+#include "np_core.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <iostream>
+#include <regex>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+#define SCAN_BLOCK  64      // Bytes per kernel call, one bit each in a mask
+
+/* Scanner */
+/*
+ * A kernel classifies one block and sets bit i of each mask for block[i]:
+ * masks[0] spaces, masks[1] the metacharacters | ! < >, masks[2] newlines.
+ * The widest kernel the CPU runs is picked once at startup, the rest of
+ * the scan works on the masks and is the same for every kernel.
+ */
+typedef void (*ScanKernel)(const char *block, uint64_t masks[3]);
+
+void scan_block_scalar(const char *block, uint64_t masks[3]) {
+    masks[0] = masks[1] = masks[2] = 0;
+    for (int i = 0; i < SCAN_BLOCK; i++) {
+        switch (block[i]) {
+        case ' ':  masks[0] |= 1ULL << i; break;
+        case '|': case '!': case '<': case '>':
+                   masks[1] |= 1ULL << i; break;
+        case '\n': masks[2] |= 1ULL << i; break;
+        }
+    }
+}
+
+#if defined(__x86_64__)
+void scan_block_sse2(const char *block, uint64_t masks[3]) {
+    const __m128i space = _mm_set1_epi8(' '), newline = _mm_set1_epi8('\n');
+    const __m128i bar = _mm_set1_epi8('|'), bang = _mm_set1_epi8('!');
+    const __m128i lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>');
+
+    masks[0] = masks[1] = masks[2] = 0;
+    for (int i = 0; i < SCAN_BLOCK; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(block + i));
+        __m128i meta = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, bar), _mm_cmpeq_epi8(v, bang)),
+                                    _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)));
+
+        masks[0] |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, space)) << i;
+        masks[1] |= (uint64_t)(uint16_t)_mm_movemask_epi8(meta) << i;
+        masks[2] |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)) << i;
+    }
+}
+
+__attribute__((target("avx2")))
+void scan_block_avx2(const char *block, uint64_t masks[3]) {
+    const __m256i space = _mm256_set1_epi8(' '), newline = _mm256_set1_epi8('\n');
+    const __m256i bar = _mm256_set1_epi8('|'), bang = _mm256_set1_epi8('!');
+    const __m256i lt = _mm256_set1_epi8('<'), gt = _mm256_set1_epi8('>');
+
+    masks[0] = masks[1] = masks[2] = 0;
+    for (int i = 0; i < SCAN_BLOCK; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(block + i));
+        __m256i meta = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, bar), _mm256_cmpeq_epi8(v, bang)),
+                                       _mm256_or_si256(_mm256_cmpeq_epi8(v, lt), _mm256_cmpeq_epi8(v, gt)));
+
+        masks[0] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, space)) << i;
+        masks[1] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(meta) << i;
+        masks[2] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline)) << i;
+    }
+}
+#endif
+
+const struct {
+    const char *name;
+    ScanKernel kernel;
+} scan_kernels[] = {
+#if defined(__x86_64__)
+    {"avx2",   scan_block_avx2},
+    {"sse2",   scan_block_sse2},
+#endif
+    {"scalar", scan_block_scalar},
+};
+
+size_t pick_scan_kernel() {
+#if defined(__x86_64__)
+    if (!__builtin_cpu_supports("avx2")) return 1;
+#endif
+    return 0;
+}
+
+size_t scan_kernel_idx = pick_scan_kernel();
+
+const char *scan_kernel() {
+    return scan_kernels[scan_kernel_idx].name;
+}
+
+bool set_scan_kernel(const char *name) {
+    // For np_bench, a kernel the CPU cannot run is refused
+    for (size_t i = 0; i < sizeof(scan_kernels) / sizeof(scan_kernels[0]); i++) {
+        if (strcmp(scan_kernels[i].name, name) == 0 && i >= pick_scan_kernel()) {
+            scan_kernel_idx = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void push_offsets(vector<unsigned> &offsets, size_t base, uint64_t mask) {
+    while (mask) {
+        offsets.push_back(base + __builtin_ctzll(mask));
+        mask &= mask - 1;
+    }
+}
+
+void scan_text(const char *buf, size_t len, ScanResult &res) {
+    ScanKernel kernel = scan_kernels[scan_kernel_idx].kernel;
+    uint64_t carry = 1;     // The byte before the text counts as a separator
+    unsigned begin = 0;
+
+    res.tokens.clear();
+    res.metas.clear();
+    res.newlines.clear();
+
+    for (size_t base = 0; base < len; base += SCAN_BLOCK) {
+        size_t n = min((size_t)SCAN_BLOCK, len - base);
+        uint64_t masks[3];
+
+        if (n == SCAN_BLOCK) {
+            kernel(buf + base, masks);
+        } else {
+            // Padded with NUL, which is in no class
+            char tail[SCAN_BLOCK] = {};
+            memcpy(tail, buf + base, n);
+            kernel(tail, masks);
+        }
+
+        // Past the end counts as a separator, so the last word ends at len
+        uint64_t valid = (n == SCAN_BLOCK) ? ~0ULL : (1ULL << n) - 1;
+        uint64_t sep = masks[0] | masks[2] | ~valid;
+        uint64_t prev = (sep << 1) | carry;
+        uint64_t edges = (~sep & prev) | (sep & ~prev);
+
+        while (edges) {
+            int i = __builtin_ctzll(edges);
+
+            if (sep & (1ULL << i)) {
+                res.tokens.push_back(Token{begin, (unsigned)(base + i) - begin});
+            } else {
+                begin = base + i;
+            }
+            edges &= edges - 1;
+        }
+        carry = sep >> (SCAN_BLOCK - 1);
+
+        push_offsets(res.metas, base, masks[1] & valid);
+        push_offsets(res.newlines, base, masks[2] & valid);
+    }
+    if (!carry) {
+        // A word runs up to a block boundary at len
+        res.tokens.push_back(Token{begin, (unsigned)len - begin});
+    }
+}
+
+/* Parser */
+bool is_space_run(const char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (isspace((unsigned char)buf[i]) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool is_white_char(const string &cmd) {
+    // Only words made of tabs and other isspace bytes are left to check
+    static thread_local ScanResult res;     // Keeps its capacity between lines
+
+    scan_text(cmd.data(), cmd.length(), res);
+    for (auto &token: res.tokens) {
+        if (!is_space_run(cmd.data() + token.begin, token.length)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+vector<string> split_args(const string &cmd) {
+    // The words of getline(iss, arg, ' ') that are not white space
+    vector<string> args;
+    static thread_local ScanResult res;
+
+    scan_text(cmd.data(), cmd.length(), res);
+    for (auto &token: res.tokens) {
+        if (!is_space_run(cmd.data() + token.begin, token.length)) {
+            args.push_back(cmd.substr(token.begin, token.length));
+        }
+    }
+    return args;
+}
+
+vector<string> parse_normal_pipe(string input) {
+    vector<string> cmds;
+    static thread_local ScanResult res;
+    size_t start = 0;
+
+    // Parse pipe, split at every "| "
+    scan_text(input.data(), input.length(), res);
+    for (unsigned pos: res.metas) {
+        if (input[pos] == '|' && pos + 1 < input.length() && input[pos + 1] == ' ') {
+            cmds.push_back(input.substr(start, pos - start));
+            start = pos + 2;
+        }
+    }
+    cmds.push_back(input.substr(start));
+
+    // Remove space
+    for (size_t i = 0; i < cmds.size(); i++) {
+        if (cmds[i].empty()) continue;
+
+        size_t head = 0, tail = cmds[i].length() - 1;
+
+        while(cmds[i][head] == ' ') ++head;
+        while(tail > head && cmds[i][tail] == ' ') --tail;
+
+        if (head != 0 || tail != cmds[i].length() - 1) {
+            cmds[i] = cmds[i].substr(head, tail + 1);
+        }
+    }
+
+    return cmds;
+}
+
+int calc(string input) {
+    int pos, res;
+    string n1, n2;
+
+    pos = input.find("+");
+    n1 = input.substr(0, pos);
+    n2 = input.substr(pos+1, input.length()-pos-1);
+    res = atoi(n1.c_str()) + atoi(n2.c_str());
+
+    // cout << "n1 = " << n1 << " n2 = " << n2 << " res = " << res << endl;
+
+    return res;
+}
+
+size_t match_number_pipe(const string &input, size_t pos) {
+    /*
+     * Length of [|!][1-9]\d?\d?[0]?\+?[1-9]?\d?\d?[0]? at pos, 0 if none.
+     * Everything after the first digit is optional, so taking each part
+     * greedily is the match the regex would find.
+     */
+    const char *p = input.c_str() + pos;
+    size_t n = 1;
+
+    auto take = [&](char lo, char hi) {
+        if (p[n] >= lo && p[n] <= hi) ++n;
+    };
+
+    if (p[n] < '1' || p[n] > '9') return 0;
+    ++n;
+    take('0', '9'); take('0', '9'); take('0', '0');
+    take('+', '+');
+    take('1', '9'); take('0', '9'); take('0', '9'); take('0', '0');
+    return n;
+}
+
+vector<Command> parse_number_pipe(string input) {
+    /*
+     *    "removetag test.html |2 ls | number |1"
+     * -> ["removetag test.html |2", "ls | number |1"]
+     */
+    vector<Command> lines;
+    static const regex pattern2("[1-9]\\d?\\d?[0]?\\+?[1-9]?\\d?\\d?[0]?");
+    static thread_local ScanResult res;
+    size_t head = 0;
+
+    // Candidates are the | and ! found by the scanner, in order
+    scan_text(input.data(), input.length(), res);
+    for (unsigned pos: res.metas) {
+        size_t len;
+
+        if (pos < head || (input[pos] != '|' && input[pos] != '!')) continue;
+        if ((len = match_number_pipe(input, pos)) == 0) continue;
+
+        Command command;
+        string tmp;
+        tmp = input.substr(head, pos + len - head);
+
+        if (tmp.find("+") == string::npos) {
+            command.cmd = tmp;
+            command.number = atoi(input.substr(pos + 1, len - 1).c_str());
+        } else {
+            int n;
+            n = calc(input.substr(pos + 1, len - 1));
+            tmp = regex_replace(tmp, pattern2, to_string(n));
+            // cout << input << endl;
+            // cout << tmp << endl;
+            command.cmd = tmp;
+            command.number = n;
+        }
+        head = pos + len;
+
+        lines.push_back(command);
+    }
+    input.erase(0, head);
+
+    if (input.length() != 0) {
+        Command command{cmd: input};
+        
+        lines.push_back(command);
+    }
+
+    if (lines.size() == 0) {
+        // Normal Pipe
+        Command command{cmd: input};
+
+        lines.push_back(command);
+    }
+
+    // Split by pipe
+    for (size_t i = 0; i < lines.size(); i++) {
+        lines[i].cmds = parse_normal_pipe(lines[i].cmd); 
+    }
+
+    // Debug
+    #if 0
+    for (size_t i = 0; i < lines.size(); i++) {
+        cerr << "Line " << i << ": " << lines[i].cmd << endl;
+        cerr << "\tCommand: " << lines[i].cmd << endl;
+        cerr << "\tCommand Size: " << lines[i].cmds.size() << endl;
+        cerr << "\tNumber: " << lines[i].number << endl;
+    }
+    #endif
+        
+    return lines;
+}
+
+/* Spawner */
+void exec_args(vector<string> &args) {
+    // Only returns if execvp failed, the caller reports it to its user
+    const char **c_args = new const char* [args.size()+1];  // Reserve one location for NULL
+
+    for (size_t i = 0; i < args.size(); i++) {
+        c_args[i] = args[i].c_str();
+    }
+    c_args[args.size()] = NULL;
+
+    execvp(c_args[0], (char **)c_args);
+    delete[] c_args;
+}
+
+/* Pipeline */
+bool open_stage_pipe(vector<Pipe> &pipes, string &error) {
+    /*
+     * The pipe from the stage being forked to the next one. On failure the
+     * pipes still open are closed and nothing more should be forked, the
+     * stages before see the end of their output.
+     */
+    int pipefd[2];
+
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        error = "*** Error: " + string(strerror(errno)) + ". ***\n";
+        close_pipes(pipes);
+        return false;
+    }
+    pipes.push_back(Pipe{pipefd[0], pipefd[1]});
+    return true;
+}
+
+StageIO wire_stage(const vector<Pipe> &pipes, size_t i, size_t n, int source, int sink, bool is_error_pipe) {
+    // Stage i of n, source and sink are the ends of the whole pipeline
+    StageIO io;
+
+    io.fd[STDIN_FILENO]  = (i == 0) ? source : pipes[i-1].in;
+    io.fd[STDOUT_FILENO] = (i + 1 == n) ? sink : pipes[i].out;
+    if (i + 1 == n && is_error_pipe) {
+        io.fd[STDERR_FILENO] = sink;
+    }
+    return io;
+}
+
+void apply_stage(const StageIO &io) {
+    // Invoked in the child, the pipes are close-on-exec
+    for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; ++fd) {
+        if (io.fd[fd] >= 0 && io.fd[fd] != fd) dup2(io.fd[fd], fd);
+    }
+}
+
+void close_stage_pipe(vector<Pipe> &pipes, size_t i) {
+    // Invoked in the parent once stage i is forked, the pipe into it is no longer needed
+    if (i == 0 || i > pipes.size()) return;
+    close(pipes[i-1].in);
+    close(pipes[i-1].out);
+    pipes[i-1] = Pipe{-1, -1};
+}
+
+void close_pipes(vector<Pipe> &pipes) {
+    for (auto &p: pipes) {
+        if (p.in >= 0)  close(p.in);
+        if (p.out >= 0) close(p.out);
+    }
+    pipes.clear();
+}
+
+/* I/O */
+int get_listen_socket(const char *port) {
+    // Dual-stack, IPv4 clients arrive as v4-mapped IPv6 addresses
+    struct sockaddr_storage s_addr;
+    socklen_t s_addr_len;
+    int listen_sock;
+    int status_code;
+
+    // Init variable
+    bzero((char *)&s_addr, sizeof(s_addr));
+
+    // Create socket, IPv4 only if the host has no IPv6
+    listen_sock = socket(AF_INET6, SOCK_STREAM, 0);
+    if (listen_sock >= 0) {
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&s_addr;
+        int v6only = 0;
+
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_addr = in6addr_any;
+        addr6->sin6_port = htons((u_short)atoi(port));
+        s_addr_len = sizeof(*addr6);
+        if (setsockopt(listen_sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(int)) < 0) {
+            perror("Set socket option");
+            exit(0);
+        }
+    } else if (errno == EAFNOSUPPORT) {
+        struct sockaddr_in *addr4 = (struct sockaddr_in *)&s_addr;
+
+        addr4->sin_family = AF_INET;
+        addr4->sin_addr.s_addr = INADDR_ANY;
+        addr4->sin_port = htons((u_short)atoi(port));
+        s_addr_len = sizeof(*addr4);
+        listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    }
+    if (listen_sock < 0) {
+        perror("Server create socket");
+        exit(0);
+    }
+
+    // Socket setting
+    int optval = 1;
+    status_code = setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+    if (status_code < 0) {
+        perror("Set socket option");
+        exit(0);
+    }
+
+    // Bind socket
+    status_code = bind(listen_sock, (struct sockaddr *) &s_addr, s_addr_len);
+    if (status_code < 0) {
+        perror("Server bind");
+        exit(0);
+    }
+
+    // Listen socket
+    status_code = listen(listen_sock, SOMAXCONN);   // Logins arrive in bursts
+    if (status_code < 0) {
+        perror("Server listen");
+        exit(0);
+    }
+
+    return listen_sock;
+}
+
+bool write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        int n = write(fd, buf, len);
+        if (n < 0) {
+            perror("Write");
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
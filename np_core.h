@@ -0,0 +1,79 @@
+#ifndef NP_CORE_H
+#define NP_CORE_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+ * Core of the three servers, built once into libnpcore.a
+ *
+ * The parser, the program spawner, the listening socket and the blocking
+ * write loop live here so that a fix applies to np_simple, np_single_proc
+ * and np_multi_proc at once and can be benchmarked by np_bench without a
+ * server. Each server keeps its own concurrency model, its user state and
+ * the executor that picks where a pipeline reads and writes.
+ */
+
+typedef struct mypipe {
+    int in;
+    int out;
+} Pipe;
+
+typedef struct my_command {
+    string cmd;             // Cut by number|error pipe
+    vector<string> cmds;    // Split by pipe
+    int number = 0;         // For number pipe
+    int in_fd = -1;         // For user pipe
+    int out_fd = -1;
+} Command;
+
+/* Scanner */
+typedef struct scan_token {
+    unsigned begin;             // Offset in the scanned text
+    unsigned length;
+} Token;
+
+typedef struct scan_result {
+    vector<Token> tokens;       // Words between spaces and newlines
+    vector<unsigned> metas;     // Offsets of | ! < >
+    vector<unsigned> newlines;
+} ScanResult;
+
+void scan_text(const char *buf, size_t len, ScanResult &res);
+const char *scan_kernel();
+bool set_scan_kernel(const char *name);
+
+/* Parser */
+bool is_white_char(const string &cmd);
+vector<string> split_args(const string &cmd);
+vector<string> parse_normal_pipe(string input);
+int calc(string input);
+vector<Command> parse_number_pipe(string input);
+
+/* Spawner */
+void exec_args(vector<string> &args);
+
+/* Pipeline */
+/*
+ * The pipes between the stages of one pipeline. The server picks what the
+ * first stage reads and what the last one writes (a number pipe, a user
+ * pipe, its socket) and the rest is wired here. The parent fills a StageIO
+ * per stage before forking, the child applies it, then its redirections.
+ */
+typedef struct stage_io {
+    int fd[3] = {-1, -1, -1};   // stdin, stdout and stderr, -1 keeps the inherited one
+} StageIO;
+
+bool open_stage_pipe(vector<Pipe> &pipes, string &error);
+StageIO wire_stage(const vector<Pipe> &pipes, size_t i, size_t n, int source, int sink, bool is_error_pipe);
+void apply_stage(const StageIO &io);
+void close_stage_pipe(vector<Pipe> &pipes, size_t i);
+void close_pipes(vector<Pipe> &pipes);
+
+/* I/O */
+int get_listen_socket(const char *port);
+bool write_all(int fd, const char *buf, size_t len);
+
+#endif
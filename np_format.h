@@ -0,0 +1,127 @@
+#ifndef NP_FORMAT_H
+#define NP_FORMAT_H
+
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <charconv>
+#include <memory>
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+/*
+ * Message formatting
+ *
+ * Server messages are put together in a FormatBuffer, a fixed array on the
+ * stack that strings are copied into and numbers written into with
+ * to_chars, where an ostringstream would allocate and consult its locale.
+ * A message longer than the buffer is cut short.
+ *
+ * What messages show of a user, the name and "ip:port", is formatted once
+ * into a UserDisplay at login, along with the user's row of who, and only
+ * the name change rebuilds it. The row is an immutable shared string, so a
+ * server can queue it as it is and a message already queued keeps the old
+ * one alive.
+ *
+ * Addresses come from the dual-stack listen socket. IPv4 clients show as
+ * they always have, IPv6 ones as "[ip]:port".
+ */
+#define FORMAT_BUF_SIZE     32768   // Two lines of input and the text around them
+#define FORMAT_ADDR_SIZE    (INET6_ADDRSTRLEN + 8)   // [ip]:port
+
+template <size_t N = FORMAT_BUF_SIZE>
+class FormatBuffer {
+public:
+    char buf[N];
+    size_t len = 0;
+
+    FormatBuffer &add(string_view str) {
+        size_t n = min(str.size(), N - this->len);
+
+        memcpy(this->buf + this->len, str.data(), n);
+        this->len += n;
+        return *this;
+    }
+
+    FormatBuffer &add(char c) {
+        if (this->len < N) this->buf[this->len++] = c;
+        return *this;
+    }
+
+    FormatBuffer &num(long value) {
+        auto result = to_chars(this->buf + this->len, this->buf + N, value);
+
+        if (result.ec == errc()) this->len = result.ptr - this->buf;
+        return *this;
+    }
+
+    string_view view() const { return string_view(this->buf, this->len); }
+    string str() const       { return string(this->buf, this->len); }
+    void clear()             { this->len = 0; }
+};
+
+typedef struct user_display {
+    string name;
+    string addr;                    // ip:port
+    shared_ptr<const string> row;   // "<id>\t<name>\t<ip:port>\t" of who
+} UserDisplay;
+
+namespace format_space {
+    const string_view WHO_HEADER = "<ID>\t<nickname>\t<IP:port>\t<indicate me>\n";
+    const string_view WHO_ME     = "<-me\n";
+
+    size_t format_addr(char *dst, size_t size, const sockaddr_storage &addr) {
+        // "ip:port" or "[ip]:port" with a NUL, returns the length without it
+        FormatBuffer<FORMAT_ADDR_SIZE> fmt;
+        char ip[INET6_ADDRSTRLEN];
+
+        if (addr.ss_family == AF_INET6) {
+            const sockaddr_in6 *addr6 = (const sockaddr_in6 *)&addr;
+
+            if (IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr)) {
+                // An IPv4 client of the dual-stack socket
+                inet_ntop(AF_INET, &addr6->sin6_addr.s6_addr[12], ip, sizeof(ip));
+                fmt.add(ip);
+            } else {
+                inet_ntop(AF_INET6, &addr6->sin6_addr, ip, sizeof(ip));
+                fmt.add('[').add(ip).add(']');
+            }
+            fmt.add(':').num(ntohs(addr6->sin6_port));
+        } else {
+            const sockaddr_in *addr4 = (const sockaddr_in *)&addr;
+
+            inet_ntop(AF_INET, &addr4->sin_addr, ip, sizeof(ip));
+            fmt.add(ip).add(':').num(ntohs(addr4->sin_port));
+        }
+        fmt.len = min(fmt.len, size - 1);
+        memcpy(dst, fmt.buf, fmt.len);
+        dst[fmt.len] = '\0';
+        return fmt.len;
+    }
+
+    template <size_t N>
+    void add_row(FormatBuffer<N> &fmt, int id, string_view name, string_view addr) {
+        fmt.num(id).add('\t').add(name).add('\t').add(addr).add('\t');
+    }
+
+    void set_name(UserDisplay *display, int id, string_view name) {
+        FormatBuffer<> fmt;
+
+        display->name = name;
+        add_row(fmt, id, name, display->addr);
+        display->row = make_shared<const string>(fmt.view());
+    }
+
+    void init_display(UserDisplay *display, int id, string_view name, const sockaddr_storage &addr) {
+        char buf[FORMAT_ADDR_SIZE];
+
+        display->addr.assign(buf, format_addr(buf, sizeof(buf), addr));
+        set_name(display, id, name);
+    }
+}
+
+#endif
@@ -0,0 +1,120 @@
+#!/bin/bash
+# Dual-stack check of every server over ::1 and 127.0.0.1, driven by np_loadgen
+#
+# usage: np_ipv6_check.sh    run the check against the built servers (make)
+#
+# Each server takes np_loadgen clients from both loopbacks at once, then one
+# client per loopback runs who. Both must see the same table, with the IPv6
+# client as [::1]:port and the IPv4 one as 127.0.0.1:port. np_simple has no
+# who, so only its prompt is checked over both.
+# NP_WORKDIR is where the servers run. It needs bin/ with the shell commands
+# and test.html, a scratch directory with system stand-ins is made if unset.
+# NP_PORT, NP_CLIENTS and NP_LINES tune the load.
+
+REPO=$(cd "$(dirname "$0")" && pwd)
+PORT=${NP_PORT:-7101}
+CLIENTS=${NP_CLIENTS:-4}
+LINES=${NP_LINES:-50}
+SERVERS=("np_simple" "np_single_proc" "np_multi_proc" "np_multi_proc --threads")
+FAILED=0
+
+setup_workdir() {
+    if [ -n "$NP_WORKDIR" ]; then
+        WORK=$NP_WORKDIR
+        return
+    fi
+    WORK=$(mktemp -d /tmp/np_ipv6_check.XXXXXX)
+    trap 'rm -rf "$WORK"' EXIT
+    mkdir -p "$WORK/bin"
+    for prog in ls cat wc; do
+        ln -s "$(command -v $prog)" "$WORK/bin/$prog"
+    done
+    # The servers set PATH to bin:., so the stand-ins use absolute paths
+    printf '#!/bin/sh\nexec %s '\''{printf "%%4d %%s\\n", NR, $0}'\''\n' "$(command -v awk)" > "$WORK/bin/number"
+    printf '#!/bin/sh\nexec %s -e '\''s/<[^>]*>//g'\'' "$@"\n' "$(command -v sed)" > "$WORK/bin/removetag"
+    printf '#!/bin/sh\n' > "$WORK/bin/noop"
+    chmod +x "$WORK/bin/number" "$WORK/bin/removetag" "$WORK/bin/noop"
+    cp "$REPO/test.html" "$WORK/"
+}
+
+fail() {
+    echo "  FAIL: $*"
+    FAILED=1
+}
+
+probe_who() {
+    # Both loopbacks logged in together, prints "<v6 who>\0<v4 who>" without <-me
+    local out6 out4
+
+    exec 3<> "/dev/tcp/::1/$PORT" || return 1
+    exec 4<> "/dev/tcp/127.0.0.1/$PORT" || return 1
+    sleep 0.3
+    printf 'who\n' >&3
+    printf 'who\n' >&4
+    sleep 0.3
+    printf 'exit\n' >&3
+    printf 'exit\n' >&4
+    out6=$(timeout 2 cat <&3 | tr -d '\r' | grep -P '^\d+\t' | cut -f 1-3)
+    out4=$(timeout 2 cat <&4 | tr -d '\r' | grep -P '^\d+\t' | cut -f 1-3)
+    exec 3<&- 4<&-
+    printf '%s\0%s' "$out6" "$out4"
+}
+
+probe_prompt() {
+    # usage: probe_prompt host, true once the server prompts
+    exec 3<> "/dev/tcp/$1/$PORT" || return 1
+    printf 'exit\n' >&3
+    timeout 2 cat <&3 | grep -q '^% '
+    local found=$?
+    exec 3<&-
+    return $found
+}
+
+check_server() {
+    # usage: check_server "binary [options]"
+    local binary options pid who6 who4
+
+    read -r binary options <<< "$1"
+    (cd "$WORK" && NP_RATELIMIT=off exec "$REPO/$binary" "$PORT" $options > /dev/null 2>&1) &
+    pid=$!
+    sleep 0.5
+
+    echo "$1"
+    "$REPO/np_loadgen" ::1 "$PORT" "$CLIENTS" "$LINES" > "$WORK/loadgen6.txt" &
+    local load6=$!
+    "$REPO/np_loadgen" 127.0.0.1 "$PORT" "$CLIENTS" "$LINES" > "$WORK/loadgen4.txt"
+    local status4=$?
+    wait $load6
+    local status6=$?
+    echo "  ::1        $(tail -n 1 "$WORK/loadgen6.txt")"
+    echo "  127.0.0.1  $(tail -n 1 "$WORK/loadgen4.txt")"
+    [ $status6 -eq 0 ] || fail "np_loadgen over ::1"
+    [ $status4 -eq 0 ] || fail "np_loadgen over 127.0.0.1"
+    sleep 0.5   # Let the np_loadgen sessions log out
+
+    if [ "$binary" = "np_simple" ]; then
+        probe_prompt ::1 || fail "no prompt over ::1"
+        probe_prompt 127.0.0.1 || fail "no prompt over 127.0.0.1"
+    else
+        { IFS= read -r -d '' who6; IFS= read -r -d '' who4; } < <(probe_who)
+        printf '%s\n' "$who6" | sed 's/^/  /'
+        [ -n "$who6" ] && [ "$who6" = "$who4" ] || fail "who differs between ::1 and 127.0.0.1"
+        grep -qP '\t\[::1\]:\d+$' <<< "$who6" || fail "no [::1]:port row"
+        grep -qP '\t127\.0\.0\.1:\d+$' <<< "$who6" || fail "no 127.0.0.1:port row"
+    fi
+
+    kill -KILL $pid 2> /dev/null
+    wait $pid 2> /dev/null
+    PORT=$((PORT + 1))
+}
+
+if [ ! -e /proc/net/if_inet6 ]; then
+    echo "No IPv6 on this host, skipped"
+    exit 0
+fi
+setup_workdir
+for server in "${SERVERS[@]}"; do
+    check_server "$server"
+done
+[ $FAILED -eq 0 ] && echo "OK" || echo "FAILED"
+exit $FAILED
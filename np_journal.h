@@ -0,0 +1,239 @@
+#ifndef NP_JOURNAL_H
+#define NP_JOURNAL_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "np_trace.h"
+
+using namespace std;
+
+/*
+ * Command journal
+ *
+ * NP_JOURNAL=<file> makes a server record every command line it runs: the
+ * wall clock time it started, the session, the line, the exit status of
+ * the process it waited for and the time until the prompt. The file is an
+ * append-only log of binary records behind a header, mapped shared into
+ * every process and thread of the server, so recording is a copy into
+ * memory and never a system call on the path of a session.
+ *
+ * Records gather in a buffer per thread and reach the map in batches, one
+ * atomic add on the tail reserves the room of a whole batch. A batch is
+ * written once it fills, once its oldest record is a second old, and when a
+ * session ends. An idle loop waits at most flush_timeout_ms() and then calls
+ * tick(), so a quiet server does not keep its last records unwritten. Records that do not fit any more are counted as
+ * dropped, and a server started on an existing journal appends after it.
+ *
+ * np_loadgen --replay plays a journal back against a server.
+ */
+#define JOURNAL_ENV         "NP_JOURNAL"
+#define JOURNAL_SIZE        (64L * 1024 * 1024)     // Mapped bytes, the header included
+#define JOURNAL_BATCH       4096                    // Bytes buffered per thread
+#define JOURNAL_FLUSH_NS    1000000000L
+#define JOURNAL_MAGIC       0x314c4e524a504eULL     // "NPJRNL1"
+#define JOURNAL_NO_STATUS   -1                      // Nothing was waited for
+
+typedef struct journal_header {
+    uint64_t magic;
+    atomic<uint64_t> tail;      // End of the reserved record bytes
+    atomic<uint64_t> dropped;   // Records that did not fit
+    char pad[40];               // Records start on a cache line
+} JournalHeader;
+
+typedef struct journal_record {
+    uint32_t length;            // With the line and padding to 8 bytes, 0 if not written
+    int32_t session;            // uid, or the pid of the shell in np_simple
+    int64_t time_ns;            // Wall clock at the start of the line
+    int64_t duration_ns;        // Until the prompt
+    int32_t status;             // Exit code, JOURNAL_NO_STATUS if none
+    uint32_t line_len;
+} JournalRecord;                // The line follows
+
+typedef struct journal_entry {
+    int session;
+    long time_ns;
+    long duration_ns;
+    int status;
+    string line;
+} JournalEntry;
+
+static_assert(sizeof(JournalHeader) == 64, "journal header is one cache line");
+static_assert(sizeof(JournalRecord) % 8 == 0, "journal records are 8-byte aligned");
+
+namespace journal_space {
+    const uint64_t CAPACITY = JOURNAL_SIZE - sizeof(JournalHeader);
+
+    JournalHeader *header = NULL;   // NULL if the journal is off
+    char *records = NULL;
+    thread_local string batch;
+    thread_local size_t batch_records = 0;
+    thread_local long batch_ns = 0; // When the oldest buffered record was made
+
+    void init() {
+        char *path = getenv(JOURNAL_ENV);
+        struct stat st;
+        int fd;
+
+        if (path == NULL || *path == '\0') {
+            return;
+        }
+        if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0 || fstat(fd, &st) < 0) {
+            perror("Journal open");
+            if (fd >= 0) close(fd);
+            return;
+        }
+        if (st.st_size < JOURNAL_SIZE && ftruncate(fd, JOURNAL_SIZE) < 0) {
+            perror("Journal ftruncate");
+            close(fd);
+            return;
+        }
+
+        void *map = mmap(NULL, JOURNAL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            perror("Journal mmap");
+            return;
+        }
+        header = (JournalHeader *)map;
+        records = (char *)map + sizeof(JournalHeader);
+        if (header->magic != JOURNAL_MAGIC) {
+            header->tail = 0;
+            header->dropped = 0;
+            header->magic = JOURNAL_MAGIC;
+        }
+    }
+
+    long wall_ns() {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return ts.tv_sec * 1000000000L + ts.tv_nsec;
+    }
+
+    int exit_code(int wait_status) {
+        // As a shell reports it
+        if (WIFSIGNALED(wait_status)) return 128 + WTERMSIG(wait_status);
+        return WEXITSTATUS(wait_status);
+    }
+
+    void flush() {
+        if (header == NULL || batch.empty()) {
+            return;
+        }
+
+        uint64_t offset = header->tail.fetch_add(batch.size());
+        if (offset + batch.size() <= CAPACITY) {
+            memcpy(records + offset, batch.data(), batch.size());
+        } else {
+            header->dropped += batch_records;
+        }
+        batch.clear();
+        batch_records = 0;
+    }
+
+    int flush_timeout_ms() {
+        // For the poll of an idle loop, -1 if nothing is buffered
+        if (header == NULL || batch.empty()) {
+            return -1;
+        }
+        long left = batch_ns + JOURNAL_FLUSH_NS - trace_space::now_ns();
+        return (left > 0) ? left / 1000000 + 1 : 0;
+    }
+
+    void tick() {
+        // Invoked by the loop after its poll, writes a batch that has waited long enough
+        if (header != NULL && !batch.empty() && trace_space::now_ns() - batch_ns >= JOURNAL_FLUSH_NS) {
+            flush();
+        }
+    }
+
+    void record(int session, const string &line, int status, long start_ns) {
+        // start_ns is trace_space::now_ns() when the line was read
+        if (header == NULL) {
+            return;
+        }
+
+        long now = trace_space::now_ns();
+        size_t length = (sizeof(JournalRecord) + line.length() + 7) & ~(size_t)7;
+        JournalRecord rec;
+
+        rec.length      = length;
+        rec.session     = session;
+        rec.duration_ns = now - start_ns;
+        rec.time_ns     = wall_ns() - rec.duration_ns;
+        rec.status      = status;
+        rec.line_len    = line.length();
+
+        if (batch.empty()) batch_ns = now;
+        batch.append((const char *)&rec, sizeof(rec));
+        batch.append(line);
+        batch.append(length - sizeof(rec) - line.length(), '\0');
+        ++batch_records;
+
+        if (batch.size() >= JOURNAL_BATCH || now - batch_ns >= JOURNAL_FLUSH_NS) {
+            flush();
+        }
+    }
+
+    bool load(const char *path, vector<JournalEntry> &entries, uint64_t *dropped) {
+        /*
+         * Read a journal in file order. A process that died between reserving
+         * and writing its batch leaves zeros, they are skipped a word at a time.
+         */
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+
+        if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(JournalHeader)) {
+            if (fd >= 0) close(fd);
+            return false;
+        }
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            return false;
+        }
+
+        JournalHeader *h = (JournalHeader *)map;
+        const char *base = (const char *)map + sizeof(JournalHeader);
+        uint64_t end = min((uint64_t)h->tail, min(CAPACITY, (uint64_t)st.st_size - sizeof(JournalHeader)));
+
+        if (h->magic != JOURNAL_MAGIC) {
+            munmap(map, st.st_size);
+            return false;
+        }
+        *dropped = h->dropped;
+
+        for (uint64_t offset = 0; offset + sizeof(JournalRecord) <= end; ) {
+            JournalRecord rec;
+
+            memcpy(&rec, base + offset, sizeof(rec));
+            if (rec.length == 0) {
+                offset += 8;
+                continue;
+            }
+            if (rec.length < sizeof(rec) + rec.line_len || offset + rec.length > end) {
+                break;
+            }
+            entries.push_back(JournalEntry{rec.session, rec.time_ns, rec.duration_ns, rec.status,
+                                           string(base + offset + sizeof(rec), rec.line_len)});
+            offset += rec.length;
+        }
+        munmap(map, st.st_size);
+        return true;
+    }
+}
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef NP_LIMITS_H
+#define NP_LIMITS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <string>
+
+using namespace std;
+
+/*
+ * Resource limits for spawned commands
+ *
+ * When the server is started with NP_CGROUP_ROOT pointing at a delegated
+ * cgroup v2 directory (one the server may write to and is not itself a
+ * member of), every session gets its own child cgroup with cpu.weight,
+ * memory.max and pids.max, and every command process joins it before exec.
+ * Without cgroups the same limits are approximated with setrlimit and nice.
+ */
+#define LIMIT_CGROUP_ENV    "NP_CGROUP_ROOT"
+#define LIMIT_CONTROLLERS   "+cpu +memory +pids"
+#define LIMIT_CPU_WEIGHT    "50"            // Default is 100
+#define LIMIT_MEMORY_MAX    (512UL << 20)
+#define LIMIT_PIDS_MAX      64
+#define LIMIT_CPU_SECONDS   120             // Fallback only
+#define LIMIT_NICE          5               // Fallback only
+
+namespace limit_space {
+    string cgroup_root;     // Empty when falling back to setrlimit
+
+    bool write_file(string path, string value) {
+        int fd = open(path.c_str(), O_WRONLY);
+        bool ok;
+
+        if (fd < 0) {
+            return false;
+        }
+        ok = (write(fd, value.c_str(), value.length()) == (ssize_t)value.length());
+        close(fd);
+
+        return ok;
+    }
+
+    string read_file(string path) {
+        ifstream ifs(path);
+        stringstream ss;
+
+        ss << ifs.rdbuf();
+        return ss.str();
+    }
+
+    void init() {
+        char *root = getenv(LIMIT_CGROUP_ENV);
+
+        if (root == NULL) {
+            return;
+        }
+        if (!write_file(string(root) + "/cgroup.subtree_control", LIMIT_CONTROLLERS)) {
+            perror("Enable cgroup controllers, fall back to setrlimit");
+            return;
+        }
+        cgroup_root = root;
+    }
+
+    string session_cgroup(string session) {
+        return cgroup_root + "/" + session;
+    }
+
+    void create_session(string session) {
+        // Invoked at login
+        string dir = session_cgroup(session);
+
+        if (cgroup_root.empty()) {
+            return;
+        }
+        if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+            perror("Create session cgroup");
+            return;
+        }
+        write_file(dir + "/cpu.weight", LIMIT_CPU_WEIGHT);
+        write_file(dir + "/memory.max", to_string(LIMIT_MEMORY_MAX));
+        write_file(dir + "/pids.max", to_string(LIMIT_PIDS_MAX));
+    }
+
+    void remove_session(string session) {
+        // Invoked at logout, fails harmlessly while commands are still running
+        if (!cgroup_root.empty()) {
+            rmdir(session_cgroup(session).c_str());
+        }
+    }
+
+    string procs_path(string session) {
+        // cgroup.procs of the session, empty without cgroups
+        return cgroup_root.empty() ? "" : session_cgroup(session) + "/cgroup.procs";
+    }
+
+    void apply_procs(const char *procs) {
+        // Invoked in the forked child, only system calls, so a threaded server may fork
+        if (procs[0]) {
+            int fd = open(procs, O_WRONLY);
+            bool ok = (fd >= 0 && write(fd, "0", 1) == 1);     // 0 is the writer itself
+
+            if (fd >= 0) close(fd);
+            if (ok) return;
+        }
+
+        struct rlimit mem = {LIMIT_MEMORY_MAX, LIMIT_MEMORY_MAX};
+        struct rlimit cpu = {LIMIT_CPU_SECONDS, LIMIT_CPU_SECONDS};
+
+        setrlimit(RLIMIT_AS, &mem);
+        setrlimit(RLIMIT_CPU, &cpu);
+        setpriority(PRIO_PROCESS, 0, LIMIT_NICE);
+    }
+
+    void apply(string session) {
+        // Invoked in the forked child, right before exec
+        apply_procs(procs_path(session).c_str());
+    }
+
+    string usage(string session, struct rusage *ru) {
+        /*
+         * Counters of the session cgroup, or the rusage of the commands the
+         * session has waited for when cgroups are not available.
+         */
+        ostringstream oss;
+
+        if (!cgroup_root.empty()) {
+            string dir = session_cgroup(session);
+            istringstream cpu_stat(read_file(dir + "/cpu.stat"));
+            string key;
+            long value, usec = 0;
+
+            while (cpu_stat >> key >> value) {
+                if (key == "usage_usec") usec = value;
+            }
+            oss << "cgroup: " << dir << endl
+                << "cpu: " << usec / 1000 << " ms" << endl
+                << "memory: " << atol(read_file(dir + "/memory.current").c_str()) / 1024 << " KB" << endl
+                << "memory peak: " << atol(read_file(dir + "/memory.peak").c_str()) / 1024 << " KB" << endl
+                << "pids: " << atol(read_file(dir + "/pids.current").c_str()) << endl;
+        } else {
+            long msec = (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000
+                      + (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) / 1000;
+
+            oss << "cgroup: none (setrlimit)" << endl
+                << "cpu: " << msec << " ms" << endl
+                << "memory peak: " << ru->ru_maxrss << " KB" << endl;
+        }
+
+        return oss.str();
+    }
+
+    void add_rusage(struct rusage *total, struct rusage *ru) {
+        timeradd(&total->ru_utime, &ru->ru_utime, &total->ru_utime);
+        timeradd(&total->ru_stime, &ru->ru_stime, &total->ru_stime);
+        total->ru_maxrss = max(total->ru_maxrss, ru->ru_maxrss);
+    }
+}
+
+#endif
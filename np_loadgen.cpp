@@ -0,0 +1,783 @@
+/* Load generator */
+/* Replays a command mix, or a journal of real sessions, against a server and reports throughput */
+/* Times a script typed line by line against the same lines sent as one batch */
+/* Holds thousands of sessions, each running multi-stage pipelines */
+/* Times the delivery of yells fanned out to a full room */
+/* Times an interactive session alone and next to sessions running heavy pipelines */
+/* Times a legitimate session alone and under a login and command flood */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "np_trace.h"
+#include "np_journal.h"
+
+using namespace std;
+
+#define LOADGEN_CLIENTS     8
+#define LOADGEN_LINES       200     // Per client
+#define LOADGEN_TIMEOUT     60      // Seconds without a prompt before a client gives up
+#define LOADGEN_BUF_SIZE    65536
+#define LOADGEN_MAX_SLEEP_US    100000
+#define LOADGEN_BATCH_LINES     10000
+#define LOADGEN_YELL_RATE       100     // Yells per second
+#define LOADGEN_YELL_SECONDS    10
+#define LOADGEN_YELL_DRAIN      10      // Seconds the listeners may lag behind the last yell
+#define LOADGEN_YELL_MARK       "yelled ***: loadgen "
+#define LOADGEN_NOISY_LINES     500     // Of the interactive session
+#define LOADGEN_NOISY_LINE      "ls -lR /usr | number | number | wc -l"
+#define LOADGEN_NOISY_WARMUP_US 1000000
+#define LOADGEN_FLOOD_LINES     100     // Of the legitimate session
+#define LOADGEN_FLOOD_RATE      10      // Lines per second, within the command limit of a user
+#define LOADGEN_FLOOD_SOURCE    "127.0.0.2"
+#define LOADGEN_FLOOD_BURST     32      // Lines an attacker writes at once
+#define LOADGEN_FLOOD_RETRY_US  100000
+
+/*
+ * Mix of a shell session, replayed in order by every client. Every number
+ * pipe is read by a later line of the mix, so no command waits for input
+ * from the socket, and the commands a server does not support only cost it
+ * an error message.
+ */
+const char *command_mix[] = {
+    "ls",
+    "cat test.html | number",
+    "removetag test.html |2",
+    "printenv PATH",
+    "ls | number |1",
+    "number",
+    "setenv LOADGEN 1",
+    "who",
+    "cat test.html | removetag | number | wc -l",
+    "ls !1",
+    "wc -c",
+    "yell hello",
+    "tell 1 hi",
+    "noop",
+    "nosuch_command",
+    "cat test.html |1+1",
+    "removetag test.html",
+    "number",
+};
+
+/*
+ * Mix of --sessions, every line a pipeline of several processes. The number
+ * pipe is read two lines later, by the last line of the mix.
+ */
+const char *pipeline_mix[] = {
+    "cat test.html | removetag | number | wc -l",
+    "removetag test.html | number |2",
+    "ls | cat | number | wc -c",
+    "cat | number | removetag | wc -l",
+};
+
+/* Mix of the interactive session of --noisy, every line quick when the host is idle */
+const char *interactive_mix[] = {
+    "ls",
+    "printenv PATH",
+    "cat test.html | number",
+    "who",
+    "removetag test.html",
+};
+
+#define MIX_SIZE(mix)   (sizeof(mix) / sizeof(mix[0]))
+
+enum { IN_LINE, LINE_START, PROMPT_HALF };   // Prompt scanner states
+
+typedef struct client_result {
+    vector<long> latency_ns;
+    bool failed;
+} ClientResult;
+
+/* Start barrier, the clients block instead of spinning so thousands fit one CPU */
+mutex start_mutex;
+condition_variable ready_cond;      // Main waits for every login
+condition_variable start_cond;      // Clients wait for the clock
+int ready_clients = 0;
+bool start_flag = false;
+long line_gap_ns = 0;               // Pace of the mix clients, 0 sends each line at the prompt
+
+void client_ready(bool is_wait) {
+    unique_lock<mutex> lock(start_mutex);
+
+    ++ready_clients;
+    ready_cond.notify_one();
+    if (is_wait) {
+        start_cond.wait(lock, [] { return start_flag; });
+    }
+}
+
+bool bind_source(int sock, int family, const char *source) {
+    // Another loopback address is another client for the per-address limits
+    struct addrinfo hints, *res;
+    bool ok;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(source, NULL, &hints, &res) != 0) {
+        return false;
+    }
+    ok = (bind(sock, res->ai_addr, res->ai_addrlen) == 0);
+    freeaddrinfo(res);
+
+    return ok;
+}
+
+int connect_server(const char *host, const char *port, const char *source = NULL) {
+    struct addrinfo hints, *res, *rp;
+    int sock = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        return -1;
+    }
+    for (rp = res; rp != NULL; rp = rp->ai_next) {
+        sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (sock < 0) continue;
+        if ((source == NULL || bind_source(sock, rp->ai_family, source)) &&
+            connect(sock, rp->ai_addr, rp->ai_addrlen) == 0) break;
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(res);
+
+    if (sock >= 0) {
+        struct timeval tv = {LOADGEN_TIMEOUT, 0};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+    return sock;
+}
+
+bool wait_prompt(int sock, long count = 1) {
+    /*
+     * Read until count prompts have started a line. Messages of other users
+     * may arrive in the same read right after the last one, so it is not
+     * always at the end.
+     */
+    char buf[LOADGEN_BUF_SIZE];
+    int state = LINE_START;
+
+    while (1) {
+        // Ack at once, a delayed ack would hold back the servers' small writes
+        int quickack = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &quickack, sizeof(quickack));
+
+        ssize_t n = read(sock, buf, sizeof(buf));
+
+        if (n <= 0) {
+            return false;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            if (state == PROMPT_HALF && buf[i] == ' ') {
+                if (--count == 0) return true;
+                state = LINE_START;
+                continue;
+            }
+            if (buf[i] == '\n') {
+                state = LINE_START;
+            } else {
+                state = (state == LINE_START && buf[i] == '%') ? PROMPT_HALF : IN_LINE;
+            }
+        }
+    }
+}
+
+void wait_until(long start, long offset_ns, double speed) {
+    if (speed <= 0) return;
+
+    long target = start + (long)(offset_ns / speed);
+    long now;
+    while ((now = trace_space::now_ns()) < target) {
+        usleep(min((target - now) / 1000 + 1, (long)LOADGEN_MAX_SLEEP_US));
+    }
+}
+
+void run_client(const char *host, const char *port, int lines, const char **mix, size_t mix_size,
+                ClientResult *result) {
+    int sock = connect_server(host, port);
+
+    result->failed = true;
+    if (sock < 0 || !wait_prompt(sock)) {
+        perror("Login");
+        client_ready(false);
+        if (sock >= 0) close(sock);
+        return;
+    }
+
+    // Every client is logged in before the clock starts
+    client_ready(true);
+
+    result->latency_ns.reserve(lines);
+    long first = trace_space::now_ns();
+    for (int i = 0; i < lines; i++) {
+        string line = string(mix[i % mix_size]) + "\n";
+
+        wait_until(first, i * line_gap_ns, line_gap_ns > 0 ? 1.0 : 0);
+        long start = trace_space::now_ns();
+
+        if (write(sock, line.c_str(), line.length()) < 0 || !wait_prompt(sock)) {
+            perror(mix[i % mix_size]);
+            close(sock);
+            return;
+        }
+        result->latency_ns.push_back(trace_space::now_ns() - start);
+    }
+
+    if (write(sock, "exit\n", 5) < 0) {
+        perror("Write exit");
+    }
+    close(sock);
+    result->failed = false;
+}
+
+/* Journal replay */
+/*
+ * Every session of the journal gets a client of its own, which logs in just
+ * before its first line and sends each line at its recorded time, divided
+ * by the speed. A session ends at its exit line, so a uid reused by a later
+ * login is a new client. With speed 0 every client sends as fast as the
+ * server answers.
+ */
+bool is_exit_line(const string &line) {
+    size_t begin = line.find_first_not_of(" \t");
+    return begin != string::npos && line.compare(begin, 4, "exit") == 0
+        && line.find_first_not_of(" \t", begin + 4) == string::npos;
+}
+
+vector<vector<JournalEntry>> split_sessions(vector<JournalEntry> &entries) {
+    // Batches of different threads interleave in the file, time orders them
+    vector<vector<JournalEntry>> sessions;
+    map<int, size_t> open_sessions;     // session id: index in sessions
+
+    stable_sort(entries.begin(), entries.end(), [](const JournalEntry &a, const JournalEntry &b) {
+        return a.time_ns < b.time_ns;
+    });
+    for (auto &entry: entries) {
+        auto iter = open_sessions.find(entry.session);
+
+        if (iter == open_sessions.end()) {
+            iter = open_sessions.emplace(entry.session, sessions.size()).first;
+            sessions.emplace_back();
+        }
+        sessions[iter->second].push_back(entry);
+        if (is_exit_line(entry.line)) {
+            open_sessions.erase(iter);
+        }
+    }
+    return sessions;
+}
+
+void run_replay(const char *host, const char *port, vector<JournalEntry> *lines,
+                long first_ns, long start, double speed, ClientResult *result) {
+    bool is_exited = false;
+
+    result->failed = true;
+    wait_until(start, lines->front().time_ns - first_ns, speed);
+
+    int sock = connect_server(host, port);
+    if (sock < 0 || !wait_prompt(sock)) {
+        perror("Login");
+        if (sock >= 0) close(sock);
+        return;
+    }
+
+    result->latency_ns.reserve(lines->size());
+    for (auto &entry: *lines) {
+        string line = entry.line + "\n";
+
+        wait_until(start, entry.time_ns - first_ns, speed);
+        long sent = trace_space::now_ns();
+        if (write(sock, line.c_str(), line.length()) < 0) {
+            perror(entry.line.c_str());
+            close(sock);
+            return;
+        }
+        if (is_exit_line(entry.line)) {
+            is_exited = true;
+            break;
+        }
+        if (!wait_prompt(sock)) {
+            perror(entry.line.c_str());
+            close(sock);
+            return;
+        }
+        result->latency_ns.push_back(trace_space::now_ns() - sent);
+    }
+
+    if (!is_exited && write(sock, "exit\n", 5) < 0) {
+        perror("Write exit");
+    }
+    close(sock);
+    result->failed = false;
+}
+
+/* Batch */
+/*
+ * The mix as one script of np_single_proc's batch builtin, against the same
+ * lines typed one by one on another session. Both wait for every prompt,
+ * the batch sends one more after its end line.
+ */
+double run_script(const char *host, const char *port, int lines, bool is_batch) {
+    size_t mix_size = MIX_SIZE(command_mix);
+    int sock = connect_server(host, port);
+    string script = is_batch ? "batch\n" : "";
+    long start;
+
+    if (sock < 0 || !wait_prompt(sock)) {
+        perror("Login");
+        exit(1);
+    }
+
+    start = trace_space::now_ns();
+    for (int i = 0; i < lines; i++) {
+        string line = string(command_mix[i % mix_size]) + "\n";
+
+        if (is_batch) {
+            script += line;
+            continue;
+        }
+        if (write(sock, line.c_str(), line.length()) < 0 || !wait_prompt(sock)) {
+            perror(command_mix[i % mix_size]);
+            exit(1);
+        }
+    }
+    if (is_batch) {
+        script += "end\n";
+        if (write(sock, script.c_str(), script.length()) != (ssize_t)script.length() ||
+            !wait_prompt(sock, lines + 1)) {
+            perror("Batch");
+            exit(1);
+        }
+    }
+    double elapsed = (trace_space::now_ns() - start) / 1e9;
+
+    if (write(sock, "exit\n", 5) < 0) {
+        perror("Write exit");
+    }
+    close(sock);
+    return elapsed;
+}
+
+/* Yell fan-out */
+/*
+ * Listeners log in one by one and then only read. The first of them yells
+ * at a fixed rate, every yell carrying its send time, so each delivery is
+ * timed when a listener reads it, the yeller's own copy included. One
+ * thread polls every listener, as the server must write to every one.
+ */
+typedef struct listener {
+    int sock;
+    string partial;     // Line not complete yet
+} Listener;
+
+bool read_yells(Listener &listener, vector<long> &latency_ns) {
+    char buf[LOADGEN_BUF_SIZE];
+    ssize_t n = read(listener.sock, buf, sizeof(buf));
+    long now = trace_space::now_ns();
+    size_t begin = 0, end;
+
+    if (n <= 0) {
+        return false;
+    }
+    listener.partial.append(buf, n);
+    while ((end = listener.partial.find('\n', begin)) != string::npos) {
+        size_t mark = listener.partial.find(LOADGEN_YELL_MARK, begin);
+
+        if (mark < end) {
+            latency_ns.push_back(now - atol(listener.partial.c_str() + mark + strlen(LOADGEN_YELL_MARK)));
+        }
+        begin = end + 1;
+    }
+    listener.partial.erase(0, begin);
+    return true;
+}
+
+int run_yells(const char *host, const char *port, int users, int rate, int seconds) {
+    vector<Listener> listeners;
+    vector<struct pollfd> pfds;
+    vector<long> latency_ns;
+    long yells = (long)rate * seconds;
+    atomic<bool> is_yelled(false);
+
+    for (int i = 0; i < users; i++) {
+        int sock = connect_server(host, port);
+
+        if (sock < 0 || !wait_prompt(sock)) {
+            perror("Login");
+            exit(1);
+        }
+        listeners.push_back(Listener{sock, ""});
+        pfds.push_back(pollfd{sock, POLLIN, 0});
+    }
+    latency_ns.reserve(yells * users);
+
+    long start = trace_space::now_ns();
+    thread yeller([&]() {
+        for (long i = 0; i < yells; i++) {
+            wait_until(start, i * 1000000000L / rate, 1.0);
+            string line = "yell loadgen " + to_string(trace_space::now_ns()) + "\n";
+
+            if (write(listeners[0].sock, line.c_str(), line.length()) < 0) {
+                perror("Yell");
+                break;
+            }
+        }
+        is_yelled = true;
+    });
+
+    long deadline = 0;
+    while ((long)latency_ns.size() < yells * users) {
+        if (is_yelled && deadline == 0) {
+            deadline = trace_space::now_ns() + LOADGEN_YELL_DRAIN * 1000000000L;
+        }
+        if (deadline > 0 && trace_space::now_ns() > deadline) {
+            break;
+        }
+        if (poll(pfds.data(), pfds.size(), 100) < 0) {
+            perror("Poll");
+            break;
+        }
+        for (size_t i = 0; i < pfds.size(); i++) {
+            if (pfds[i].revents && !read_yells(listeners[i], latency_ns)) {
+                pfds[i].fd = -1;    // Logged out by the server
+            }
+        }
+    }
+    double elapsed = (trace_space::now_ns() - start) / 1e9;
+
+    yeller.join();
+    for (auto &listener: listeners) {
+        close(listener.sock);
+    }
+    if (latency_ns.empty()) {
+        cout << "No yell delivered" << endl;
+        return 1;
+    }
+    sort(latency_ns.begin(), latency_ns.end());
+    printf("%ld yells at %d/s to %d users, %zu of %ld deliveries in %.2f s, p50 %ld us, p99 %ld us, max %ld us\n",
+           yells, rate, users, latency_ns.size(), yells * users, elapsed,
+           latency_ns[latency_ns.size() / 2] / 1000,
+           latency_ns[latency_ns.size() * 99 / 100] / 1000,
+           latency_ns.back() / 1000);
+
+    return ((long)latency_ns.size() == yells * users) ? 0 : 1;
+}
+
+void dump_journal(vector<JournalEntry> &entries) {
+    long first_ns = entries.empty() ? 0 : entries.front().time_ns;
+
+    for (auto &entry: entries) {
+        printf("%10.3f s  session %-6d status %-4d %8ld us  %s\n",
+               (entry.time_ns - first_ns) / 1e9, entry.session, entry.status,
+               entry.duration_ns / 1000, entry.line.c_str());
+    }
+}
+
+int report(vector<ClientResult> &results, double elapsed) {
+    vector<long> latency_ns;
+    int failed = 0;
+
+    for (auto &r: results) {
+        if (r.failed) ++failed;
+        latency_ns.insert(latency_ns.end(), r.latency_ns.begin(), r.latency_ns.end());
+    }
+    sort(latency_ns.begin(), latency_ns.end());
+
+    if (latency_ns.empty()) {
+        cout << "No line completed, " << failed << " clients failed" << endl;
+        exit(1);
+    }
+    printf("%zu lines in %.2f s, %.1f lines/s, p50 %ld us, p99 %ld us, %d clients failed\n",
+           latency_ns.size(), elapsed, latency_ns.size() / elapsed,
+           latency_ns[latency_ns.size() / 2] / 1000,
+           latency_ns[latency_ns.size() * 99 / 100] / 1000,
+           failed);
+
+    return failed ? 1 : 0;
+}
+
+int run_clients(const char *host, const char *port, int clients, int lines, const char **mix, size_t mix_size) {
+    vector<ClientResult> results(clients);
+    vector<thread> threads;
+    long start;
+
+    {
+        lock_guard<mutex> lock(start_mutex);
+
+        ready_clients = 0;
+        start_flag = false;
+    }
+    for (int cid = 0; cid < clients; cid++) {
+        threads.emplace_back(run_client, host, port, lines, mix, mix_size, &results[cid]);
+    }
+    {
+        unique_lock<mutex> lock(start_mutex);
+
+        ready_cond.wait(lock, [clients] { return ready_clients == clients; });
+        start = trace_space::now_ns();
+        start_flag = true;
+    }
+    start_cond.notify_all();
+    for (auto &t: threads) {
+        t.join();
+    }
+    return report(results, (trace_space::now_ns() - start) / 1e9);
+}
+
+/* Neighbors */
+/*
+ * One session runs the interactive mix alone, then again next to sessions
+ * that load the server, until it is done. The server should keep the
+ * second latency close to the first.
+ */
+atomic<bool> is_quiet(false);
+
+typedef void (*Neighbor)(const char *host, const char *port, int id, atomic<long> *requests);
+
+void run_noisy(const char *host, const char *port, int id, atomic<long> *pipelines) {
+    // Repeats LOADGEN_NOISY_LINE, limited per session by the server
+    int sock = connect_server(host, port);
+    string line = string(LOADGEN_NOISY_LINE) + "\n";
+
+    if (sock < 0 || !wait_prompt(sock)) {
+        perror("Login");
+        if (sock >= 0) close(sock);
+        return;
+    }
+    while (!is_quiet) {
+        if (write(sock, line.c_str(), line.length()) < 0 || !wait_prompt(sock)) {
+            perror(LOADGEN_NOISY_LINE);
+            close(sock);
+            return;
+        }
+        ++*pipelines;
+    }
+
+    if (write(sock, "exit\n", 5) < 0) {
+        perror("Write exit");
+    }
+    close(sock);
+}
+
+void run_flood(const char *host, const char *port, int id, atomic<long> *requests) {
+    /*
+     * From LOADGEN_FLOOD_SOURCE, so the legitimate session keeps its own
+     * login bucket. Even attackers connect and hang up as fast as they can,
+     * odd ones log in and write commands and yells without waiting for the
+     * prompt, reading only to keep the socket open.
+     */
+    char buf[LOADGEN_BUF_SIZE];
+    string burst;
+    int sock = -1;
+
+    if (id % 2 == 0) {
+        while (!is_quiet) {
+            if ((sock = connect_server(host, port, LOADGEN_FLOOD_SOURCE)) >= 0) {
+                close(sock);
+                ++*requests;
+            }
+        }
+        return;
+    }
+
+    // The login flood shares the address, so retry until admitted
+    while (!is_quiet && (sock < 0 || !wait_prompt(sock))) {
+        if (sock >= 0) close(sock);
+        usleep(LOADGEN_FLOOD_RETRY_US);
+        sock = connect_server(host, port, LOADGEN_FLOOD_SOURCE);
+    }
+    for (int i = 0; i < LOADGEN_FLOOD_BURST; i++) {
+        burst += (i % 2) ? "ls\n" : "yell flood flood flood flood flood flood flood flood\n";
+    }
+
+    // Never blocked in a write, a server writing back to this session would wait on it
+    struct pollfd pfd = {sock, POLLIN | POLLOUT, 0};
+    while (!is_quiet && sock >= 0 && poll(&pfd, 1, 100) >= 0) {
+        if (pfd.revents & (POLLERR | POLLHUP)) {
+            break;
+        }
+        if ((pfd.revents & POLLIN) && recv(sock, buf, sizeof(buf), MSG_DONTWAIT) == 0) {
+            break;
+        }
+        if (pfd.revents & POLLOUT) {
+            // A line cut by a short write is one more unknown command
+            ssize_t n = send(sock, burst.c_str(), burst.length(), MSG_DONTWAIT);
+
+            if (n > 0) *requests += count(burst.begin(), burst.begin() + n, '\n');
+        }
+    }
+    if (sock >= 0) close(sock);
+}
+
+int run_neighbors(const char *host, const char *port, int neighbors, int lines, Neighbor neighbor, const char *name) {
+    vector<thread> threads;
+    atomic<long> requests(0);
+    string label = "with " + to_string(neighbors) + " " + name;
+    int failed;
+
+    printf("%-16s", "alone");
+    fflush(stdout);
+    failed = run_clients(host, port, 1, lines, interactive_mix, MIX_SIZE(interactive_mix));
+
+    for (int i = 0; i < neighbors; i++) {
+        threads.emplace_back(neighbor, host, port, i, &requests);
+    }
+    usleep(LOADGEN_NOISY_WARMUP_US);
+    printf("%-16s", label.c_str());
+    fflush(stdout);
+    failed |= run_clients(host, port, 1, lines, interactive_mix, MIX_SIZE(interactive_mix));
+
+    // Each neighbor stops after its current request
+    is_quiet = true;
+    for (auto &t: threads) {
+        t.join();
+    }
+    printf("%ld %s requests\n", requests.load(), name);
+
+    return failed;
+}
+
+int main(int argc, char const *argv[]) {
+    bool is_dump   = (argc == 3 && strcmp(argv[1], "--dump") == 0);
+    bool is_replay = ((argc == 5 || argc == 6) && strcmp(argv[3], "--replay") == 0);
+    bool is_batch  = ((argc == 4 || argc == 5) && strcmp(argv[3], "--batch") == 0);
+    bool is_sessions = ((argc == 5 || argc == 6) && strcmp(argv[3], "--sessions") == 0);
+    bool is_yells  = ((argc >= 5 && argc <= 7) && strcmp(argv[3], "--yells") == 0);
+    bool is_noisy  = ((argc == 5 || argc == 6) && strcmp(argv[3], "--noisy") == 0);
+    bool is_flood  = ((argc == 5 || argc == 6) && strcmp(argv[3], "--flood") == 0);
+
+    if (!is_dump && !is_replay && !is_batch && !is_sessions && !is_yells && !is_noisy && !is_flood &&
+        (argc < 3 || argc > 5)) {
+        cout << "Usage: prog host port [clients] [lines]" << endl
+             << "       prog host port --replay journal [speed]" << endl
+             << "       prog host port --batch [lines]" << endl
+             << "       prog host port --sessions clients [lines]" << endl
+             << "       prog host port --yells users [rate] [seconds]" << endl
+             << "       prog host port --noisy sessions [lines]" << endl
+             << "       prog 127.0.0.1 port --flood attackers [lines]" << endl
+             << "       prog --dump journal" << endl;
+        exit(0);
+    }
+
+    if (is_batch) {
+        int lines = (argc == 5) ? atoi(argv[4]) : LOADGEN_BATCH_LINES;
+        double typed = run_script(argv[1], argv[2], lines, false);
+        double batch = run_script(argv[1], argv[2], lines, true);
+
+        printf("%d lines typed in %.2f s, as a batch in %.2f s, %.1fx\n", lines, typed, batch, typed / batch);
+        return 0;
+    }
+
+    struct rlimit nofile;
+
+    // A session the server drops fails on its own, it must not end the run
+    signal(SIGPIPE, SIG_IGN);
+
+    // A socket per client
+    getrlimit(RLIMIT_NOFILE, &nofile);
+    nofile.rlim_cur = nofile.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &nofile);
+
+    if (is_yells) {
+        // e.g. 1000 users against a server built with -DUSER_LIMIT=1000 and NP_RATELIMIT=off
+        int users = atoi(argv[4]);
+        int rate = (argc > 5) ? atoi(argv[5]) : LOADGEN_YELL_RATE;
+        int seconds = (argc > 6) ? atoi(argv[6]) : LOADGEN_YELL_SECONDS;
+
+        if (users <= 0 || rate <= 0 || seconds <= 0) {
+            cout << "Users, rate and seconds must be positive" << endl;
+            exit(1);
+        }
+        return run_yells(argv[1], argv[2], users, rate, seconds);
+    }
+
+    if (is_noisy) {
+        int lines = (argc == 6) ? atoi(argv[5]) : LOADGEN_NOISY_LINES;
+
+        return run_neighbors(argv[1], argv[2], atoi(argv[4]), lines, run_noisy, "noisy");
+    }
+
+    if (is_flood) {
+        // The legitimate session paced below the command limit, the server keeps its limits on
+        int lines = (argc == 6) ? atoi(argv[5]) : LOADGEN_FLOOD_LINES;
+
+        line_gap_ns = 1000000000L / LOADGEN_FLOOD_RATE;
+        return run_neighbors(argv[1], argv[2], atoi(argv[4]), lines, run_flood, "flood");
+    }
+
+    vector<ClientResult> results;
+    vector<thread> threads;
+    long start;
+
+    if (is_dump || is_replay) {
+        vector<JournalEntry> entries;
+        uint64_t dropped = 0;
+        const char *path = is_dump ? argv[2] : argv[4];
+
+        if (!journal_space::load(path, entries, &dropped)) {
+            cerr << "Not a journal: " << path << endl;
+            exit(1);
+        }
+        if (dropped > 0) {
+            cerr << dropped << " records were dropped by a full journal" << endl;
+        }
+        if (is_dump) {
+            sort(entries.begin(), entries.end(), [](const JournalEntry &a, const JournalEntry &b) {
+                return a.time_ns < b.time_ns;
+            });
+            dump_journal(entries);
+            return 0;
+        }
+        if (entries.empty()) {
+            cout << "Empty journal" << endl;
+            exit(1);
+        }
+
+        double speed = (argc == 6) ? atof(argv[5]) : 1.0;
+        vector<vector<JournalEntry>> sessions = split_sessions(entries);
+        long first_ns = sessions.front().front().time_ns;
+
+        results.resize(sessions.size());
+        start = trace_space::now_ns();
+        for (size_t sid = 0; sid < sessions.size(); sid++) {
+            threads.emplace_back(run_replay, argv[1], argv[2], &sessions[sid], first_ns, start, speed, &results[sid]);
+        }
+        for (auto &t: threads) {
+            t.join();
+        }
+        return report(results, (trace_space::now_ns() - start) / 1e9);
+    }
+
+    // --sessions runs the pipeline mix, e.g. 5000 against np_single_proc built with -DUSER_LIMIT=5000
+    const char **mix = is_sessions ? pipeline_mix : command_mix;
+    size_t mix_size = is_sessions ? MIX_SIZE(pipeline_mix) : MIX_SIZE(command_mix);
+    int arg = is_sessions ? 4 : 3;
+    int clients = (argc > arg) ? atoi(argv[arg]) : LOADGEN_CLIENTS;
+    int lines = (argc > arg + 1) ? atoi(argv[arg + 1]) : LOADGEN_LINES;
+
+    return run_clients(argv[1], argv[2], clients, lines, mix, mix_size);
+}
@@ -1,26 +1,44 @@
 #include "np_multi_proc.h"
 
 int main(int argc,char const *argv[]) {
-    if (argc != 2) {
-        cout << "Usage: prog port" << endl;
+    bool is_threads = (argc == 3 || argc == 4) && strcmp(argv[2], "--threads") == 0;
+
+    if (argc != 2 && !is_threads) {
+        cout << "Usage: prog port [--threads [workers]]" << endl;
         exit(0);
     }
 
+    trace_space::init();
+    limit_space::init();
+    redirect_space::init();
+    rate_space::init();
+    journal_space::init();
+
+    if (is_threads) {
+        // Thread-per-core model, see np_thread_pool.h
+        int workers = (argc == 4) ? atoi(argv[3]) : thread::hardware_concurrency();
+        thread_space::serve(argv[1], workers);
+    }
+
     /* Initialize shared memory */
     init_shm();
     init_lock();
+    init_user_pipe_dir();
 
     /* Setup server signal handler */
     signal(SIGCHLD, signal_server_handler);
     signal(SIGINT, signal_server_handler);
     signal(SIGQUIT, signal_server_handler);
     signal(SIGTERM, signal_server_handler);
-    // signal(SIGUSR2, signal_server_handler);
+
+    // Without SA_RESTART, so accept returns to print the reports
+    struct sigaction report_action = {};
+    report_action.sa_handler = signal_server_handler;
+    sigaction(TRACE_SIGNAL, &report_action, NULL);
 
     /* Variables */
-    struct sockaddr_in c_addr;
+    struct sockaddr_storage c_addr;
     int client_sock, c_addr_len;
-    int status_code;
 
     // Initilize variables
     bzero((char *)&c_addr, sizeof(c_addr));
@@ -28,12 +46,27 @@ int main(int argc,char const *argv[]) {
     listen_sock = get_listen_socket(argv[1]);
 
     while (true) {
+        c_addr_len = sizeof(c_addr);
         client_sock = accept(listen_sock, (struct sockaddr *) &c_addr, (socklen_t *) &c_addr_len);
+        if (client_sock < 0 && errno == EINTR) {
+            if (report_requested) {
+                report_requested = 0;
+                report_lock_stats();
+                report_shm_usage();
+                rate_space::report();
+            }
+            continue;
+        }
         if (client_sock < 0) {
             perror("Sever accept");
             exit(0);
         }
 
+        if (!rate_space::admit_login(c_addr)) {
+            // Rejected before forking
+            close(client_sock);
+            continue;
+        }
         if (is_user_up_to_limit()) {
             cerr << "Online users are up to limit (" << USER_LIMIT << ")" << endl;
             close(client_sock);
@@ -43,15 +76,20 @@ int main(int argc,char const *argv[]) {
 
         if (pid > 0) {
             /* Parent */
+            ++online_users;
             close(client_sock);
         } else if (pid == 0) {
             /* Child */
             // Setup signal handler
             signal(SIGUSR1, signal_child_handler);
             // signal(SIGUSR2, signal_child_handler);
-            signal(SIGINT, signal_child_handler);
-            signal(SIGQUIT, signal_child_handler);
-            signal(SIGTERM, signal_child_handler);
+            // Without SA_RESTART, so a waiting read returns to log the user out
+            struct sigaction exit_action = {};
+            exit_action.sa_handler = signal_child_handler;
+            sigaction(SIGINT, &exit_action, NULL);
+            sigaction(SIGQUIT, &exit_action, NULL);
+            sigaction(SIGTERM, &exit_action, NULL);
+            signal(TRACE_SIGNAL, trace_space::dump);
             // Create user
             int uid = create_user(client_sock, c_addr);
             // dup2(client_sock, STDIN_FILENO);
@@ -5,9 +5,11 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/syscall.h>
-#include <sys/ipc.h>
-#include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 #include <sys/stat.h>
+#include <poll.h>
+#include <dirent.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <strings.h>
@@ -25,6 +27,19 @@
 #include <pthread.h>
 #include <regex>
 
+#include "np_core.h"
+#include "np_trace.h"
+#include "np_limits.h"
+#include "np_number_pipe.h"
+#include "np_redirect.h"
+#include "np_builtin.h"
+#include "np_ratelimit.h"
+#include "np_telnet.h"
+#include "np_compress.h"
+#include "np_journal.h"
+#include "np_format.h"
+#include "np_thread_pool.h"
+
 using namespace std;
 
 #define MAX_BUF_SIZE    15000
@@ -33,40 +48,30 @@ using namespace std;
 #define BUILT_IN_EXIT   99
 #define BUILT_IN_TRUE   1
 #define BUILT_IN_FALSE  0
+#ifndef USER_LIMIT
 #define USER_LIMIT      30
-#define FIFO_LIMIT      USER_LIMIT * USER_LIMIT
-#define USERSHMKEY  ((key_t) 6650)
-#define MSGSHMKEY   ((key_t) 6651)
-#define FIFOSHMKEY  ((key_t) 6652)
-#define USER_PIPE_DIR   "user_pipe/"
+#endif
+#define FIFO_CHUNK      64              // User pipe records taken from the arena at once
+#define SHM_NAME        "np_multi_proc"
+#define SHM_RESERVE     (1UL << 36)     // Virtual space reserved for the arena
+#define SHM_ALIGN       64              // Cache line
+#define SHM_PAGE        4096UL
+#define SHM_HUGE_PAGE   (2UL << 20)
+#define USER_PIPE_DIR   "user_pipe/"     // FIFOs under <server pid>/
 #define BF_NORMAL       0
 #define BF_USER_EXIT    1
-
-typedef struct mypipe {
-    int in;
-    int out;
-} Pipe;
-
-typedef struct my_number_pipe {
-    int in;
-    int out;
-    int number;
-} NumberPipe;
-
-typedef struct my_command {
-    string cmd;           // Cut by number|error pipe
-    vector<string> cmds;  // Split by pipe
-    int number;           // For number pipe
-    int in_fd, out_fd;    // For user pipe
-} Command;
+#define NAME_SIZE       32
+#define USER_ROW_SIZE   128     // uid, name and ip_addr with tabs
 
 typedef struct my_user {
     int uid;
     int sockfd;
     pid_t pid;
     bool is_active;
-    char name[32];
-    char ip_addr[INET6_ADDRSTRLEN];
+    char name[NAME_SIZE];
+    char ip_addr[FORMAT_ADDR_SIZE];     // ip:port or [ip]:port
+    char row[USER_ROW_SIZE];            // Of who, see np_format.h
+    int row_len;
 } User;
 
 typedef struct my_message {
@@ -83,36 +88,115 @@ typedef struct my_fifo_info {
     int dst_uid;
     char pathname[PATHLENGTH];
     bool is_active;
+    struct my_fifo_info *next;  // In the list of its source, or the free list
 } FifoInfo;
 
+/*
+ * User pipes by source, only the pipes in flight hold a record. Records come
+ * from the arena FIFO_CHUNK at a time and are recycled through the free
+ * list, so the footprint follows the pipes open at once instead of
+ * USER_LIMIT squared. The mapping is inherited, so pointers are the same
+ * in every user process.
+ */
+typedef struct fifo_table {
+    FifoInfo *head[USER_LIMIT];     // By source uid, under its fifo lock
+    FifoInfo *free_list;            // Under the arena lock
+    size_t records;                 // Taken from the arena so far
+} FifoTable;
+
+/*
+ * Shared memory arena
+ *
+ * One memfd is mapped MAP_SHARED before any fork, so every user process
+ * sees the same pages and nothing outlives the server. The whole
+ * SHM_RESERVE range is mapped up front and the memfd is grown with
+ * ftruncate when an allocation needs more room, so pointers handed out
+ * earlier stay valid. The header lives at the start of the arena.
+ */
+typedef struct shm_arena_header {
+    size_t committed;   // Current memfd size
+    size_t used;        // Bump pointer
+    size_t page_size;   // Growth granularity
+    bool is_huge;       // Backed by MFD_HUGETLB
+} ShmArenaHeader;
+
+/*
+ * Robust process-shared lock with contention counters
+ *
+ * Locks live in the shared arena. If a process dies while holding one, the
+ * next owner gets EOWNERDEAD and marks the mutex consistent again instead
+ * of deadlocking every user. The counters are only updated by the owner.
+ */
+typedef struct shm_lock {
+    pthread_mutex_t mutex;
+    unsigned long acquired;
+    unsigned long contended;
+    unsigned long wait_ns;
+    unsigned long recovered;    // Taken over from a dead owner
+} ShmLock;
+
+typedef struct shm_locks {
+    ShmLock user[USER_LIMIT];   // Per user slot
+    ShmLock msg;                // The broadcast message slot
+    ShmLock fifo[USER_LIMIT];   // Per user pipe list, by source uid
+    ShmLock arena;              // Bump pointer and the free list of user pipe records
+} ShmLocks;
+
 typedef struct user_context {
     string original_input;
+    long start_ns = 0;      // When original_input was read
+    int status = JOURNAL_NO_STATUS;     // Of the last waited process, see np_journal.h
     map<string, string> env;
     vector<Pipe> pipes;
-    vector<NumberPipe> number_pipes;
+    NumberPipeWheel number_pipes;
+    vector<int> sync_fds;   // Redirected outputs to fdatasync, see np_redirect.h
 } Context;
 
 /* Global Value */
-int user_shm_id, msg_shm_id, fifo_shm_id;
+int shm_fd;
+char *shm_base;
+ShmArenaHeader *shm_header;
 User *user_shm_ptr;
 Message *msg_shm_ptr;
-FifoInfo *fifo_shm_ptr;
+FifoTable *fifo_shm_ptr;
 int listen_sock;
-pthread_mutex_t user_mutex, msg_mutex, fifo_mutex;
+ShmLocks *lock_shm_ptr;
+pid_t server_pid;
 regex up_in_pattern("[<][1-9]\\d?\\d?\\d?[0]?");
 regex up_out_pattern("[>][1-9]\\d?\\d?\\d?[0]?");
 bool user_can_leave = false;
+string session_cgroup;      // cgroup of this user process, see np_limits.h
+atomic<int> online_users(0);      // Server only, forked and not yet reaped
+volatile sig_atomic_t report_requested = 0;     // Server only, set by TRACE_SIGNAL
+volatile sig_atomic_t exit_requested = 0;       // User process only, left from read_msg
+TokenBucket command_bucket = {};            // User process only
+TokenBucket msg_bucket = {};
+TelnetState telnet;         // User process only, see np_telnet.h
+string inbuf;               // Received bytes not yet cut into lines
+int client_in = -1;         // The client socket once sockfd is np_compress.h
+char user_pipe_dir[PATHLENGTH / 2]; // This server's directory of FIFOs, leaves room for "<src>to<dst>"
 
 /* Function Prototype */;
 // Initialize resource
+bool arena_grow(size_t size);
+void *arena_alloc(size_t size);
+FifoInfo *fifo_alloc();
+void fifo_free(FifoInfo *fifo);
 void init_shm();
+void init_user_pipe_dir();
+void remove_user_pipe_dir(const char *path);
 void init_lock();
+void shm_lock(ShmLock *lock);
+void shm_unlock(ShmLock *lock);
+void msg_lock(sigset_t *saved);
+void msg_unlock(sigset_t *saved);
+void report_lock_stats();
+void report_shm_usage();
 
 // Server releated functions
 void server_exit_procedure();
 void signal_server_handler(int sig);
 bool is_user_up_to_limit();
-int get_listen_socket(const char *port);
 int get_online_user_number();
 int get_sockfd_by_pid(pid_t pid);
 int get_uid_by_pid(pid_t pid);
@@ -120,7 +204,7 @@ bool has_user(int target_uid);
 void debug_user();
 
 // User releated functions
-int create_user(int sock, sockaddr_in addr);
+int create_user(int sock, const sockaddr_storage &addr);
 void user_exit_procedure(int uid);
 void signal_child_handler(int sig);
 
@@ -134,22 +218,22 @@ void login_prompt(int uid);
 void logout_prompt(int uid);
 void command_prompt(int uid);
 void welcome(int uid);
+bool admit_msg(int uid, string &msg);
 void tell(int uid, int tid, string msg);
 void yell(int uid, string msg);
 void name_cmd(int uid, string name);
+void my_compress(int uid);
 int handle_builtin(int uid, string cmd, Context *context);
 
 // Pipe related
-bool is_white_char(string cmd);
-void decrement_number_pipes(vector<NumberPipe> &number_pipes);
-vector<string> parse_normal_pipe(string input);
-vector<Command> parse_number_pipe(string input);
+void release_user_pipe(FifoInfo *fifo);
 void clean_user_pipe(int uid);
-int create_user_pipe(int src_uid, int dst_uid);
-int search_user_pipe(int src_uid, int dst_uid);
-bool handle_input_user_pipe(int uid, string cmd, int *up_idx, Context *context);
-bool handle_output_user_pipe(int uid, string cmd, int *up_idx, Context *context);
-void handle_user_pipe(int uid, string cmd, bool *in, bool *out, bool *in_err, bool *out_err, int *in_idx, int *out_idx, Context *context);
+FifoInfo *find_user_pipe(int src_uid, int dst_uid);
+FifoInfo *create_user_pipe(int src_uid, int dst_uid);
+FifoInfo *search_user_pipe(int src_uid, int dst_uid);
+bool handle_input_user_pipe(int uid, string cmd, FifoInfo **up, Context *context);
+bool handle_output_user_pipe(int uid, string cmd, FifoInfo **up, Context *context);
+void handle_user_pipe(int uid, string cmd, bool *in, bool *out, bool *in_err, bool *out_err, FifoInfo **in_up, FifoInfo **out_up, Context *context);
 int handle_command(int uid, string input, Context *context);
 
 // Executor
@@ -159,23 +243,103 @@ int run_shell(int uid, string input, Context *context);
 void serve_client(int uid);
 /* Function Prototype End */
 
+bool arena_grow(size_t size) {
+    size_t committed = (size + shm_header->page_size - 1) / shm_header->page_size * shm_header->page_size;
+
+    if (committed > SHM_RESERVE) {
+        cerr << "Shared memory arena exhausted (" << size << " bytes)" << endl;
+        return false;
+    }
+    if (ftruncate(shm_fd, committed) < 0) {
+        perror("Grow shm");
+        return false;
+    }
+    // Huge pages are not overcommitted, reserve them now instead of SIGBUS later
+    if (shm_header->is_huge && fallocate(shm_fd, 0, 0, committed) < 0) {
+        perror("Reserve huge pages");
+        return false;
+    }
+    shm_header->committed = committed;
+
+    return true;
+}
+
+void *arena_alloc(size_t size) {
+    // Invoked by the server before fork, then by user processes under the arena lock
+    size_t offset = (shm_header->used + SHM_ALIGN - 1) / SHM_ALIGN * SHM_ALIGN;
+
+    if (offset + size > shm_header->committed && !arena_grow(offset + size)) {
+        return NULL;
+    }
+    // Bump allocation never reuses memory, fresh memfd pages are already zero
+    shm_header->used = offset + size;
+
+    return shm_base + offset;
+}
+
 void init_shm() {
-    void *tmp_ptr;
+    struct timeval start, end;
+    size_t need = sizeof(ShmArenaHeader) + sizeof(User) * USER_LIMIT
+                + sizeof(Message) + sizeof(FifoTable);
+    size_t page_size = SHM_PAGE;
+    size_t committed = SHM_PAGE;
+    bool is_huge = false;
+
+    gettimeofday(&start, NULL);
+
+    // Use huge pages when the arena spans several of them
+    if (need >= 4 * SHM_HUGE_PAGE) {
+        size_t huge_size = (need + SHM_HUGE_PAGE - 1) / SHM_HUGE_PAGE * SHM_HUGE_PAGE;
+
+        shm_fd = memfd_create(SHM_NAME, MFD_CLOEXEC | MFD_HUGETLB);
+        if (shm_fd >= 0 && fallocate(shm_fd, 0, 0, huge_size) == 0) {
+            page_size = SHM_HUGE_PAGE;
+            committed = huge_size;
+            is_huge = true;
+        } else if (shm_fd >= 0) {
+            // No huge pages configured, fall back to normal pages
+            close(shm_fd);
+        }
+    }
+    if (!is_huge) {
+        shm_fd = memfd_create(SHM_NAME, MFD_CLOEXEC);
+    }
+    if (shm_fd < 0) {
+        perror("Create shm");
+        exit(0);
+    }
+    if (!is_huge && ftruncate(shm_fd, committed) < 0) {
+        perror("Size shm");
+        exit(0);
+    }
 
-    // Get user shared memory ID
-    user_shm_id = shmget(USERSHMKEY, sizeof(User) * USER_LIMIT, IPC_CREAT | IPC_EXCL | SHM_R | SHM_W);
-    if (user_shm_id < 0) {
-        perror("Get user shm");
+    // Reserve the whole range, only committed pages are backed
+    shm_base = (char *)mmap(NULL, SHM_RESERVE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, shm_fd, 0);
+    if (shm_base == MAP_FAILED) {
+        perror("Map shm");
         exit(0);
     }
-    // Attach user shared memory
-    tmp_ptr = shmat(user_shm_id, NULL, 0);
-    if (*((int*) tmp_ptr) == -1) {
-        perror("Map user shm");
+    // Not from fstat, mapping a hugetlb memfd extends it to the whole range
+    shm_header = (ShmArenaHeader *)shm_base;
+    shm_header->committed = committed;
+    shm_header->used = sizeof(ShmArenaHeader);
+    shm_header->page_size = page_size;
+    shm_header->is_huge = is_huge;
+
+    // Structured layout: users, message slot, user pipe records
+    user_shm_ptr = static_cast<User *>(arena_alloc(sizeof(User) * USER_LIMIT));
+    msg_shm_ptr  = static_cast<Message *>(arena_alloc(sizeof(Message) * 1));
+    fifo_shm_ptr = static_cast<FifoTable *>(arena_alloc(sizeof(FifoTable)));
+    lock_shm_ptr = static_cast<ShmLocks *>(arena_alloc(sizeof(ShmLocks)));
+    if (!user_shm_ptr || !msg_shm_ptr || !fifo_shm_ptr || !lock_shm_ptr) {
         exit(0);
     }
-    user_shm_ptr = static_cast<User *>(tmp_ptr);
-    bzero((char *)user_shm_ptr, sizeof(User) * USER_LIMIT);
+
+    gettimeofday(&end, NULL);
+    cout << "Shared memory: " << USER_LIMIT << " users, "
+         << shm_header->committed << " bytes committed"
+         << (is_huge ? " (huge pages)" : "") << ", init "
+         << (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec) << " us" << endl;
 
     #if 0
     for(int x=0; x < USER_LIMIT; ++x) {
@@ -185,55 +349,137 @@ void init_shm() {
     }
     #endif
 
-    // Get message shared memory ID
-    msg_shm_id = shmget(MSGSHMKEY, sizeof(Message) * 1, IPC_CREAT | IPC_EXCL | SHM_R | SHM_W);
-    if (msg_shm_id < 0) {
-        perror("Get msg shm");
-        exit(0);
+    return;
+}
+
+void remove_user_pipe_dir(const char *path) {
+    // FIFOs nobody received, then the directory itself
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    char fifo[PATHLENGTH + sizeof(entry->d_name)];
+
+    if (dir == NULL) {
+        return;
     }
-    // Attach message shared memory
-    tmp_ptr = shmat(msg_shm_id, NULL, 0);
-    if (*((int*) tmp_ptr) == -1) {
-        perror("Map msg shm");
-        exit(0);
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(fifo, sizeof(fifo), "%s%s", path, entry->d_name);
+        unlink(fifo);
     }
-    msg_shm_ptr = static_cast<Message *>(tmp_ptr);
-    bzero((char *)msg_shm_ptr, sizeof(Message) * 1);
+    closedir(dir);
+    rmdir(path);
+}
 
-    // Get FIFO shared memory ID
-    fifo_shm_id = shmget(FIFOSHMKEY, sizeof(FifoInfo) * FIFO_LIMIT, IPC_CREAT | IPC_EXCL | SHM_R | SHM_W);
-    if (fifo_shm_id < 0) {
-        perror("Get fifo shm");
-        exit(0);
+void init_user_pipe_dir() {
+    // One directory per server, two servers in the same directory never share a FIFO
+    DIR *dir;
+    struct dirent *entry;
+    char path[PATHLENGTH];
+
+    mkdir(USER_PIPE_DIR, 0777);
+    if ((dir = opendir(USER_PIPE_DIR)) != NULL) {
+        // Left by servers that were killed
+        while ((entry = readdir(dir)) != NULL) {
+            pid_t pid = atoi(entry->d_name);
+
+            if (pid > 0 && kill(pid, 0) < 0 && errno == ESRCH) {
+                snprintf(path, sizeof(path), "%s%d/", USER_PIPE_DIR, pid);
+                remove_user_pipe_dir(path);
+            }
+        }
+        closedir(dir);
     }
-    // Attach fifo shared memory
-    tmp_ptr = shmat(fifo_shm_id, NULL, 0);
-    if (*((int*) tmp_ptr) == -1) {
-        perror("Map fifo shm");
+
+    snprintf(user_pipe_dir, sizeof(user_pipe_dir), "%s%d/", USER_PIPE_DIR, getpid());
+    if (mkdir(user_pipe_dir, 0700) < 0 && errno != EEXIST) {
+        perror("Create user pipe directory");
         exit(0);
     }
-    fifo_shm_ptr = static_cast<FifoInfo *>(tmp_ptr);
-    bzero((char *)fifo_shm_ptr, sizeof(FifoInfo) * FIFO_LIMIT);
-
-    return;
 }
 
 void init_lock() {
-    pthread_mutexattr_t user_mutex_attr;
-    pthread_mutexattr_t msg_mutex_attr;
-    pthread_mutexattr_t fifo_mutex_attr;
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+
+    for (int x=0; x < USER_LIMIT; ++x) {
+        pthread_mutex_init(&lock_shm_ptr->user[x].mutex, &attr);
+        pthread_mutex_init(&lock_shm_ptr->fifo[x].mutex, &attr);
+    }
+    pthread_mutex_init(&lock_shm_ptr->msg.mutex, &attr);
+    pthread_mutex_init(&lock_shm_ptr->arena.mutex, &attr);
+
+    pthread_mutexattr_destroy(&attr);
+    server_pid = getpid();
+}
+
+void shm_lock(ShmLock *lock) {
+    int rc = pthread_mutex_trylock(&lock->mutex);
+
+    if (rc == EBUSY) {
+        // Only time the slow path
+        long start = trace_space::now_ns();
+        rc = pthread_mutex_lock(&lock->mutex);
+        ++lock->contended;
+        lock->wait_ns += trace_space::now_ns() - start;
+    }
+
+    if (rc == EOWNERDEAD) {
+        // Previous owner died inside the critical section
+        pthread_mutex_consistent(&lock->mutex);
+        ++lock->recovered;
+    }
+    ++lock->acquired;
+}
+
+void shm_unlock(ShmLock *lock) {
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+void msg_lock(sigset_t *saved) {
+    // SIGUSR1 takes the slot lock in signal_child_handler, so it waits until this process lets go
+    sigset_t usr1;
 
-    pthread_mutexattr_init(&user_mutex_attr);
-    pthread_mutexattr_setpshared(&user_mutex_attr, PTHREAD_PROCESS_SHARED);
-    pthread_mutex_init(&user_mutex, &user_mutex_attr);
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &usr1, saved);
+    shm_lock(&lock_shm_ptr->msg);
+}
+
+void msg_unlock(sigset_t *saved) {
+    shm_unlock(&lock_shm_ptr->msg);
+    sigprocmask(SIG_SETMASK, saved, NULL);
+}
 
-    pthread_mutexattr_init(&msg_mutex_attr);
-    pthread_mutexattr_setpshared(&msg_mutex_attr, PTHREAD_PROCESS_SHARED);
-    pthread_mutex_init(&msg_mutex, &msg_mutex_attr);
+void report_lock_stats() {
+    auto report = [](string name, ShmLock *lock) {
+        if (lock->acquired == 0) return;
+        cout << name << "\tacquired: " << lock->acquired
+             << "\tcontended: " << lock->contended
+             << "\twait: " << lock->wait_ns / 1000 << " us"
+             << "\trecovered: " << lock->recovered << endl;
+    };
+
+    cout << "***** Lock stats" << endl;
+    for (int x=0; x < USER_LIMIT; ++x) {
+        report("user[" + to_string(x+1) + "]", &lock_shm_ptr->user[x]);
+    }
+    report("msg", &lock_shm_ptr->msg);
+    for (int x=0; x < USER_LIMIT; ++x) {
+        report("fifo[" + to_string(x+1) + "]", &lock_shm_ptr->fifo[x]);
+    }
+    report("arena", &lock_shm_ptr->arena);
+}
 
-    pthread_mutexattr_init(&fifo_mutex_attr);
-    pthread_mutexattr_setpshared(&fifo_mutex_attr, PTHREAD_PROCESS_SHARED);
-    pthread_mutex_init(&fifo_mutex, &fifo_mutex_attr);
+void report_shm_usage() {
+    // The arena only grows, so this is the footprint of the busiest moment so far
+    shm_lock(&lock_shm_ptr->arena);
+    cout << "Shared memory: " << shm_header->used << " bytes used, "
+         << shm_header->committed << " bytes committed, "
+         << fifo_shm_ptr->records << " user pipe records" << endl;
+    shm_unlock(&lock_shm_ptr->arena);
 }
 
 /* Server Related*/
@@ -249,25 +495,15 @@ void server_exit_procedure() {
         }
     }
 
-    cout << "Detach and Remove Shared Memory" << endl;
-    if (shmdt(user_shm_ptr) < 0) {
-        perror("Detach user shm");
-    }
-    if (shmctl(user_shm_id, IPC_RMID, NULL) < 0) {
-        perror("Remove user shared memory");
-    }
-    if (shmdt(msg_shm_ptr) < 0) {
-        perror("Detach message shm");
-    }
-    if (shmctl(msg_shm_id, IPC_RMID, NULL) < 0) {
-        perror("Remove message shared memory");
-    }
-    if (shmdt(fifo_shm_ptr) < 0) {
-        perror("Detach fifo shm");
-    }
-    if (shmctl(fifo_shm_id, IPC_RMID, NULL) < 0) {
-        perror("Remove fifo shared memory");
+    report_lock_stats();
+    report_shm_usage();
+    remove_user_pipe_dir(user_pipe_dir);
+
+    cout << "Unmap Shared Memory" << endl;
+    if (munmap(shm_base, SHM_RESERVE) < 0) {
+        perror("Unmap shm");
     }
+    close(shm_fd);
     cout << "Close listen socket" << endl;
     close(listen_sock);
 
@@ -279,76 +515,39 @@ void signal_server_handler(int sig) {
     if (sig == SIGCHLD) {
         int stat;
         while(waitpid(-1, &stat, WNOHANG) > 0) {
-            // Remove zombie process
+            // Remove zombie process, the server only forks user processes
+            if (getpid() == server_pid) {
+                --online_users;
+            }
         }
 
-    }
-}
-
-bool is_user_up_to_limit() {
-    for (int x=0; x < USER_LIMIT; ++x) {
-        if (!user_shm_ptr[x].is_active) {
-            return false;
+    } else if (sig == TRACE_SIGNAL) {
+        // The reports allocate, they are printed once accept is interrupted
+        trace_space::dump(sig);
+        for (int x = 0; x < USER_LIMIT; ++x) {
+            // Only the user processes, their commands keep SIGUSR2 at SIG_DFL
+            pid_t pid = user_shm_ptr[x].pid;
+            if (user_shm_ptr[x].is_active && pid > 0) kill(pid, TRACE_SIGNAL);
         }
+        report_requested = 1;
     }
-    return true;
 }
 
-int get_listen_socket(const char *port) {
-    struct sockaddr_in s_addr;
-    int listen_sock;
-    int status_code;
-
-    // Init variable
-    bzero((char *)&s_addr, sizeof(s_addr));
-
-    // Init server address
-    s_addr.sin_family = AF_INET;
-    s_addr.sin_addr.s_addr = INADDR_ANY;
-    s_addr.sin_port = htons((u_short)atoi(port));
-
-    // Create socket
-    listen_sock = socket(s_addr.sin_family, SOCK_STREAM, 0);
-    if (listen_sock < 0) {
-        perror("Server create socket");
-        exit(0);
-    }
-
-    // Socket setting
-    int optval = 1;
-    status_code = setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
-    if (status_code < 0) {
-        perror("Set socket option");
-        exit(0);
-    }
-
-    // Bind socket
-    status_code = bind(listen_sock, (struct sockaddr *) &s_addr, sizeof(s_addr));
-    if (status_code < 0) {
-        perror("Server bind");
-        exit(0);
-    }
-
-    // Listen socket
-    status_code = listen(listen_sock, 5);
-    if (status_code < 0) {
-        perror("Server listen");
-        exit(0);
-    }
-
-    return listen_sock;
+bool is_user_up_to_limit() {
+    // Counted at fork and reap, so no slot scan and no race with slot claiming
+    return online_users >= USER_LIMIT;
 }
 
 int get_online_user_number() {
     int counter = 0;
 
-    pthread_mutex_lock(&user_mutex);
     for(int x=0; x < USER_LIMIT; ++x) {
+        shm_lock(&lock_shm_ptr->user[x]);
         if (user_shm_ptr[x].is_active) {
             ++counter;
         }
+        shm_unlock(&lock_shm_ptr->user[x]);
     }
-    pthread_mutex_unlock(&user_mutex);
 
     return counter;
 }
@@ -410,38 +609,55 @@ void debug_user() {
     cout << "***** Debug user end" << endl;
 }
 
-int create_user(int sock, sockaddr_in addr) {
+void update_row(int uid) {
+    // Under the user lock, after the name changed
+    FormatBuffer<USER_ROW_SIZE> fmt;
+    User *user = &user_shm_ptr[uid-1];
+
+    format_space::add_row(fmt, uid, user->name, user->ip_addr);
+    memcpy(user->row, fmt.buf, fmt.len);
+    user->row_len = fmt.len;
+}
+
+int create_user(int sock, const sockaddr_storage &addr) {
     // Invoked in child process
     int uid;
-    char ip[INET6_ADDRSTRLEN];
-    sprintf(ip, "%s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+    char ip[FORMAT_ADDR_SIZE];
+    format_space::format_addr(ip, sizeof(ip), addr);
 
-    pthread_mutex_lock(&user_mutex);
     for (uid=1; uid <= USER_LIMIT; ++uid) {
+        bool is_claimed = false;
+
+        shm_lock(&lock_shm_ptr->user[uid-1]);
         if(user_shm_ptr[uid-1].is_active == false) {
             user_shm_ptr[uid-1].uid = uid;
             user_shm_ptr[uid-1].pid = getpid();
             user_shm_ptr[uid-1].is_active = true;
             user_shm_ptr[uid-1].sockfd = sock;
             strcpy(user_shm_ptr[uid-1].name, "(no name)");
-            strncpy(user_shm_ptr[uid-1].ip_addr, ip, INET6_ADDRSTRLEN);
+            strncpy(user_shm_ptr[uid-1].ip_addr, ip, FORMAT_ADDR_SIZE);
+            update_row(uid);
 
-            break;
+            is_claimed = true;
         }
+        shm_unlock(&lock_shm_ptr->user[uid-1]);
+
+        if (is_claimed) break;
     }
-    pthread_mutex_unlock(&user_mutex);
 
     return uid;
 }
 
 void user_exit_procedure(int uid) {
+    journal_space::flush();
     logout_prompt(uid);
     clean_user_pipe(uid);
+    limit_space::remove_session(session_cgroup);
 
-    pthread_mutex_lock(&user_mutex);
+    shm_lock(&lock_shm_ptr->user[uid-1]);
     close(user_shm_ptr[uid-1].sockfd);
     bzero(&(user_shm_ptr[uid-1]), sizeof(User));
-    pthread_mutex_unlock(&user_mutex);
+    shm_unlock(&lock_shm_ptr->user[uid-1]);
 
     while(user_can_leave == false) {
         usleep(100);
@@ -452,13 +668,15 @@ void user_exit_procedure(int uid) {
 
 void signal_child_handler(int sig) {
     char buf[CONTENT_SIZE];
+    int length = 0;
     bzero(buf, CONTENT_SIZE);
 
     if (sig == SIGUSR1) {
-        // Receive boradcast message
+        // Receive boradcast message, SIGUSR1 is blocked here and wherever this process holds the slot
         while (true) {
-            pthread_mutex_lock(&msg_mutex);
-            strncpy(buf, msg_shm_ptr->content, msg_shm_ptr->length);
+            shm_lock(&lock_shm_ptr->msg);
+            length = min(msg_shm_ptr->length, CONTENT_SIZE);
+            strncpy(buf, msg_shm_ptr->content, length);
             msg_shm_ptr->counter--;
 
             if (msg_shm_ptr->counter <= 0) {
@@ -468,16 +686,18 @@ void signal_child_handler(int sig) {
             if (msg_shm_ptr->is_exit && msg_shm_ptr->src_id == get_uid_by_pid(getpid())) {
                 user_can_leave = true;
             }
-            pthread_mutex_unlock(&msg_mutex);
+            shm_unlock(&lock_shm_ptr->msg);
             break;
         }
 
-        string msg(buf);
-        sendout_msg(get_sockfd_by_pid(getpid()), msg);
+        // No allocation in the handler, the interrupted code may be inside malloc
+        length = strnlen(buf, length);
+        if (write(get_sockfd_by_pid(getpid()), buf, length) < 0) {}
     } else if (sig == SIGUSR2) {
         // Receive user pipe
     } else if(sig == SIGINT || sig == SIGQUIT || sig == SIGTERM){
-        user_exit_procedure(get_uid_by_pid(getpid()));
+        // The logout allocates and takes locks, read_msg runs it
+        exit_requested = 1;
     }
 
 
@@ -486,18 +706,53 @@ void signal_child_handler(int sig) {
 
 /* Network IO */
 string read_msg(int uid, int sockfd) {
-    static int cmd_counter = 0;
+    // One line at a time, the rest stays in inbuf for the next call
     char buf[MAX_BUF_SIZE];
-    bzero(buf, MAX_BUF_SIZE);
+    size_t pos;
+
+    while ((pos = inbuf.find('\n')) == string::npos) {
+        int in = (client_in >= 0) ? client_in : sockfd;
+        int timeout_ms = journal_space::flush_timeout_ms();
 
-    if (read(sockfd, buf, MAX_BUF_SIZE) < 0) {
-        perror("Read Message.");
-        return "";
+        if (exit_requested) {
+            user_exit_procedure(uid);
+        }
+        if (timeout_ms >= 0 && !telnet.eof) {
+            // Idle with records buffered, write them once they are due
+            struct pollfd pfd = {in, POLLIN, 0};
+            int ready = poll(&pfd, 1, timeout_ms);
+
+            if (ready == 0) journal_space::tick();
+            if (ready <= 0) continue;   // Due, or interrupted by a message
+        }
+
+        int n = telnet.eof ? 0 : read(in, buf, MAX_BUF_SIZE);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("Read Message.");
+            return "";
+        } else if (n == 0) {
+            // Closed without exit, or Ctrl-D. The logout broadcast comes back
+            // to this process, so its write must not fail on the gone client.
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, sockfd);
+            close(null_fd);
+            user_exit_procedure(uid);
+        }
+
+        string reply;
+        telnet_space::filter(&telnet, buf, n, inbuf, reply);
+        if (!reply.empty()) {
+            sendout_msg(sockfd, reply);
+        }
+        if (telnet.local[TELNET_OPT_COMPRESS2]) my_compress(uid);
     }
 
-    string msg(buf);
-    msg.erase(remove(msg.begin(), msg.end(), '\n'), msg.end());
-    msg.erase(remove(msg.begin(), msg.end(), '\r'), msg.end());
+    string msg = inbuf.substr(0, pos);
+    inbuf.erase(0, pos + 1);
 
     #if 0
     cout << "uid: " << uid << " Recv: " << msg << endl;
@@ -507,6 +762,7 @@ string read_msg(int uid, int sockfd) {
 }
 
 void sendout_msg(int sockfd, string &msg) {
+    TRACE_SPAN("sendout_msg");
     int n = write(sockfd, msg.c_str(), msg.length());
     if (n < 0) {
         perror("Sendout Message");
@@ -515,19 +771,12 @@ void sendout_msg(int sockfd, string &msg) {
 }
 /* Network IO End */
 
-bool is_white_char(string cmd) {
-    for (size_t i = 0; i < cmd.length(); i++) {
-        if(isspace(cmd[i]) == 0) {
-            return false;
-        }
-    }
-    return true;
-}
-
 void broadcast(string msg, int type) {
+    TRACE_SPAN("broadcast");
+    sigset_t saved;
     int n=0;
     while (true) {
-        pthread_mutex_lock(&msg_mutex);
+        msg_lock(&saved);
         if (msg_shm_ptr->is_active) {
             ++n;
             if (msg_shm_ptr->is_exit == BF_NORMAL && n==10) {
@@ -537,7 +786,7 @@ void broadcast(string msg, int type) {
             }
             // cout << "broadcast msg is " << msg_shm_ptr->content << endl;
             // cout << "broadcast type is " << ((msg_shm_ptr->is_exit == BF_NORMAL) ? "Normal" : "Exit") << endl;
-            pthread_mutex_unlock(&msg_mutex);
+            msg_unlock(&saved);
             usleep(900);
             continue;
         } else {
@@ -547,7 +796,7 @@ void broadcast(string msg, int type) {
             msg_shm_ptr->src_id = get_uid_by_pid(getpid());
             msg_shm_ptr->is_exit = (type == BF_USER_EXIT);
             strncpy(msg_shm_ptr->content, msg.c_str(), msg.length());
-            pthread_mutex_unlock(&msg_mutex);
+            msg_unlock(&saved);
             break;
         }
     }
@@ -562,27 +811,23 @@ void broadcast(string msg, int type) {
 }
 
 void login_prompt(int uid) {
-    ostringstream oss;
-    string msg;
+    FormatBuffer<> msg;
 
     // Create message
-    oss << "*** User '" << user_shm_ptr[uid-1].name << "' entered from " << user_shm_ptr[uid-1].ip_addr << ". ***" << endl;
-    msg = oss.str();
+    msg.add("*** User '").add(user_shm_ptr[uid-1].name).add("' entered from ").add(user_shm_ptr[uid-1].ip_addr).add(". ***\n");
 
     // Broadcast
-    broadcast(msg, BF_NORMAL);
+    broadcast(msg.str(), BF_NORMAL);
 }
 
 void logout_prompt(int uid) {
-    ostringstream oss;
-    string msg;
+    FormatBuffer<> msg;
 
     // Create message
-    oss << "*** User '" << user_shm_ptr[uid-1].name << "' left. ***" << endl;
-    msg = oss.str();
+    msg.add("*** User '").add(user_shm_ptr[uid-1].name).add("' left. ***\n");
 
     // Broadcast
-    broadcast(msg, BF_USER_EXIT);
+    broadcast(msg.str(), BF_USER_EXIT);
 }
 
 void command_prompt(int uid) {
@@ -603,194 +848,151 @@ void welcome(int uid) {
 }
 
 void who(int uid) {
-    ostringstream oss;
-    string tab("\t"), is_me("<-me"), msg;
+    FormatBuffer<> fmt;
+    string msg;
 
-    // Create Message
-    oss << "<ID>\t<nickname>\t<IP:port>\t<indicate me>" << endl;
+    // Create Message from the rows cached in the user slots
+    fmt.add(format_space::WHO_HEADER);
     for (int x=0; x < USER_LIMIT; ++x) {
         if (user_shm_ptr[x].is_active) {
-            oss << user_shm_ptr[x].uid << tab
-                << user_shm_ptr[x].name << tab
-                << user_shm_ptr[x].ip_addr << tab
-                << ((user_shm_ptr[x].uid == uid) ? is_me : "")
-                << endl;
+            fmt.add(string_view(user_shm_ptr[x].row, user_shm_ptr[x].row_len))
+               .add((user_shm_ptr[x].uid == uid) ? format_space::WHO_ME : "\n");
         }
     }
-    msg = oss.str();
+    msg = fmt.str();
 
     // Send out Message
     sendout_msg(user_shm_ptr[uid-1].sockfd, msg);
 }
 
+void usage(int uid) {
+    struct rusage ru;
+    string msg;
+
+    // Children are reaped by signal_server_handler
+    getrusage(RUSAGE_CHILDREN, &ru);
+    msg = limit_space::usage(session_cgroup, &ru);
+
+    sendout_msg(user_shm_ptr[uid-1].sockfd, msg);
+}
+
+bool admit_msg(int uid, string &msg) {
+    if (rate_space::admit_msg(&msg_bucket, msg.length())) {
+        return true;
+    }
+
+    string err("*** Error: too many messages, please slow down. ***\n");
+    sendout_msg(user_shm_ptr[uid-1].sockfd, err);
+    return false;
+}
+
 void tell(int uid, int tid, string msg) {
-    ostringstream oss;
+    FormatBuffer<> fmt;
+
+    if (!admit_msg(uid, msg)) {
+        return;
+    }
 
     if (has_user(tid)) {
         // Create message
-        oss << "*** " << user_shm_ptr[uid-1].name << " told you ***: " << msg << endl;
-        msg = oss.str();
+        fmt.add("*** ").add(user_shm_ptr[uid-1].name).add(" told you ***: ").add(msg).add('\n');
+        msg = fmt.str();
 
         // Use message shared memory
-        pthread_mutex_lock(&msg_mutex);
+        sigset_t saved;
+        msg_lock(&saved);
         msg_shm_ptr->is_active = true;
         msg_shm_ptr->counter = 1;
         msg_shm_ptr->length = msg.length();
         strncpy(msg_shm_ptr->content, msg.c_str(), msg.length());
-        pthread_mutex_unlock(&msg_mutex);
+        msg_unlock(&saved);
 
         // Send signal
         kill(user_shm_ptr[tid-1].pid, SIGUSR1);
     } else {
         // User is not exist
-        oss << "*** Error: user #" << tid << " does not exist yet. ***" << endl;
-        msg = oss.str();
+        fmt.add("*** Error: user #").num(tid).add(" does not exist yet. ***\n");
+        msg = fmt.str();
 
         sendout_msg(user_shm_ptr[uid-1].sockfd, msg);
     }
 }
 
 void yell(int uid, string msg) {
-    ostringstream oss;
-    
+    FormatBuffer<> fmt;
+
+    if (!admit_msg(uid, msg)) {
+        return;
+    }
+
     // Create message
-    oss << "*** " << user_shm_ptr[uid-1].name << " yelled ***: " << msg << endl;
-    msg = oss.str();
+    fmt.add("*** ").add(user_shm_ptr[uid-1].name).add(" yelled ***: ").add(msg).add('\n');
 
     // Broadcast message
-    broadcast(msg, BF_NORMAL);
+    broadcast(fmt.str(), BF_NORMAL);
 }
 
 void name_cmd(int uid, string name) {
-    ostringstream oss;
+    FormatBuffer<> fmt;
     string msg;
 
+    // Cut to what the slot holds, so the check and the message see the stored name
+    name = name.substr(0, NAME_SIZE - 1);
+
     // Check name
     for (int x=0; x < USER_LIMIT; ++x) {
         if (name.compare(user_shm_ptr[x].name) == 0) {
             // The name is already exist
-            oss << "*** User '" << name << "' already exists. ***" << endl;
-            msg = oss.str();
+            fmt.add("*** User '").add(name).add("' already exists. ***\n");
+            msg = fmt.str();
             sendout_msg(user_shm_ptr[uid-1].sockfd, msg);
             return;
         }
     }
 
     // Change name and broadcast message
-    pthread_mutex_lock(&user_mutex);
-    bzero(user_shm_ptr[uid-1].name, 32);
-    strncpy(user_shm_ptr[uid-1].name, name.c_str(), name.length());
-    pthread_mutex_unlock(&user_mutex);
-    oss << "*** User from " << user_shm_ptr[uid-1].ip_addr << " is named '" << name << "'. ***" << endl;
-    msg = oss.str();
-
-    broadcast(msg, BF_NORMAL);
+    shm_lock(&lock_shm_ptr->user[uid-1]);
+    bzero(user_shm_ptr[uid-1].name, NAME_SIZE);
+    strncpy(user_shm_ptr[uid-1].name, name.c_str(), NAME_SIZE - 1);
+    update_row(uid);
+    shm_unlock(&lock_shm_ptr->user[uid-1]);
+    fmt.add("*** User from ").add(user_shm_ptr[uid-1].ip_addr).add(" is named '").add(name).add("'. ***\n");
+
+    broadcast(fmt.str(), BF_NORMAL);
 }
 
-void decrement_number_pipes(vector<NumberPipe> &number_pipes) {
-    for (size_t i = 0; i < number_pipes.size(); i++) {
-        --number_pipes[i].number;
-    }
-}
+void my_compress(int uid) {
+    // sockfd becomes the compressor, so every writer of this user follows
+    int sockfd = user_shm_ptr[uid-1].sockfd;
 
-vector<string> parse_normal_pipe(string input) {
-    vector<string> cmds;
-    string pipe_symbol("| ");
-    int pos;
+    if (client_in >= 0) return;
 
-    // Parse pipe
-    while ((pos = input.find(pipe_symbol)) != string::npos) {
-        cmds.push_back(input.substr(0, pos));
-        input.erase(0, pos + pipe_symbol.length());
-    }
-    cmds.push_back(input);
+    int fd = compress_space::spawn(sockfd);
+    if (fd < 0) return;
 
-    // Remove space
-    for (size_t i = 0; i < cmds.size(); i++) {
-        int head = 0, tail = cmds[i].length() - 1;
-
-        while(cmds[i][head] == ' ') ++head;
-        while(cmds[i][tail] == ' ') --tail;
-
-        if (head != 0 || tail != cmds[i].length() - 1) {
-            cmds[i] = cmds[i].substr(head, tail + 1);
-        }
-    }
-
-    return cmds;
-}
-
-vector<Command> parse_number_pipe(string input) {
-    /*
-     *    "removetag test.html |2 ls | number |1"
-     * -> ["removetag test.html |2", "ls | number |1"]
-     */
-    vector<Command> lines;
-    regex pattern("[|!][1-9]\\d?\\d?[0]?");
-    smatch result;
-
-    while(regex_search(input, result, pattern)) {
-        Command command;
-        string tmp;
-        tmp = input.substr(0, result.position() + result.length());
-
-        command.cmd = input.substr(0, result.position() + result.length());
-        command.number = atoi(input.substr(result.position() + 1, result.length() - 1).c_str());
-        input.erase(0, result.position() + result.length());
-
-        lines.push_back(command);
-    }
-
-    if (input.length() != 0) {
-        Command command{cmd: input};
-        
-        lines.push_back(command);
-    }
-
-    if (lines.size() == 0) {
-        // Normal Pipe
-        Command command{cmd: input};
-
-        lines.push_back(command);
-    }
-
-    // Split by pipe
-    for (size_t i = 0; i < lines.size(); i++) {
-        lines[i].cmds = parse_normal_pipe(lines[i].cmd); 
-    }
-
-    // Debug
-    #if 0
-    for (size_t i = 0; i < lines.size(); i++) {
-        cerr << "Line " << i << ": " << lines[i].cmd << endl;
-        cerr << "\tCommand: " << lines[i].cmd << endl;
-        cerr << "\tCommand Size: " << lines[i].cmds.size() << endl;
-        cerr << "\tNumber: " << lines[i].number << endl;
-    }
-    #endif
-        
-    return lines;
+    client_in = dup(sockfd);
+    dup2(fd, sockfd);
+    close(fd);
 }
 
 int handle_builtin(int uid, string cmd, Context *context) {
-    istringstream iss(cmd);
-    string prog;
+    BuiltinCall call;
 
-    getline(iss, prog, ' ');
+    if (!builtin_space::parse(cmd, call)) {
+        return BUILT_IN_FALSE;
+    }
 
-    if (prog == "setenv") {
-        string var, value;
+    switch (call.id) {
+    case BUILTIN_setenv: {
+        string var(call.args[0]), value(call.args[1]);
 
-        getline(iss, var, ' ');
-        getline(iss, value, ' ');
         setenv(var.c_str(), value.c_str(), 1);
         context->env[var] = value;
 
         return BUILT_IN_TRUE;
-    } else if (prog == "printenv") {
-        string var;
-
-        getline(iss, var, ' ');
+    }
+    case BUILTIN_printenv: {
+        string var(call.args[0]);
         char *value = getenv(var.c_str());
     
         if (value) {
@@ -804,48 +1006,35 @@ int handle_builtin(int uid, string cmd, Context *context) {
         }
 
         return BUILT_IN_TRUE;
-    } else if (prog == "exit") {
+    }
+    case BUILTIN_exit:
+        journal_space::record(uid, context->original_input, JOURNAL_NO_STATUS, context->start_ns);
         user_exit_procedure(uid);
-
         return BUILT_IN_EXIT;
-    } else if (prog == "who") {
+    case BUILTIN_who:
         who(uid);
-
         return BUILT_IN_TRUE;
-    } else if (prog == "tell") {
-        string tid, msg;
-
-        getline(iss, tid, ' ');
-        getline(iss, msg);
-
-        tell(uid, atoi(tid.c_str()), msg);
-
+    case BUILTIN_usage:
+        usage(uid);
         return BUILT_IN_TRUE;
-    } else if (prog == "yell") {
-        string msg;
-
-        getline(iss, msg);
-        yell(uid, msg);
-
+    case BUILTIN_compress:
+        my_compress(uid);
         return BUILT_IN_TRUE;
-    } else if (prog == "name") {
-        string new_name;
-        
-        getline(iss, new_name, ' ');
-        name_cmd(uid, new_name);
-
+    case BUILTIN_tell:
+        tell(uid, atoi(string(call.args[0]).c_str()), string(call.args[1]));
+        return BUILT_IN_TRUE;
+    case BUILTIN_yell:
+        yell(uid, string(call.args[0]));
         return BUILT_IN_TRUE;
+    case BUILTIN_name:
+        name_cmd(uid, string(call.args[0]));
+        return BUILT_IN_TRUE;
+    default:
+        return BUILT_IN_FALSE;
     }
-
-    return BUILT_IN_FALSE;
 }
 
 void execute_command(int uid, vector<string> args) {
-    int fd;
-    bool need_file_redirection = false;
-    const char *prog = args[0].c_str();
-    const char **c_args = new const char* [args.size()+1];  // Reserve one location for NULL
-
     #if 0
     cerr << "Execute Command Args: ";
     for (size_t i = 0; i < args.size(); i++) {
@@ -854,93 +1043,124 @@ void execute_command(int uid, vector<string> args) {
     cerr << endl;
     #endif
 
-    /* Parse Arguments */
-    for (size_t i = 0; i < args.size(); i++) {
-        if (args[i] == ">") {
-            need_file_redirection = true;
-            fd = open(args[i+1].c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-            args.pop_back();  // Remove file name
-            args.pop_back();  // Remove redirect symbol
-            break;
+    // Execute Command, redirection is already stripped and applied
+    exec_args(args);
+
+    ostringstream oss;
+    string msg;
+
+    oss << "Unknown command: [" << args[0] << "]." << endl;
+    msg = oss.str();
+    sendout_msg(user_shm_ptr[uid-1].sockfd, msg);
+    exit(1);
+}
+
+FifoInfo *fifo_alloc() {
+    // A recycled record, or a new chunk from the arena
+    FifoInfo *fifo;
+
+    shm_lock(&lock_shm_ptr->arena);
+    if (fifo_shm_ptr->free_list == NULL) {
+        FifoInfo *chunk = static_cast<FifoInfo *>(arena_alloc(sizeof(FifoInfo) * FIFO_CHUNK));
+
+        for (int x = 0; chunk && x < FIFO_CHUNK; ++x) {
+            chunk[x].next = fifo_shm_ptr->free_list;
+            fifo_shm_ptr->free_list = &chunk[x];
         }
-        c_args[i] = args[i].c_str();
+        if (chunk) fifo_shm_ptr->records += FIFO_CHUNK;
     }
-    c_args[args.size()] = NULL;
+    fifo = fifo_shm_ptr->free_list;
+    if (fifo) fifo_shm_ptr->free_list = fifo->next;
+    shm_unlock(&lock_shm_ptr->arena);
 
-    // Check if need file redirection
-    if (need_file_redirection) {
-        dup2(fd, STDOUT_FILENO);
-        close(fd);
-    }
+    return fifo;
+}
 
-    // Execute Command
-    if (execvp(prog, (char **)c_args) == -1) {
-        ostringstream oss;
-        string msg;
+void fifo_free(FifoInfo *fifo) {
+    shm_lock(&lock_shm_ptr->arena);
+    fifo->is_active = false;
+    fifo->next = fifo_shm_ptr->free_list;
+    fifo_shm_ptr->free_list = fifo;
+    shm_unlock(&lock_shm_ptr->arena);
+}
 
-        oss << "Unknown command: [" << args[0] << "]." << endl;
-        msg = oss.str();
-        sendout_msg(user_shm_ptr[uid-1].sockfd, msg);
-        exit(1);
+void release_user_pipe(FifoInfo *fifo) {
+    // Off its source's list and back to the free list, the caller holds that source's lock
+    FifoInfo **link = &fifo_shm_ptr->head[fifo->src_uid-1];
+
+    while (*link && *link != fifo) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = fifo->next;
+        fifo_free(fifo);
     }
 }
 
 void clean_user_pipe(int uid) {
-    pthread_mutex_lock(&fifo_mutex);
-    for (int x=0; x < FIFO_LIMIT; ++x) {
-        if (fifo_shm_ptr[x].is_active) {
-            if (fifo_shm_ptr[x].src_uid == uid || fifo_shm_ptr[x].dst_uid == uid) {
-                int fd = open(fifo_shm_ptr[x].pathname, O_RDONLY);
+    // One walk over the pipes in flight, not over every pair of users
+    for (int x=0; x < USER_LIMIT; ++x) {
+        ShmLock *bucket = &lock_shm_ptr->fifo[x];
+
+        shm_lock(bucket);
+        for (FifoInfo *fifo = fifo_shm_ptr->head[x], *next; fifo; fifo = next) {
+            next = fifo->next;
+            if (fifo->src_uid == uid || fifo->dst_uid == uid) {
+                int fd = open(fifo->pathname, O_RDONLY);
                 char buf[MAX_BUF_SIZE];
                 bzero(buf, MAX_BUF_SIZE);
                 read(fd, buf, MAX_BUF_SIZE);
                 close(fd);
-                fifo_shm_ptr[x].is_active = false;
+                unlink(fifo->pathname);
+                release_user_pipe(fifo);
             }
         }
+        shm_unlock(bucket);
     }
-    pthread_mutex_unlock(&fifo_mutex);
 }
 
-int create_user_pipe(int src_uid, int dst_uid) {
-    int result_index = -1;
+FifoInfo *find_user_pipe(int src_uid, int dst_uid) {
+    // The caller holds the source's lock
+    for (FifoInfo *fifo = fifo_shm_ptr->head[src_uid-1]; fifo; fifo = fifo->next) {
+        if (fifo->dst_uid == dst_uid) return fifo;
+    }
+    return NULL;
+}
+
+FifoInfo *create_user_pipe(int src_uid, int dst_uid) {
+    FifoInfo *result = NULL;
     char path[PATHLENGTH];
     bzero(path, PATHLENGTH);
 
-    pthread_mutex_lock(&fifo_mutex);
-    if (fifo_shm_ptr[(src_uid-1) * USER_LIMIT + (dst_uid-1)].is_active == false) {
-        result_index = (src_uid-1) * USER_LIMIT + (dst_uid-1);
-        sprintf(path, "%s%dto%d", USER_PIPE_DIR, src_uid, dst_uid);
-
-        fifo_shm_ptr[(src_uid-1) * USER_LIMIT + (dst_uid-1)].is_active = true;
-        fifo_shm_ptr[(src_uid-1) * USER_LIMIT + (dst_uid-1)].src_uid = src_uid;
-        fifo_shm_ptr[(src_uid-1) * USER_LIMIT + (dst_uid-1)].dst_uid = dst_uid;
-        strncpy(fifo_shm_ptr[(src_uid-1) * USER_LIMIT + (dst_uid-1)].pathname, path, PATHLENGTH);
+    shm_lock(&lock_shm_ptr->fifo[src_uid-1]);
+    if (find_user_pipe(src_uid, dst_uid) == NULL && (result = fifo_alloc()) != NULL) {
+        sprintf(path, "%s%dto%d", user_pipe_dir, src_uid, dst_uid);
 
+        result->is_active = true;
+        result->src_uid = src_uid;
+        result->dst_uid = dst_uid;
+        strncpy(result->pathname, path, PATHLENGTH);
+        result->next = fifo_shm_ptr->head[src_uid-1];
+        fifo_shm_ptr->head[src_uid-1] = result;
     }
-    pthread_mutex_unlock(&fifo_mutex);
+    shm_unlock(&lock_shm_ptr->fifo[src_uid-1]);
 
-    mkfifo(path, 0666);
+    if (result) mkfifo(path, 0666);
 
-    return result_index;
+    return result;
 }
 
-int search_user_pipe(int src_uid, int dst_uid) {
-    int result = -1;
+FifoInfo *search_user_pipe(int src_uid, int dst_uid) {
+    FifoInfo *result;
 
-    for (int x=0; x < FIFO_LIMIT; ++x) {
-        if (fifo_shm_ptr[x].is_active) {
-            if (fifo_shm_ptr[x].src_uid == src_uid && fifo_shm_ptr[x].dst_uid == dst_uid) {
-                result = x;
-                break;
-            }
-        }
-    }
+    shm_lock(&lock_shm_ptr->fifo[src_uid-1]);
+    result = find_user_pipe(src_uid, dst_uid);
+    shm_unlock(&lock_shm_ptr->fifo[src_uid-1]);
     
     return result;
 }
 
-bool handle_input_user_pipe(int uid, string cmd, int *up_idx, Context *context) {
+bool handle_input_user_pipe(int uid, string cmd, FifoInfo **up, Context *context) {
     int src_uid;
     bool error = false;
     ostringstream oss;
@@ -963,9 +1183,9 @@ bool handle_input_user_pipe(int uid, string cmd, int *up_idx, Context *context)
 
     if (!error) {
         // Search user pipe
-        *up_idx = search_user_pipe(src_uid, uid);
+        *up = search_user_pipe(src_uid, uid);
 
-        if (*up_idx == -1) {
+        if (*up == NULL) {
             // Not found
             oss.clear();
             oss << "*** Error: the pipe #" << src_uid << "->#" << uid << " does not exist yet. ***" << endl;
@@ -988,7 +1208,7 @@ bool handle_input_user_pipe(int uid, string cmd, int *up_idx, Context *context)
     return error;
 }
 
-bool handle_output_user_pipe(int uid, string cmd, int *up_idx, Context *context) {
+bool handle_output_user_pipe(int uid, string cmd, FifoInfo **up, Context *context) {
     int dst_uid;
     bool error = false;
     ostringstream oss;
@@ -1011,10 +1231,7 @@ bool handle_output_user_pipe(int uid, string cmd, int *up_idx, Context *context)
 
     if (!error) {
         // Search pipe
-        int tmp;
-        int result = search_user_pipe(uid, dst_uid);
-
-        if (result != -1) {
+        if (search_user_pipe(uid, dst_uid) != NULL) {
             // User pipe is exist
             oss.clear();
             oss << "*** Error: the pipe #" << uid << "->#" << dst_uid << " already exists. ***" << endl;
@@ -1034,30 +1251,31 @@ bool handle_output_user_pipe(int uid, string cmd, int *up_idx, Context *context)
         broadcast(msg, BF_NORMAL);
 
         // Create user pipe
-        *up_idx = create_user_pipe(uid, dst_uid);
+        *up = create_user_pipe(uid, dst_uid);
     }
 
     return error;
 }
 
-void handle_user_pipe(int uid, string cmd, bool *in, bool *out, bool *in_err, bool *out_err, int *in_idx, int *out_idx, Context *context) {
+void handle_user_pipe(int uid, string cmd, bool *in, bool *out, bool *in_err, bool *out_err, FifoInfo **in_up, FifoInfo **out_up, Context *context) {
+    TRACE_SPAN("handle_user_pipe");
     smatch result;
 
     *in  = regex_search(cmd, result, up_in_pattern);
     *out = regex_search(cmd, result, up_out_pattern);
 
     if (*in) {
-        *in_err = handle_input_user_pipe(uid, cmd, in_idx, context);
+        *in_err = handle_input_user_pipe(uid, cmd, in_up, context);
     }
 
     if (*out) {
-        *out_err = handle_output_user_pipe(uid, cmd, out_idx, context);
+        *out_err = handle_output_user_pipe(uid, cmd, out_up, context);
     }
 }
 
 int main_executor(int uid, Command &command, Context *context) {
     /* Pre-Process */
-    decrement_number_pipes(context->number_pipes);
+    context->number_pipes.advance();
     if (command.cmds.size() == 1) {
         int code = handle_builtin(uid, command.cmds[0], context);
         if (code != BUILT_IN_FALSE) {
@@ -1068,21 +1286,28 @@ int main_executor(int uid, Command &command, Context *context) {
     cerr << "Handle " << command.cmd << endl;
     #endif
 
+    // Open redirected files first, nothing is forked if one fails
+    vector<Redirection> redirs;
+    string error;
+
+    if (!redirect_space::open_all(command.cmds, redirs, error)) {
+        sendout_msg(user_shm_ptr[uid-1].sockfd, error);
+        return 0;
+    }
+
     vector<string> args;
     string error_pipe_symbol = "!", pipe_symbol = "|";
-    string arg;
     bool is_error_pipe = false, is_number_pipe = false;
+    PendingPipe *number_pipe_out = NULL;
     bool is_input_user_pipe = false, is_output_user_pipe = false;
     bool is_input_user_pipe_error = false, is_output_user_pipe_error = false;
     
     // Handle a command per loop
     for (size_t i = 0; i < command.cmds.size(); i++) {
-        istringstream iss(command.cmds[i]);
         vector<string> args;
         pid_t pid;
-        int pipefd[2];
-        int input_user_pipe_idx  = -1;
-        int output_user_pipe_idx = -1;
+        FifoInfo *input_user_pipe  = NULL;
+        FifoInfo *output_user_pipe = NULL;
         bool is_first_cmd = false, is_final_cmd = false;
         smatch in_result, out_result;
 
@@ -1093,18 +1318,16 @@ int main_executor(int uid, Command &command, Context *context) {
         handle_user_pipe(uid, command.cmds[i],
             &is_input_user_pipe, &is_output_user_pipe,
             &is_input_user_pipe_error, &is_output_user_pipe_error,
-            &input_user_pipe_idx, &output_user_pipe_idx, context);
+            &input_user_pipe, &output_user_pipe, context);
 
         /* Parse Command to Args */
         #if 0
         cerr << "*** Parse Command: " << command.cmds[i] << endl;
         #endif
 
-        while (getline(iss, arg, ' ')) {
+        for (auto &arg: split_args(command.cmds[i])) {
             bool ignore_arg = false;
 
-            if (is_white_char(arg)) continue;
-
             if (regex_search(arg, in_result, up_in_pattern)) {
                 ignore_arg = true;
             }
@@ -1117,28 +1340,14 @@ int main_executor(int uid, Command &command, Context *context) {
             if (is_final_cmd) {
                 if ((is_number_pipe = (arg.find("|") != string::npos)) ||
                     (is_error_pipe  = (arg.find("!") != string::npos))) {
-                    bool is_add = false;
                     ignore_arg = true;
 
-                    for (int x=0; x < context->number_pipes.size(); ++x) {
-                        // Same number means that using the same pipe
-                        if (context->number_pipes[x].number == command.number) {
-                            context->number_pipes.push_back(NumberPipe{
-                                in:     context->number_pipes[x].in,
-                                out:    context->number_pipes[x].out,
-                                number: command.number
-                            });
-                            is_add = true;
-                            break;
-                        }
-                    }
-                    // No match, Create a new pipe
-                    if (!is_add) {
-                        pipe(pipefd);
-                        context->number_pipes.push_back(NumberPipe{
-                            in: pipefd[0],
-                            out: pipefd[1],
-                            number: command.number});
+                    // Same number means that using the same pipe
+                    number_pipe_out = context->number_pipes.get(command.number);
+                    if (number_pipe_out == NULL) {
+                        // Out of descriptors, the output is dropped as for a failed user pipe
+                        string msg = "*** Error: " + string(strerror(errno)) + ". ***\n";
+                        sendout_msg(user_shm_ptr[uid-1].sockfd, msg);
                     }
                     #if 0
                     debug_number_pipes(context->number_pipes);
@@ -1151,17 +1360,21 @@ int main_executor(int uid, Command &command, Context *context) {
                 args.push_back(arg);
             }
         }
+        redirect_space::strip(args);
         /* Parse Command to Args End */
 
         /* Create Normal Pipe */
-        if (!is_error_pipe && !is_number_pipe && !is_output_user_pipe) {
-            if(!is_final_cmd && command.cmds.size() > 1) {
-                pipe(pipefd);
-                context->pipes.push_back(Pipe{in: pipefd[0], out: pipefd[1]});
-                #if 0
-                debug_pipes(context->pipes);
-                #endif
+        if (!is_final_cmd) {
+            if (!open_stage_pipe(context->pipes, error)) {
+                // The stages forked so far see the end of their input, a user pipe stays to be read
+                sendout_msg(user_shm_ptr[uid-1].sockfd, error);
+                context->number_pipes.release_current();
+                redirect_space::close_all(redirs);
+                return 0;
             }
+            #if 0
+            debug_pipes(context->pipes);
+            #endif
         }
 
         #if 0
@@ -1171,15 +1384,18 @@ int main_executor(int uid, Command &command, Context *context) {
              << "\tin err: "  << (is_input_user_pipe_error ? "True" : "False") << endl
              << "\tout err: " << (is_output_user_pipe_error ? "True" : "False") << endl;
         cerr << "User Pipe index" << endl;
-        cerr << "\tin: " << input_user_pipe_idx << endl
-             << "\tout:" << output_user_pipe_idx << endl;
+        cerr << "\tin: " << input_user_pipe << endl
+             << "\tout:" << output_user_pipe << endl;
         #endif
 
         // cerr << "Start Fork" << endl;
-        do {
-            pid = fork();
-            usleep(5000);
-        } while (pid < 0);
+        {
+            TRACE_SPAN("fork");
+            do {
+                pid = fork();
+                usleep(5000);
+            } while (pid < 0);
+        }
 
         if (pid > 0) {
             /* Parent Process */
@@ -1190,26 +1406,13 @@ int main_executor(int uid, Command &command, Context *context) {
             #endif
             /* Close Pipe */
             // Normal Pipe
-            if (i != 0) {
-                // cerr << "Parent Close pipe: " << i-1 << endl;
-                close(context->pipes[i-1].in);
-                close(context->pipes[i-1].out);
-            }
+            close_stage_pipe(context->pipes, i);
 
-            // Number Pipe
-            for (int x=0; x < context->number_pipes.size(); ++x) {
-                if (context->number_pipes[x].number == 0) {
-                    #if 0
-                    cerr << "Parent Close number pipe: " << x << endl;
-                    #endif
-                    close(context->number_pipes[x].in);
-                    close(context->number_pipes[x].out);
+            // Number Pipe, the first process has taken it
+            context->number_pipes.release_current();
 
-                    // Remove number pipe
-                    context->number_pipes.erase(context->number_pipes.begin() + x);
-                    --x;
-                }
-            }
+            // Redirected files
+            redirect_space::release(redirs[i], context->sync_fds);
 
             if (is_final_cmd && !(is_number_pipe || is_error_pipe) && !is_output_user_pipe) {
                 // Final process, wait
@@ -1217,7 +1420,12 @@ int main_executor(int uid, Command &command, Context *context) {
                 cerr << "Parent Wait Start" << endl;
                 #endif
                 int st;
-                waitpid(pid, &st, 0);
+                TRACE_SPAN("waitpid");
+                if (waitpid(pid, &st, 0) > 0) {
+                    // Not reaped by the SIGCHLD handler first
+                    context->status = journal_space::exit_code(st);
+                }
+                redirect_space::sync(context->sync_fds);
                 #if 0
                 cerr << "Parent Wait End: " << st << endl;
                 #endif
@@ -1238,176 +1446,67 @@ int main_executor(int uid, Command &command, Context *context) {
             #endif
 
             /* Duplicate pipe */
+            int source = -1, sink = user_shm_ptr[uid-1].sockfd;
+
             // STDERR -> socket
             dup2(user_shm_ptr[uid-1].sockfd, STDERR_FILENO);
 
-            if (is_first_cmd) {
-                // Receive input from number pipe
-                for (size_t x = 0; x < context->number_pipes.size(); x++) {
-                    if (context->number_pipes[x].number == 0) {
-                        dup2(context->number_pipes[x].in, STDIN_FILENO);
-                        #if 0
-                        cerr << "First Number Pipe (in) " << context->number_pipes[x].in << " to stdin" << endl;
-                        #endif
-                        break;
-                    }
-                }
-
-                // Setup output of normal pipe
-                if (context->pipes.size() > 0) {
-                    dup2(context->pipes[i].out, STDOUT_FILENO);
-                    #if 0
-                    cerr << "First Normal Pipe (out) " << context->pipes[i].out << " to stdout" << endl;
-                    #endif
-                }
-
-                // Recv from user pipe
-                if (is_input_user_pipe) {
-                    if (is_input_user_pipe_error) {
-                        int dev_null = open("/dev/null", O_RDWR);
-                        dup2(dev_null, STDIN_FILENO);
-                        close(dev_null);
-                        #if 0
-                        cerr << "Set up user pipe input to null" << endl;
-                        #endif
-                    } else {
-                        // dup2(user_pipes[input_user_pipe_idx].pipe.in, STDIN_FILENO);
-                        int fd = open(fifo_shm_ptr[input_user_pipe_idx].pathname, O_RDONLY);
-                        dup2(fd, STDIN_FILENO);
-                        close(fd);
-                        pthread_mutex_lock(&fifo_mutex);
-                        fifo_shm_ptr[input_user_pipe_idx].is_active = false;
-                        pthread_mutex_unlock(&fifo_mutex);
-
-                        #if 0
-                        cerr << "Set up user pipe input to " << fifo_shm_ptr[input_user_pipe_idx].pipe.in << endl;
-                        #endif
-                    }
-
-                }
+            // Receive input from number pipe
+            if (PendingPipe *number_pipe_in = context->number_pipes.current()) {
+                source = number_pipe_in->in;
             }
 
-            // Setup input and output of normal pipe
-            if (!is_first_cmd && !is_final_cmd) {
-                if (context->pipes.size() > 0) {
-                    dup2(context->pipes[i-1].in, STDIN_FILENO);
-                    dup2(context->pipes[i].out, STDOUT_FILENO);
+            // Recv from user pipe
+            if (is_first_cmd && is_input_user_pipe) {
+                if (is_input_user_pipe_error) {
+                    source = open("/dev/null", O_RDWR | O_CLOEXEC);
+                } else {
+                    int src_uid = input_user_pipe->src_uid;
+                    source = open(input_user_pipe->pathname, O_RDONLY | O_CLOEXEC);
+                    // Both ends are open, the name and the record are no longer needed
+                    unlink(input_user_pipe->pathname);
+                    shm_lock(&lock_shm_ptr->fifo[src_uid-1]);
+                    release_user_pipe(input_user_pipe);
+                    shm_unlock(&lock_shm_ptr->fifo[src_uid-1]);
                 }
                 #if 0
-                cerr << "Internal (in) " << context->pipes[i-1].in << " to stdin"  << endl;
-                cerr << "Internal (out) " << context->pipes[i].out << " to stdout" << endl;
+                cerr << "Set up user pipe input to " << source << endl;
                 #endif
-                // TODO: user pipe in the middle ??
             }
 
-            if (is_final_cmd) {
-                if (is_number_pipe) {
-                    /* Number Pipe */
-                    #if 0
-                    cerr << "Final Number Pipe" << endl;
-                    #endif
-                    
-                    // Setup Input
-                    if (context->pipes.size() > 0) {
-                        // Receive from previous command via normal pipe
-                        dup2(context->pipes[i-1].in, STDIN_FILENO);
-                        #if 0
-                        cerr << "Final number Pipe (in) (from normal pip) " << context->pipes[i-1].in << " to stdin" << endl;
-                        #endif
-                    }
-                    
-                    // Setup Output
-                    for (size_t x = 0; x < context->number_pipes.size(); x++) {
-                        if (context->number_pipes[x].number == command.number) {
-                            dup2(context->number_pipes[x].out, STDOUT_FILENO);
-                            close(context->number_pipes[x].out);
-                            #if 0
-                            cerr << "Final Number Pipe (out) " << context->number_pipes[x].out << " to stdout" << endl;
-                            #endif
-                            break;
-                        }
-                    }
-                } else if (is_error_pipe) {
-                    #if 0
-                    cerr << "Final Error Pipe" << endl;
-                    #endif
-                    /* Error Pipe */
-                    /* Setup Input */
-                    if (context->pipes.size() > 0) {
-                        dup2(context->pipes[i-1].in, STDIN_FILENO);
-                    }
-                    /* Setup Output and Error */
-                    for (size_t x = 0; x < context->number_pipes.size(); x++) {
-                        if (context->number_pipes[x].number == command.number) {
-                            dup2(context->number_pipes[x].out, STDOUT_FILENO);
-                            dup2(context->number_pipes[x].out, STDERR_FILENO);
-                            break;
-                        }
-                    }
-                } else if (is_output_user_pipe) {
-                    #if 0
-                    cerr << "Final User Pipe" << endl;
-                    #endif
-
-                    if (context->pipes.size() > 0) {
-                        // Set input
-                        dup2(context->pipes[i-1].in, STDIN_FILENO);
-                    }
-
-                    // Set output
-                    if (is_output_user_pipe_error) {
-                        int dev_null = open("/dev/null", O_RDWR);
-                        dup2(dev_null, STDOUT_FILENO);
-                        close(dev_null);
-                    } else {
-                        // dup2(fifo_shm_ptr[output_user_pipe_idx].pipe.out, STDOUT_FILENO);
-                        int fd = open(fifo_shm_ptr[output_user_pipe_idx].pathname, O_WRONLY);
-                        dup2(fd, STDOUT_FILENO);
-                        close(fd);
-                    }
-
+            // Send to number pipe or user pipe, /dev/null when there is none
+            if (is_number_pipe || is_error_pipe) {
+                sink = number_pipe_out ? number_pipe_out->out : open("/dev/null", O_RDWR | O_CLOEXEC);
+            } else if (is_output_user_pipe) {
+                if (is_output_user_pipe_error) {
+                    sink = open("/dev/null", O_RDWR | O_CLOEXEC);
                 } else {
-                    #if 0
-                    cerr << "Final Normal Pipe" << endl;
-                    #endif
-                    /* Normal Pipe*/
-                    if (context->pipes.size() > 0) {
-                        dup2(context->pipes[i-1].in, STDIN_FILENO);
-                        #if 0
-                        cerr << "Set input from " << context->pipes[i-1].in << " to stdin" << endl;
-                        #endif
-                    }
-
-                    // Redirect to socket
-                    dup2(user_shm_ptr[uid-1].sockfd, STDOUT_FILENO);
-                    #if 0
-                    cerr << "Set output to socket " << user_shm_ptr[uid-1].sockfd << endl;
-                    #endif
+                    sink = open(output_user_pipe->pathname, O_WRONLY | O_CLOEXEC);
                 }
             }
+            #if 0
+            cerr << "Stage " << i << " (in) " << source << " (out) " << sink << endl;
+            #endif
+            apply_stage(wire_stage(context->pipes, i, command.cmds.size(), source, sink, is_error_pipe));
+            // Normal and number pipes are close-on-exec
 
-            /* Close pipe */
-            for (int ci = 0; ci < context->pipes.size(); ci++) {
-                close(context->pipes[ci].in);
-                close(context->pipes[ci].out);
-            }
-            for (int ci = 0; ci < context->number_pipes.size(); ci++) {
-                close(context->number_pipes[ci].in);
-                close(context->number_pipes[ci].out);
-            }
-
+            redirect_space::apply(redirs[i]);
+            limit_space::apply(session_cgroup);
             execute_command(uid, args);
         }
     }
-    context->pipes.clear();
+    close_pipes(context->pipes);
     return 0;
 }
 
 int handle_command(int uid, string input, Context *context) {
     vector<Command> lines;
-    int code;
+    int code = 0;
 
-    lines = parse_number_pipe(input);
+    {
+        TRACE_SPAN("parse_number_pipe");
+        lines = parse_number_pipe(input);
+    }
 
     for (size_t i = 0; i < lines.size(); i++) {
         code = main_executor(uid, lines[i], context);
@@ -1436,13 +1535,31 @@ void serve_client(int uid) {
     setenv("PATH", "bin:.", 1);
 
     signal(SIGCHLD, signal_server_handler);
+    trace_space::current_tid = uid;
+
+    session_cgroup = "np_multi_" + to_string(server_pid) + "_" + to_string(uid);
+    limit_space::create_session(session_cgroup);
 
     while (true) {
         string input = read_msg(uid, user_shm_ptr[uid-1].sockfd);
         context.original_input = input;
+        context.start_ns = trace_space::now_ns();
+        context.status = JOURNAL_NO_STATUS;
+
+        if (input.size() != 0 && !rate_space::admit_command(&command_bucket)) {
+            // Dropped before parsing, so number pipes do not count it
+            string err("*** Error: too many commands, please slow down. ***\n");
+            sendout_msg(user_shm_ptr[uid-1].sockfd, err);
+            command_prompt(uid);
+            continue;
+        }
 
         // Run shell
+        TRACE_SPAN("command");
         run_shell(uid, input, &context);
+        if (input.size() != 0) {
+            journal_space::record(uid, input, context.status, context.start_ns);
+        }
         command_prompt(uid);
     }
 }
@@ -0,0 +1,159 @@
+#ifndef NP_NUMBER_PIPE_H
+#define NP_NUMBER_PIPE_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <unordered_map>
+
+using namespace std;
+
+/*
+ * Number pipe scheduler
+ *
+ * Pending |N and !N pipes are kept in a timing wheel indexed by the absolute
+ * line number they target, so there is no per-line countdown: starting a
+ * line, finding its input pipe and creating or sharing an output pipe are
+ * all O(1). Targets beyond the wheel go to an overflow map. Pipes are
+ * created close-on-exec, so children keep only the ends they dup2'd and do
+ * not have to close every pending pipe. A pipe whose line has passed is
+ * closed as soon as the next line starts.
+ */
+#define NUMBER_PIPE_WHEEL_SIZE  2048    // Must be power of 2, covers |1000+1000
+
+typedef struct pending_pipe {
+    long line;      // Target line, -1 for an empty slot
+    int in;
+    int out;
+} PendingPipe;
+
+class NumberPipeWheel {
+private:
+    PendingPipe slots[NUMBER_PIPE_WHEEL_SIZE];
+    unordered_map<long, PendingPipe> far;   // Targets beyond the wheel
+    long line = 0;                          // Current line
+    size_t count = 0;
+
+    PendingPipe *find(long target) {
+        PendingPipe *slot = &this->slots[target & (NUMBER_PIPE_WHEEL_SIZE - 1)];
+
+        if (slot->line == target) {
+            return slot;
+        }
+        if (!this->far.empty()) {
+            auto iter = this->far.find(target);
+            if (iter != this->far.end()) return &iter->second;
+        }
+        return NULL;
+    }
+
+    PendingPipe *insert_at(long target, int in, int out) {
+        PendingPipe pp = {target, in, out};
+
+        ++this->count;
+        if (target - this->line < NUMBER_PIPE_WHEEL_SIZE) {
+            PendingPipe *slot = &this->slots[target & (NUMBER_PIPE_WHEEL_SIZE - 1)];
+            *slot = pp;
+            return slot;
+        }
+        return &(this->far[target] = pp);
+    }
+
+    void release(PendingPipe *pp) {
+        close(pp->in);
+        close(pp->out);
+        --this->count;
+        if (&this->slots[pp->line & (NUMBER_PIPE_WHEEL_SIZE - 1)] == pp) {
+            pp->line = -1;
+        } else {
+            this->far.erase(pp->line);
+        }
+    }
+
+public:
+    NumberPipeWheel() {
+        for (auto &slot: this->slots) {
+            slot.line = -1;
+        }
+    }
+
+    ~NumberPipeWheel() {
+        this->clear();
+    }
+
+    NumberPipeWheel(const NumberPipeWheel &) = delete;
+    NumberPipeWheel &operator=(const NumberPipeWheel &) = delete;
+
+    void advance() {
+        // Start the next line, a pipe left for the previous one is unread
+        PendingPipe *stale = this->find(this->line);
+
+        if (stale) {
+            this->release(stale);
+        }
+        ++this->line;
+    }
+
+    PendingPipe *current() {
+        // Input of the current line, NULL if none
+        return this->count ? this->find(this->line) : NULL;
+    }
+
+    void release_current() {
+        // Invoked by the parent once the reader has been forked
+        PendingPipe *pp = this->current();
+
+        if (pp) {
+            this->release(pp);
+        }
+    }
+
+    PendingPipe *get(int distance) {
+        // Output pipe for the line `distance` lines ahead, shared by all writers
+        long target = this->line + distance;
+        PendingPipe *pp = this->find(target);
+        int pipefd[2];
+
+        if (pp) {
+            return pp;
+        }
+        if (pipe2(pipefd, O_CLOEXEC) < 0) {
+            return NULL;
+        }
+        return this->insert_at(target, pipefd[0], pipefd[1]);
+    }
+
+    void put(int distance, int in, int out) {
+        // Restore a pending pipe received from another process
+        fcntl(in, F_SETFD, FD_CLOEXEC);
+        fcntl(out, F_SETFD, FD_CLOEXEC);
+        this->insert_at(this->line + distance, in, out);
+    }
+
+    template <typename F>
+    void for_each(F f) {
+        // f(distance, in, out) for every pending pipe, O(wheel size)
+        if (this->count == 0) return;
+        for (auto &slot: this->slots) {
+            if (slot.line >= 0) f(slot.line - this->line, slot.in, slot.out);
+        }
+        for (auto &elem: this->far) {
+            f(elem.first - this->line, elem.second.in, elem.second.out);
+        }
+    }
+
+    void clear() {
+        // Close every pending pipe
+        for (auto &slot: this->slots) {
+            if (slot.line >= 0) this->release(&slot);
+        }
+        while (!this->far.empty()) {
+            this->release(&this->far.begin()->second);
+        }
+    }
+
+    size_t size() {
+        return this->count;
+    }
+};
+
+#endif
@@ -0,0 +1,86 @@
+#!/bin/bash
+# Build profile training and comparison, driven by np_loadgen
+#
+# usage: np_profile.sh train                 run the instrumented servers (make pgo)
+#        np_profile.sh compare [profile...]  build each profile and measure it
+#
+# Profiles are Makefile targets: all (the default -O0 build), release, lto, pgo.
+# NP_WORKDIR is where the servers run. It needs bin/ with the shell commands
+# and test.html, a scratch directory with system stand-ins is made if unset.
+# NP_PORT, NP_CLIENTS and NP_LINES tune the load.
+
+REPO=$(cd "$(dirname "$0")" && pwd)
+PORT=${NP_PORT:-7001}
+CLIENTS=${NP_CLIENTS:-8}
+LINES=${NP_LINES:-200}
+SERVERS=("np_simple" "np_single_proc" "np_multi_proc" "np_multi_proc --threads")
+
+setup_workdir() {
+    if [ -n "$NP_WORKDIR" ]; then
+        WORK=$NP_WORKDIR
+        return
+    fi
+    WORK=$(mktemp -d /tmp/np_profile.XXXXXX)
+    trap 'rm -rf "$WORK"' EXIT
+    mkdir -p "$WORK/bin"
+    for prog in ls cat wc; do
+        ln -s "$(command -v $prog)" "$WORK/bin/$prog"
+    done
+    # The servers set PATH to bin:., so the stand-ins use absolute paths
+    printf '#!/bin/sh\nexec %s '\''{printf "%%4d %%s\\n", NR, $0}'\''\n' "$(command -v awk)" > "$WORK/bin/number"
+    printf '#!/bin/sh\nexec %s -e '\''s/<[^>]*>//g'\'' "$@"\n' "$(command -v sed)" > "$WORK/bin/removetag"
+    printf '#!/bin/sh\n' > "$WORK/bin/noop"
+    chmod +x "$WORK/bin/number" "$WORK/bin/removetag" "$WORK/bin/noop"
+    cp "$REPO/test.html" "$WORK/"
+}
+
+run_server() {
+    # usage: run_server "binary [options]", prints the np_loadgen report
+    local binary options pid
+
+    read -r binary options <<< "$1"
+    (cd "$WORK" && NP_RATELIMIT=off exec "$REPO/$binary" "$PORT" $options > /dev/null 2>&1) &
+    pid=$!
+    sleep 0.5
+    "$REPO/np_loadgen" 127.0.0.1 "$PORT" "$CLIENTS" "$LINES"
+
+    # Let the sessions exit, so instrumented processes write their profile
+    sleep 1
+    kill -INT $pid 2> /dev/null
+    sleep 0.5
+    kill -KILL $pid 2> /dev/null
+    wait $pid 2> /dev/null
+    PORT=$((PORT + 1))
+}
+
+train() {
+    for server in "${SERVERS[@]}"; do
+        echo "Training $server"
+        run_server "$server" || exit 1
+    done
+}
+
+compare() {
+    local profiles=${*:-all release lto pgo}
+    local report=""
+
+    for profile in $profiles; do
+        make -C "$REPO" clean > /dev/null
+        if ! make -C "$REPO" $profile > /dev/null 2>&1; then
+            echo "Build of $profile failed"
+            exit 1
+        fi
+        for server in "${SERVERS[@]}"; do
+            report+=$(printf "%-8s %-24s %s" $profile "$server" "$(run_server "$server" | tail -n 1)")$'\n'
+        done
+    done
+    echo
+    printf "%s" "$report"
+}
+
+setup_workdir
+case "$1" in
+    train)   train ;;
+    compare) shift; compare "$@" ;;
+    *)       sed -n '4,5p' "$0"; exit 1 ;;
+esac
@@ -0,0 +1,155 @@
+#ifndef NP_RATELIMIT_H
+#define NP_RATELIMIT_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+
+#include "np_trace.h"
+
+using namespace std;
+
+/*
+ * Admission control
+ *
+ * Token buckets refilled at a fixed rate up to a burst size. Logins are
+ * limited per source address before a user is created or forked, commands are
+ * limited per user before they are parsed, and yell/tell are limited per
+ * user by message bytes. A rejected request costs one hash lookup.
+ *
+ * NP_RATELIMIT=off admits everything, for load generation from one host.
+ */
+#define RATE_ENV                "NP_RATELIMIT"
+#define RATE_LOGIN_PER_SEC      2.0
+#define RATE_LOGIN_BURST        10.0
+#define RATE_COMMAND_PER_SEC    20.0
+#define RATE_COMMAND_BURST      50.0
+#define RATE_MSG_BYTES_PER_SEC  2048.0
+#define RATE_MSG_BYTES_BURST    16384.0 // Larger than MAX_BUF_SIZE
+#define RATE_IP_TABLE_LIMIT     4096    // Idle entries are dropped beyond this
+
+typedef struct login_key {
+    uint64_t prefix, host;  // IPv4 as v4-mapped, IPv6 without the host half
+    bool operator==(const login_key &other) const {
+        return this->prefix == other.prefix && this->host == other.host;
+    }
+} LoginKey;
+
+struct login_key_hash {
+    size_t operator()(const LoginKey &key) const {
+        return hash<uint64_t>()(key.prefix * 0x9e3779b97f4a7c15ULL ^ key.host);
+    }
+};
+
+typedef struct token_bucket {
+    double tokens;
+    long last_ns;       // 0 for a fresh bucket, which starts full
+} TokenBucket;
+
+namespace rate_space {
+    unordered_map<LoginKey, TokenBucket, login_key_hash> login_buckets;
+    atomic<unsigned long> rejected_logins(0), rejected_commands(0), rejected_msgs(0);   // Bumped by any worker thread
+    bool enabled = true;
+
+    void init() {
+        char *policy = getenv(RATE_ENV);
+
+        if (policy != NULL && strcmp(policy, "off") == 0) {
+            enabled = false;
+        }
+    }
+
+    bool take(TokenBucket *bucket, double cost, double rate, double burst) {
+        long now;
+
+        if (!enabled) {
+            return true;
+        }
+        now = trace_space::now_ns();
+        if (bucket->last_ns == 0) {
+            bucket->tokens = burst;
+        } else {
+            bucket->tokens += (now - bucket->last_ns) / 1e9 * rate;
+            if (bucket->tokens > burst) bucket->tokens = burst;
+        }
+        bucket->last_ns = now;
+
+        if (bucket->tokens < cost) {
+            return false;
+        }
+        bucket->tokens -= cost;
+        return true;
+    }
+
+    LoginKey login_key(const sockaddr_storage &addr) {
+        /*
+         * One bucket per IPv4 address, and per /64 for IPv6 since a host
+         * picks any address of its /64. An IPv4 client keys the same from
+         * the dual-stack socket as from an IPv4 one.
+         */
+        LoginKey key = {0, 0};
+        struct in6_addr ip;
+
+        if (addr.ss_family == AF_INET6) {
+            ip = ((const sockaddr_in6 *)&addr)->sin6_addr;
+        } else {
+            in_addr_t ip4 = ((const sockaddr_in *)&addr)->sin_addr.s_addr;
+
+            memset(&ip, 0, sizeof(ip));
+            ip.s6_addr[10] = ip.s6_addr[11] = 0xff;
+            memcpy(&ip.s6_addr[12], &ip4, sizeof(ip4));
+        }
+        memcpy(&key.prefix, &ip.s6_addr[0], sizeof(key.prefix));
+        if (IN6_IS_ADDR_V4MAPPED(&ip)) {
+            memcpy(&key.host, &ip.s6_addr[8], sizeof(key.host));
+        }
+        return key;
+    }
+
+    bool admit_login(const sockaddr_storage &addr) {
+        if (login_buckets.size() >= RATE_IP_TABLE_LIMIT) {
+            // Full buckets carry no state, forget them
+            long now = trace_space::now_ns();
+
+            for (auto iter = login_buckets.begin(); iter != login_buckets.end(); ) {
+                double refilled = iter->second.tokens + (now - iter->second.last_ns) / 1e9 * RATE_LOGIN_PER_SEC;
+                iter = (refilled >= RATE_LOGIN_BURST) ? login_buckets.erase(iter) : next(iter);
+            }
+        }
+
+        if (!take(&login_buckets[login_key(addr)], 1, RATE_LOGIN_PER_SEC, RATE_LOGIN_BURST)) {
+            ++rejected_logins;
+            return false;
+        }
+        return true;
+    }
+
+    bool admit_command(TokenBucket *bucket) {
+        if (!take(bucket, 1, RATE_COMMAND_PER_SEC, RATE_COMMAND_BURST)) {
+            ++rejected_commands;
+            return false;
+        }
+        return true;
+    }
+
+    bool admit_msg(TokenBucket *bucket, size_t bytes) {
+        if (!take(bucket, bytes, RATE_MSG_BYTES_PER_SEC, RATE_MSG_BYTES_BURST)) {
+            ++rejected_msgs;
+            return false;
+        }
+        return true;
+    }
+
+    void report() {
+        cerr << "Admission control: rejected " << rejected_logins << " logins, "
+             << rejected_commands << " commands, " << rejected_msgs << " messages" << endl;
+    }
+}
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef NP_REDIRECT_H
+#define NP_REDIRECT_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+ * File redirection
+ *
+ * `> file`, `>> file` and `< file` are resolved by the server before any
+ * process of the line is forked, so a file that cannot be opened is reported
+ * once and nothing is spawned. The files are opened close-on-exec and only
+ * the process that owns the redirection dup2's them. The commands write to
+ * the file directly, so there is no copy through the server.
+ *
+ * NP_FSYNC selects the durability of output files:
+ *   none   leave it to the page cache (default)
+ *   dsync  open with O_DSYNC, every write is durable when it returns
+ *   exit   fdatasync once the line's final process has been waited
+ */
+#define REDIRECT_FSYNC_ENV  "NP_FSYNC"
+#define REDIRECT_FILE_MODE  (S_IRUSR | S_IWUSR)
+
+enum { FSYNC_NONE, FSYNC_DSYNC, FSYNC_EXIT };
+
+typedef struct redirection {
+    int in;     // -1 when not redirected
+    int out;
+} Redirection;
+
+namespace redirect_space {
+    int fsync_policy = FSYNC_NONE;
+
+    void init() {
+        char *policy = getenv(REDIRECT_FSYNC_ENV);
+
+        if (policy == NULL) {
+            return;
+        }
+        if (strcmp(policy, "dsync") == 0) {
+            fsync_policy = FSYNC_DSYNC;
+        } else if (strcmp(policy, "exit") == 0) {
+            fsync_policy = FSYNC_EXIT;
+        }
+    }
+
+    bool is_operator(const string &arg) {
+        return arg == ">" || arg == ">>" || arg == "<";
+    }
+
+    int open_file(const string &op, const string &path) {
+        int flags = O_CLOEXEC;
+
+        if (op == "<") {
+            flags |= O_RDONLY;
+        } else {
+            flags |= O_WRONLY | O_CREAT | ((op == ">>") ? O_APPEND : O_TRUNC);
+            if (fsync_policy == FSYNC_DSYNC) flags |= O_DSYNC;
+        }
+        return open(path.c_str(), flags, REDIRECT_FILE_MODE);
+    }
+
+    void close_all(vector<Redirection> &redirs) {
+        for (auto &r: redirs) {
+            if (r.in >= 0)  close(r.in);
+            if (r.out >= 0) close(r.out);
+        }
+        redirs.clear();
+    }
+
+    bool open_all(vector<string> &cmds, vector<Redirection> &redirs, string &error) {
+        /*
+         * One Redirection per pipeline stage. On failure every file opened so
+         * far is closed and error holds the message for the user.
+         */
+        redirs.assign(cmds.size(), Redirection{-1, -1});
+
+        for (size_t i = 0; i < cmds.size(); i++) {
+            istringstream iss(cmds[i]);
+            string arg, op;
+
+            while (iss >> arg) {
+                if (op.empty()) {
+                    if (is_operator(arg)) op = arg;
+                    continue;
+                }
+
+                int fd = open_file(op, arg);
+                int *slot = (op == "<") ? &redirs[i].in : &redirs[i].out;
+
+                if (fd < 0) {
+                    error = "*** Error: " + arg + ": " + strerror(errno) + ". ***\n";
+                    close_all(redirs);
+                    return false;
+                }
+                // The last redirection of a kind wins, as in sh
+                if (*slot >= 0) close(*slot);
+                *slot = fd;
+                op.clear();
+            }
+            if (!op.empty()) {
+                error = "*** Error: missing file name after '" + op + "'. ***\n";
+                close_all(redirs);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void strip(vector<string> &args) {
+        // Remove operators and their file names from the argument list
+        size_t n = 0;
+
+        for (size_t i = 0; i < args.size(); i++) {
+            if (is_operator(args[i])) {
+                ++i;
+                continue;
+            }
+            args[n++] = args[i];
+        }
+        args.resize(n);
+    }
+
+    void apply(Redirection &r) {
+        // Invoked in the child, after pipes are set up, so files take precedence
+        if (r.in >= 0)  dup2(r.in, STDIN_FILENO);
+        if (r.out >= 0) dup2(r.out, STDOUT_FILENO);
+    }
+
+    void release(Redirection &r, vector<int> &sync_fds) {
+        // Invoked in the parent once the owning process has been forked
+        if (r.in >= 0) {
+            close(r.in);
+        }
+        if (r.out >= 0) {
+            if (fsync_policy == FSYNC_EXIT) {
+                sync_fds.push_back(r.out);
+            } else {
+                close(r.out);
+            }
+        }
+        r.in = r.out = -1;
+    }
+
+    void sync(vector<int> &sync_fds) {
+        for (int fd: sync_fds) {
+            fdatasync(fd);
+            close(fd);
+        }
+        sync_fds.clear();
+    }
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef NP_RELAY_H
+#define NP_RELAY_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "np_trace.h"
+
+using namespace std;
+
+/*
+ * Output relay
+ *
+ * With NP_RELAY=on the commands of np_single_proc never get the client
+ * socket. Each command line writes into a pipe of its own, the stdout of
+ * the final stage and the stderr of every stage, and the event loop moves
+ * the bytes on to the socket with splice, without copying them through
+ * the server. A loop round moves at most RELAY_QUOTA bytes per session,
+ * the sessions taking turns to go first, so one large output cannot fill
+ * the socket queues ahead of everyone else.
+ *
+ * The client socket is non-blocking once relayed and SIGPIPE is ignored
+ * by the server, a client that left only ends the relay.
+ */
+#define RELAY_ENV       "NP_RELAY"
+#define RELAY_QUOTA     (64 * 1024)     // Bytes per session per loop round
+
+enum { RELAY_OPEN, RELAY_BLOCKED, RELAY_DONE };
+
+typedef struct relay {
+    int fd;                 // Read end, non-blocking
+    bool is_waited;         // The session holds its prompt until the end
+} Relay;
+
+typedef struct relay_stats {
+    size_t bytes = 0;
+    long busy_ns = 0;       // While the session had a relay open
+    long open_ns = 0;       // Start of the current busy period, 0 if idle
+} RelayStats;
+
+namespace relay_space {
+    bool enabled = false;
+    size_t total_bytes = 0;
+
+    void init() {
+        char *mode = getenv(RELAY_ENV);
+
+        if (mode != NULL && strcmp(mode, "on") == 0) {
+            enabled = true;
+            signal(SIGPIPE, SIG_IGN);
+        }
+    }
+
+    int open(vector<Relay> &relays, RelayStats *stats, int outfd) {
+        // Returns the write end for the commands, -1 to write to outfd directly
+        int fds[2];
+
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+            perror("Relay pipe");
+            return -1;
+        }
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(outfd, F_SETFL, fcntl(outfd, F_GETFL) | O_NONBLOCK);
+
+        if (relays.empty()) stats->open_ns = trace_space::now_ns();
+        relays.push_back(Relay{fds[0], false});
+        return fds[1];
+    }
+
+    void close_relay(vector<Relay> &relays, size_t idx, RelayStats *stats) {
+        close(relays[idx].fd);
+        relays.erase(relays.begin() + idx);
+        if (relays.empty() && stats->open_ns != 0) {
+            stats->busy_ns += trace_space::now_ns() - stats->open_ns;
+            stats->open_ns = 0;
+        }
+    }
+
+    int forward(int fd, int outfd, size_t *quota, RelayStats *stats) {
+        // Moves up to *quota bytes, RELAY_DONE at EOF or once the client is gone
+        while (*quota > 0) {
+            ssize_t n = splice(fd, NULL, outfd, NULL, *quota, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+            if (n > 0) {
+                *quota -= n;
+                stats->bytes += n;
+                total_bytes += n;
+                continue;
+            }
+            if (n == 0) return RELAY_DONE;
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) return RELAY_DONE;
+
+            // Either the pipe is empty or the socket is full
+            int pending = 0;
+            ioctl(fd, FIONREAD, &pending);
+            return (pending > 0) ? RELAY_BLOCKED : RELAY_OPEN;
+        }
+        return RELAY_OPEN;
+    }
+
+    string usage(RelayStats *stats) {
+        ostringstream oss;
+        long busy_ns = stats->busy_ns;
+
+        if (stats->open_ns != 0) busy_ns += trace_space::now_ns() - stats->open_ns;
+        oss << "output: " << stats->bytes / 1024 << " KB, "
+            << ((busy_ns > 0) ? (double)stats->bytes / 1024 / 1024 / (busy_ns / 1e9) : 0.0)
+            << " MB/s while busy" << endl;
+        return oss.str();
+    }
+
+    void report() {
+        if (enabled) {
+            cerr << "Output relay: " << total_bytes << " bytes spliced" << endl;
+        }
+    }
+}
+
+#endif
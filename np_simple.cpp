@@ -11,15 +11,18 @@ int main(int argc,char const *argv[]) {
         exit(0);
     }
 
-    struct sockaddr_in c_addr;
+    struct sockaddr_storage c_addr;
     int listen_sock, client_sock, c_addr_len;
-    int status_code;
 
     bzero((char *)&c_addr, sizeof(c_addr));
 
     listen_sock = get_listen_socket(argv[1]);
     
     signal(SIGCHLD, child_handler);
+    trace_space::init();
+    limit_space::init();
+    redirect_space::init();
+    journal_space::init();
 
     while (1) {
         c_addr_len = sizeof(c_addr);
@@ -13,6 +13,7 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <poll.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <iostream>
@@ -22,32 +23,21 @@
 #include <algorithm>
 #include <vector>
 
+#include "np_core.h"
+#include "np_trace.h"
+#include "np_limits.h"
+#include "np_number_pipe.h"
+#include "np_redirect.h"
+#include "np_builtin.h"
+#include "np_telnet.h"
+#include "np_compress.h"
+#include "np_journal.h"
+
 using namespace std;
 
 #define DEBUG_CMD   0
 #define DEBUG_ARG   1
-
-struct mypipe {
-    int in;
-    int out;
-};
-
-struct my_number_pipe {
-    int in;
-    int out;
-    int number;
-};
-
-struct my_command {
-    string cmd;           // Cut by number|error pipe
-    vector<string> cmds;  // Split by pipe
-    int  number;
-    bool has_pipe;
-};
-
-typedef struct mypipe Pipe;
-typedef struct my_number_pipe NumberPipe;
-typedef struct my_command Command;
+#define SIMPLE_READ_SIZE    4096
 
 /* Function Prototype */
 // Debug Function
@@ -60,35 +50,39 @@ void child_handler(int sig);
 // Built-in Function
 void my_setenv(string var, string value);
 void my_printenv(string var);
+void my_usage();
+void my_compress();
 bool handle_builtin(string cmd);
 // Parse Function
-vector<string> parse_pipe(string input);
-int calc(string input);
-vector<Command> parse_number_pipe(string input);
 void parse_command(string input);
 // Executor
 void execute_command(vector<string> args);
 void main_executor(Command &command);
 int run_npshell();
 // Others
-bool is_white_char(string cmd);
-void decrement_number_pipes();
-int get_listen_socket(const char *port);
+bool read_line(string &input);
 
 
 /* Global Variables */
 vector<Pipe> pipes;
-vector<NumberPipe> number_pipes;
+NumberPipeWheel number_pipes;
+string session_name;     // cgroup of this session
+vector<int> sync_fds;    // Redirected outputs to fdatasync, see np_redirect.h
+TelnetState telnet;      // Telnet state of the client on stdin
+string inbuf;            // Received bytes not yet cut into lines
+bool is_compressed = false;     // stdout and stderr go through np_compress.h
+long line_start_ns;     // When the running line was read
+int line_status;        // Of its last waited process, see np_journal.h
 
 void debug_vector(int type, vector<string> &cmds) {
-    for (int i = 0; i < cmds.size(); i++) {
+    for (size_t i = 0; i < cmds.size(); i++) {
         switch (type)
         {
         case DEBUG_CMD:
-            printf("CMD[%d]: %s\n", i, cmds[i].c_str());
+            printf("CMD[%zu]: %s\n", i, cmds[i].c_str());
             break;
         case DEBUG_ARG:
-            printf("ARG[%d]: %s\n", i, cmds[i].c_str());
+            printf("ARG[%zu]: %s\n", i, cmds[i].c_str());
             break;
         default:
             break;
@@ -99,12 +93,11 @@ void debug_vector(int type, vector<string> &cmds) {
 void debug_number_pipes() {
     if (number_pipes.size() > 0) {    
         cerr << "Number Pipes" << endl;
-        for (size_t i = 0; i < number_pipes.size(); i++) {
-            cerr << "\tIndex: "  << i 
-                 << "\tNumber: " << number_pipes[i].number
-                 << "\tIn: "     << number_pipes[i].in
-                 << "\tOut: "    << number_pipes[i].out << endl;
-        }
+        number_pipes.for_each([](long distance, int in, int out) {
+            cerr << "\tNumber: " << distance
+                 << "\tIn: "     << in
+                 << "\tOut: "    << out << endl;
+        });
     }
 }
 
@@ -136,66 +129,6 @@ void child_handler(int sig) {
     return;
 }
 
-bool is_white_char(string cmd) {
-    for (size_t i = 0; i < cmd.length(); i++) {
-        if(isspace(cmd[i]) == 0) {
-            return false;
-        }
-    }
-    return true;
-}
-
-void decrement_number_pipes() {
-    for (size_t i = 0; i < number_pipes.size(); i++) {
-        --number_pipes[i].number;
-    }
-}
-
-int get_listen_socket(const char *port) {
-    struct sockaddr_in s_addr;
-    int listen_sock;
-    int status_code;
-
-    // Init variable
-    bzero((char *)&s_addr, sizeof(s_addr));
-
-    // Init server address
-    s_addr.sin_family = AF_INET;
-    s_addr.sin_addr.s_addr = INADDR_ANY;
-    s_addr.sin_port = htons((u_short)atoi(port));
-
-    // Create socket
-    listen_sock = socket(s_addr.sin_family, SOCK_STREAM, 0);
-    if (listen_sock < 0) {
-        perror("Server create socket");
-        exit(0);
-    }
-
-    // Socket setting
-    int optval = 1;
-    status_code = setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
-    if (status_code < 0) {
-        perror("Set socket option");
-        exit(0);
-    }
-
-    // Bind socket
-    status_code = bind(listen_sock, (struct sockaddr *) &s_addr, sizeof(s_addr));
-    if (status_code < 0) {
-        perror("Server bind");
-        exit(0);
-    }
-
-    // Listen socket
-    status_code = listen(listen_sock, 5);
-    if (status_code < 0) {
-        perror("Server listen");
-        exit(0);
-    }
-
-    return listen_sock;
-}
-
 void my_setenv(string var, string value) {
     /*
     Change or add an environment variable.
@@ -216,149 +149,62 @@ void my_printenv(string var) {
         cout << value << endl;
 }
 
-bool handle_builtin(string cmd) {
-    istringstream iss(cmd);
-    string prog;
-
-    getline(iss, prog, ' ');
-
-    if (prog == "setenv") {
-        string var, value;
-
-        getline(iss, var, ' ');
-        getline(iss, value, ' ');
-        my_setenv(var, value);
-
-        return true;
-    } else if (prog == "printenv") {
-        string var;
-
-        getline(iss, var, ' ');
-        my_printenv(var);
-
-        return true;
-    } else if (prog == "exit") {
-        exit(0);
-
-        return true;
-    }
-
-    return false;
-}
-
-vector<string> parse_pipe(string input) {
-    vector<string> cmds;
-    string pipe_symbol("| ");
-    int pos;
-
-    // Parse pipe
-    while ((pos = input.find(pipe_symbol)) != string::npos) {
-        cmds.push_back(input.substr(0, pos));
-        input.erase(0, pos + pipe_symbol.length());
-    }
-    cmds.push_back(input);
-
-    // Remove space
-    for (size_t i = 0; i < cmds.size(); i++) {
-        int head = 0, tail = cmds[i].length() - 1;
-
-        while(cmds[i][head] == ' ') ++head;
-        while(cmds[i][tail] == ' ') --tail;
-
-        if (head != 0 || tail != cmds[i].length() - 1) {
-            cmds[i] = cmds[i].substr(head, tail + 1);
-        }
-    }
+void my_usage() {
+    /*
+    Print the resource usage of the commands of this session.
+    */
+    struct rusage ru;
 
-    return cmds;
+    getrusage(RUSAGE_CHILDREN, &ru);
+    cout << limit_space::usage(session_name, &ru);
 }
 
-int calc(string input) {
-    int arr[2], pos, res;
-    string n1, n2;
-
-    pos = input.find("+");
-    n1 = input.substr(0, pos);
-    n2 = input.substr(pos+1, input.length()-pos-1);
-    res = atoi(n1.c_str()) + atoi(n2.c_str());
+void my_compress() {
+    // The rest of the session, this shell and its commands, is compressed
+    if (is_compressed) return;
 
-    // cout << "n1 = " << n1 << " n2 = " << n2 << " res = " << res << endl;
+    fflush(stdout);
+    int fd = compress_space::spawn(STDOUT_FILENO);
+    if (fd < 0) return;
 
-    return res;
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+    is_compressed = true;
 }
 
-vector<Command> parse_number_pipe(string input) {
-    /*
-     *    "removetag test.html |2 ls | number |1"
-     * -> ["removetag test.html |2", "ls | number |1"]
-     */
-    vector<Command> lines;
-    regex pattern("[|!][1-9]\\d?\\d?[0]?\\+?[1-9]?\\d?\\d?[0]?");
-    regex pattern2("[1-9]\\d?\\d?[0]?\\+?[1-9]?\\d?\\d?[0]?");
-    smatch result;
-
-    while(regex_search(input, result, pattern)) {
-        Command command;
-        string tmp;
-        tmp = input.substr(0, result.position() + result.length());
-
-        if (tmp.find("+") == string::npos) {
-            command.cmd = input.substr(0, result.position() + result.length());
-            command.number = atoi(input.substr(result.position() + 1, result.length() - 1).c_str());
-            input.erase(0, result.position() + result.length());
-        } else {
-            int n;
-            n = calc(input.substr(result.position()+1, result.length()-1));
-            tmp = regex_replace(tmp, pattern2, to_string(n));
-            // cout << input << endl;
-            // cout << tmp << endl;
-            command.cmd = tmp;
-            command.number = n;
-
-            input.erase(0, result.position() + result.length());
-            // break;
-        }
-
-        lines.push_back(command);
-    }
-
-    if (input.length() != 0) {
-        Command command{cmd: input};
-        
-        lines.push_back(command);
-    }
-
-    if (lines.size() == 0) {
-        // Normal Pipe
-        Command command{cmd: input};
-
-        lines.push_back(command);
-    }
+bool handle_builtin(string cmd) {
+    BuiltinCall call;
 
-    // Split by pipe
-    for (size_t i = 0; i < lines.size(); i++) {
-        lines[i].cmds = parse_pipe(lines[i].cmd); 
+    if (!builtin_space::parse(cmd, call)) {
+        return false;
     }
 
-    // Debug
-    #if 0
-    for (size_t i = 0; i < lines.size(); i++) {
-        cout << "Line " << i << ": " << lines[i].cmd << endl;
-        cout << "\tCommand: " << lines[i].cmd << endl;
-        cout << "\tCommand Size: " << lines[i].cmds.size() << endl;
-        cout << "\tNumber: " << lines[i].number << endl;
+    switch (call.id) {
+    case BUILTIN_setenv:
+        my_setenv(string(call.args[0]), string(call.args[1]));
+        return true;
+    case BUILTIN_printenv:
+        my_printenv(string(call.args[0]));
+        return true;
+    case BUILTIN_usage:
+        my_usage();
+        return true;
+    case BUILTIN_compress:
+        my_compress();
+        return true;
+    case BUILTIN_exit:
+        journal_space::record(getpid(), cmd, JOURNAL_NO_STATUS, line_start_ns);
+        journal_space::flush();
+        limit_space::remove_session(session_name);
+        exit(0);
+    default:
+        // Not a builtin of this server, run it as a program
+        return false;
     }
-    #endif
-        
-    return lines;
 }
 
 void execute_command(vector<string> args) {
-    int fd;
-    bool need_file_redirection = false;
-    const char *prog = args[0].c_str();
-    const char **c_args = new const char* [args.size()+1];  // Reserve one location for NULL
-
     #if 0
     cerr << "Execute Command Args: ";
     for (size_t i = 0; i < args.size(); i++) {
@@ -367,35 +213,16 @@ void execute_command(vector<string> args) {
     cerr << endl;
     #endif
 
-    /* Parse Arguments */
-    for (size_t i = 0; i < args.size(); i++) {
-        if (args[i] == ">") {
-            need_file_redirection = true;
-            fd = open(args[i+1].c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-            args.pop_back();  // Remove file name
-            args.pop_back();  // Remove redirect symbol
-            break;
-        }
-        c_args[i] = args[i].c_str();
-    }
-    c_args[args.size()] = NULL;
-
-    // Check if need file redirection
-    if (need_file_redirection) {
-        dup2(fd, STDOUT_FILENO);
-        close(fd);
-    }
+    // Execute Command, redirection is already stripped and applied
+    exec_args(args);
 
-    // Execute Command
-    if (execvp(prog, (char **)c_args) == -1) {
-        cerr << "Unknown command: [" << args[0] << "]." << endl;
-        exit(1);
-    }
+    cerr << "Unknown command: [" << args[0] << "]." << endl;
+    exit(1);
 }
 
 void main_executor(Command &command) {
     /* Pre-Process */
-    decrement_number_pipes();
+    number_pipes.advance();
     if (command.cmds.size() == 1) {
         if (handle_builtin(command.cmds[0]))    return;
     }
@@ -403,54 +230,43 @@ void main_executor(Command &command) {
     cout << "Handle " << command.cmd << endl;
     #endif
 
+    // Open redirected files first, nothing is forked if one fails
+    vector<Redirection> redirs;
+    string error;
+
+    if (!redirect_space::open_all(command.cmds, redirs, error)) {
+        cerr << error;
+        return;
+    }
+
     vector<string> args;
     string error_pipe_symbol = "!", pipe_symbol = "|";
-    string arg;
     bool is_error_pipe = false, is_number_pipe = false;
+    PendingPipe *number_pipe_out = NULL;
 
     // Handle a command per loop
     for (size_t i = 0; i < command.cmds.size(); i++) {
-        istringstream iss(command.cmds[i]);
         vector<string> args;
         pid_t pid;
-        int pipefd[2];
-        bool is_first_cmd = false, is_final_cmd = false;
+        bool is_final_cmd = false;
 
-        if (i == 0)                        is_first_cmd = true;
         if (i == command.cmds.size() - 1)  is_final_cmd = true;
 
         /* Parse Command to Args */
-        while (getline(iss, arg, ' ')) {
+        for (auto &arg: split_args(command.cmds[i])) {
             bool ignore_arg = false;
 
-            if (is_white_char(arg)) continue;
-
             // Handle number and error pipe
             if (is_final_cmd) {
                 if ((is_number_pipe = (arg.find("|") != string::npos)) ||
                     (is_error_pipe  = (arg.find("!") != string::npos))) {
-                    bool is_add = false;
                     ignore_arg = true;
 
-                    for (int x=0; x < number_pipes.size(); ++x) {
-                        // Same number means that using the same pipe
-                        if (number_pipes[x].number == command.number) {
-                            number_pipes.push_back(NumberPipe{
-                                in:     number_pipes[x].in,
-                                out:    number_pipes[x].out,
-                                number: command.number
-                            });
-                            is_add = true;
-                            break;
-                        }
-                    }
-                    // No match, Create a new pipe
-                    if (!is_add) {
-                        pipe(pipefd);
-                        number_pipes.push_back(NumberPipe{
-                            in: pipefd[0],
-                            out: pipefd[1],
-                            number: command.number});
+                    // Same number means that using the same pipe
+                    number_pipe_out = number_pipes.get(command.number);
+                    if (number_pipe_out == NULL) {
+                        // Out of descriptors, the output is dropped
+                        cout << "*** Error: " << strerror(errno) << ". ***" << endl;
                     }
                     #if 0
                     debug_number_pipes();
@@ -462,23 +278,30 @@ void main_executor(Command &command) {
                 args.push_back(arg);
             }
         }
+        redirect_space::strip(args);
 
         /* Create Normal Pipe */
-        if (!is_error_pipe && !is_number_pipe) {
-            if(!is_final_cmd && command.cmds.size() > 1) {
-                pipe(pipefd);
-                pipes.push_back(Pipe{in: pipefd[0], out: pipefd[1]});
-                #if 0
-                debug_pipes();
-                #endif
+        if (!is_final_cmd) {
+            if (!open_stage_pipe(pipes, error)) {
+                // The stages forked so far see the end of their input
+                cout << error;
+                number_pipes.release_current();
+                redirect_space::close_all(redirs);
+                return;
             }
+            #if 0
+            debug_pipes();
+            #endif
         }
 
         // cout << "Start Fork" << endl;
-        do {
-            pid = fork();
-            usleep(5000);
-        } while (pid < 0);
+        {
+            TRACE_SPAN("fork");
+            do {
+                pid = fork();
+                usleep(5000);
+            } while (pid < 0);
+        }
 
         if (pid > 0) {
             /* Parent Process */
@@ -489,25 +312,13 @@ void main_executor(Command &command) {
             #endif
             /* Close Pipe */
             // Normal Pipe
-            if (i != 0) {
-                close(pipes[i-1].in);
-                close(pipes[i-1].out);
-            }
+            close_stage_pipe(pipes, i);
 
-            // Number Pipe
-            for (int x=0; x < number_pipes.size(); ++x) {
-                if (number_pipes[x].number == 0) {
-                    #if 0
-                    cout << "Parent Close number pipe: " << x << endl;
-                    #endif
-                    close(number_pipes[x].in);
-                    close(number_pipes[x].out);
-                    
-                    // Remove number pipe
-                    number_pipes.erase(number_pipes.begin() + x);
-                    --x;
-                }
-            }
+            // Number Pipe, the first process has taken it
+            number_pipes.release_current();
+
+            // Redirected files
+            redirect_space::release(redirs[i], sync_fds);
 
             if (is_final_cmd && !(is_number_pipe || is_error_pipe)) {
                 // Final process, wait
@@ -515,7 +326,12 @@ void main_executor(Command &command) {
                 cout << "Parent Wait Start" << endl;
                 #endif
                 int st;
-                waitpid(pid, &st, 0);
+                TRACE_SPAN("waitpid");
+                if (waitpid(pid, &st, 0) > 0) {
+                    // Not reaped by the SIGCHLD handler first
+                    line_status = journal_space::exit_code(st);
+                }
+                redirect_space::sync(sync_fds);
                 #if 0
                 cout << "Parent Wait End: " << st << endl;
                 #endif
@@ -525,7 +341,7 @@ void main_executor(Command &command) {
             #if 0
             usleep(2000);
             cout << "Child PID: " << getpid() << endl;
-            cout << "\tFirst? " << (is_first_cmd ? "True" : "False") << endl;
+            cout << "\tFirst? " << (i == 0 ? "True" : "False") << endl;
             cout << "\tFinal? " << (is_final_cmd ? "True" : "False") << endl;
             cout << "\tNumber? " << (is_number_pipe ? "True" : "False") << endl;
             cout << "\tError? " << (is_error_pipe ? "True" : "False") << endl;
@@ -535,139 +351,107 @@ void main_executor(Command &command) {
             usleep(5000);
             #endif
 
-            /* Duplicate pipe */ 
-            if (is_first_cmd) {
-                // Receive input from number pipe
-                for (size_t x = 0; x < number_pipes.size(); x++) {
-                    if (number_pipes[x].number == 0) {
-                        dup2(number_pipes[x].in, STDIN_FILENO);
-                        #if 0
-                        cerr << "First Number Pipe (in) " << number_pipes[x].in << " to " << STDIN_FILENO << endl;
-                        #endif
-                        break;
-                    }
-                }
+            /* Duplicate pipe */
+            // Input from number pipe, output to number pipe or /dev/null when it ran out
+            int source = -1, sink = -1;
 
-                // Setup output of normal pipe
-                if (pipes.size() > 0) {
-                    dup2(pipes[i].out, STDOUT_FILENO);
-                    #if 0
-                    cout << "First Normal Pipe (out) " << pipes[i].out << " to " << STDOUT_FILENO << endl;
-                    #endif
-                }
-            }
-
-            // Setup input and output of normal pipe
-            if (!is_first_cmd && !is_final_cmd) {
-                if (pipes.size() > 0) {
-                    dup2(pipes[i-1].in, STDIN_FILENO);
-                    dup2(pipes[i].out, STDOUT_FILENO);
-                }
-                #if 0
-                cout << "Internal (in) " << pipes[i-1].in << " to " << STDIN_FILENO << endl;
-                cout << "Internal (out) " << pipes[i].out << " to " << STDOUT_FILENO << endl;
-                #endif
-            }
-
-            if (is_final_cmd) {
-                if (is_number_pipe) {
-                    /* Setup Input */
-                    if (pipes.size() > 0) {
-                        // Receive from previous command via normal pipe
-                        dup2(pipes[i-1].in, STDIN_FILENO);
-                        #if 0
-                        cerr << "Final number Pipe (in) (from normal pip) " << pipes[i-1].in << " to " <<STDIN_FILENO << endl;
-                        #endif
-                    }
-                    /* Setup Output */
-                    for (size_t x = 0; x < number_pipes.size(); x++) {
-                        if (number_pipes[x].number == command.number) {
-                            dup2(number_pipes[x].out, STDOUT_FILENO);
-                            close(number_pipes[x].out);
-                            #if 0
-                            cerr << "Final Number Pipe (out) " << number_pipes[x].out << " to " << STDOUT_FILENO << endl;
-                            #endif
-                            break;
-                        }
-                    }
-                } else if (is_error_pipe) {
-                    /* Setup Input */
-                    if (pipes.size() > 0) {
-                        dup2(pipes[i-1].in, STDIN_FILENO);
-                    }
-                    /* Setup Output and Error */
-                    for (size_t x = 0; x < number_pipes.size(); x++) {
-                        if (number_pipes[x].number == command.number) {
-                            dup2(number_pipes[x].out, STDOUT_FILENO);
-                            dup2(number_pipes[x].out, STDERR_FILENO);
-                            break;
-                        }
-                    }
-                } else {
-                    /* Setup Input */
-                    if (pipes.size() > 0) {
-                        dup2(pipes[i-1].in, STDIN_FILENO);
-                        #if 0
-                        cout << "Final Pipe (out) " << pipes[i-1].in << " to " << STDIN_FILENO << endl;
-                        #endif
-                    }
-                }
-            }
-
-            /* Close pipe */
-            for (int ci = 0; ci < pipes.size(); ci++) {
-                close(pipes[ci].in);
-                close(pipes[ci].out);
+            if (PendingPipe *number_pipe_in = number_pipes.current()) {
+                source = number_pipe_in->in;
             }
-            for (int ci = 0; ci < number_pipes.size(); ci++) {
-                close(number_pipes[ci].in);
-                close(number_pipes[ci].out);
+            if (is_number_pipe || is_error_pipe) {
+                sink = number_pipe_out ? number_pipe_out->out : open("/dev/null", O_RDWR);
             }
+            #if 0
+            cerr << "Stage " << i << " (in) " << source << " (out) " << sink << endl;
+            #endif
+            apply_stage(wire_stage(pipes, i, command.cmds.size(), source, sink, is_error_pipe));
+            // Normal and number pipes are close-on-exec
 
+            redirect_space::apply(redirs[i]);
+            limit_space::apply(session_name);
             execute_command(args);
         }
     }
-    pipes.clear();
+    close_pipes(pipes);
 }
 
 void parse_command(string input) {
     vector<Command> lines;
 
-    lines = parse_number_pipe(input);
+    {
+        TRACE_SPAN("parse_number_pipe");
+        lines = parse_number_pipe(input);
+    }
 
     for (size_t i = 0; i < lines.size(); i++) {
         main_executor(lines[i]);
     }
 }
 
+bool read_line(string &input) {
+    // Cut the next line out of stdin, false at EOF or Ctrl-D
+    char buf[SIMPLE_READ_SIZE];
+    size_t pos;
+
+    while ((pos = inbuf.find('\n')) == string::npos) {
+        if (telnet.eof) return false;
+
+        int timeout_ms = journal_space::flush_timeout_ms();
+        if (timeout_ms >= 0) {
+            // Idle with records buffered, write them once they are due
+            struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+            int ready = poll(&pfd, 1, timeout_ms);
+
+            if (ready == 0) journal_space::tick();
+            if (ready <= 0) continue;
+        }
+
+        ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+
+        string reply;
+        telnet_space::filter(&telnet, buf, n, inbuf, reply);
+        if (!reply.empty()) {
+            cout << reply; fflush(stdout);
+        }
+        if (telnet.local[TELNET_OPT_COMPRESS2]) my_compress();
+    }
+    input = inbuf.substr(0, pos);
+    inbuf.erase(0, pos + 1);
+    return true;
+}
+
 int run_npshell() {
     string input;
 
     my_setenv("PATH", "bin:.");
+    session_name = "np_simple_" + to_string(getpid());
+    limit_space::create_session(session_name);
     signal(SIGINT, interrupt_handler);
     signal(SIGCHLD, child_handler);
 
     while (1) {
         cout << "% "; fflush(stdout);
-        input.clear();
-        getline(cin, input);
+        if (!read_line(input)) {
+            journal_space::flush();
+            limit_space::remove_session(session_name);
+            return 0;
+        }
         #if 0
         cout << "Input: " << input << endl;
         #endif
 
-        const char c = input.c_str()[0];
-        if (cin.eof() || c == 4) {
-            return 0;
-        }
-
         if ( input.empty() || is_white_char(input) ) {
             // cout << "X" <<endl;
             continue;
         }
 
-		input.erase(remove(input.begin(), input.end(), '\n'),input.end());
-		input.erase(remove(input.begin(), input.end(), '\r'),input.end());
+        TRACE_SPAN("command");
+        line_start_ns = trace_space::now_ns();
+        line_status = JOURNAL_NO_STATUS;
         parse_command(input);
+        journal_space::record(getpid(), input, line_status, line_start_ns);
     }
 
     return 0;
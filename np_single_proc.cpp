@@ -1,105 +1,202 @@
 /* Server 2 */
-/* Single-process concurrent (use select) */
+/* Single-process concurrent (use poll) */
 #include "np_single_proc.h"
 
 using namespace std;
 using namespace user_space;
 
 int listen_sock;
+volatile sig_atomic_t handoff_requested = 0;
+volatile sig_atomic_t report_requested = 0;
+volatile sig_atomic_t interrupt_requested = 0;
 
 void interrupt_handler(int sig) {
-    // Handle SIGINT
+    // Handle SIGINT, the loop closes the sockets and flushes the journal
+    interrupt_requested = 1;
+}
+
+void shutdown_process() {
     close(listen_sock);
-    for (auto &elem: user_table.table) {
-        close(elem.second->get_sockfd());
+    for (auto user: user_table.slots) {
+        if (user) close(user->get_sockfd());
     }
+    journal_space::flush();
     exit(0);
 }
 
+void report() {
+    // Dump trace, cache and admission statistics, from the event loop
+    trace_space::dump(TRACE_SIGNAL);
+    cache_space::report();
+    rate_space::report();
+    relay_space::report();
+    zygote_space::report();
+    batch_space::report();
+    for (auto user: user_table.slots) {
+        if (user && user->relay_stats.bytes > 0) {
+            cerr << "\tuser " << user->get_id() << " " << relay_space::usage(&user->relay_stats);
+        }
+    }
+}
+
+void report_handler(int sig) {
+    // Handle SIGUSR2, the reports allocate so they wait for the event loop
+    report_requested = 1;
+}
+
+void handoff_handler(int sig) {
+    // Handle SIGHUP, hand all sessions to a freshly exec'd server
+    handoff_requested = 1;
+}
+
 int main(int argc,char const *argv[]) {
-    if (argc != 2) {
+    bool is_resume = (argc == 4 && strcmp(argv[2], "--resume") == 0);
+
+    if (argc != 2 && !is_resume) {
         cout << "Usage: prog port" << endl;
         exit(0);
     }
+    for (char **env = environ; *env; ++env) {
+        server_env.push_back(*env);
+    }
     signal(SIGINT, interrupt_handler);
-
-    struct sockaddr_in c_addr;
+    signal(SIGHUP, handoff_handler);
+    trace_space::init();
+    cache_space::init();
+    limit_space::init();
+    zygote_space::init();
+    redirect_space::init();
+    rate_space::init();
+    relay_space::init();
+    journal_space::init();
+    signal(TRACE_SIGNAL, report_handler);
+
+    struct sockaddr_storage c_addr;
     int client_sock, c_addr_len;
-    int status_code;
-    int nfds;
-    fd_set afds, rfds;
+    PollSet pollset;
+    bool is_accept_paused = false;  // Out of descriptors, the listen socket waits a little
+    struct rlimit nofile;
+
+    // Every session holds a socket, pidfds and relay pipes, so take all the hard limit allows
+    getrlimit(RLIMIT_NOFILE, &nofile);
+    nofile.rlim_cur = nofile.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &nofile);
 
     // Initilize variables
     bzero((char *)&c_addr, sizeof(c_addr));
     c_addr_len = sizeof(c_addr);
-    FD_ZERO(&afds);
 
-    listen_sock = get_listen_socket(argv[1]);
+    if (is_resume) {
+        listen_sock = resume_process(atoi(argv[3]));
+        for (auto user: user_table.slots) {
+            if (user) start_session(user);
+        }
+    } else {
+        listen_sock = get_listen_socket(argv[1]);
+    }
+    // Accepted sockets do not inherit O_NONBLOCK, only the drain loop below sees it
+    fcntl(listen_sock, F_SETFL, fcntl(listen_sock, F_GETFL) | O_NONBLOCK);
     // listen_sock = get_listen_socket("12345");
-    nfds = listen_sock;
-
-    FD_SET(listen_sock, &afds);
     // Initilize variables done
     
 
     while (1) {
-        memcpy(&rfds, &afds, sizeof(rfds));
+        if (interrupt_requested) {
+            shutdown_process();
+        }
+        if (handoff_requested && session_space::is_idle()) {
+            handoff_requested = 0;
+            handoff_process(argv[0], argv[1], listen_sock);
+        }
+        if (report_requested) {
+            report_requested = 0;
+            report();
+        }
+
+        // Watch the listen socket, waiting sessions and unsent outboxes
+        pollset.clear();
+        if (!is_accept_paused) {
+            pollset.watch(listen_sock, POLLIN);
+        }
+        session_space::watch(pollset);
+        watch_relays(pollset);
+        for (auto user: user_table.slots) {
+            if (user && !user->outbox.empty()) {
+                pollset.watch(user->get_sockfd(), POLLOUT);
+            }
+        }
 
-        if (select(nfds+1, &rfds, (fd_set *)0, (fd_set *)0, (struct timeval *)0) < 0) {
-            perror("select error");
+        // Wake up for the journal batch once it is due
+        int timeout_ms = journal_space::flush_timeout_ms();
+        if (is_accept_paused) {
+            timeout_ms = (timeout_ms < 0) ? ACCEPT_RETRY_MS : min(timeout_ms, ACCEPT_RETRY_MS);
+            is_accept_paused = false;
+        }
+        if (pollset.wait(timeout_ms) < 0) {
+            if (errno == EINTR) {
+                // Interrupted by signal, e.g. trace dump
+                continue;
+            }
+            perror("poll error");
             exit(0);
         }
+        journal_space::tick();
 
-        if(FD_ISSET(listen_sock, &rfds)) {
+        // Drain the backlog, so the logins of one round share each user's sendmsg
+        for (int n = 0; n < ACCEPT_BATCH && pollset.is_readable(listen_sock); n++) {
+            c_addr_len = sizeof(c_addr);
             client_sock = accept(listen_sock, (struct sockaddr *) &c_addr, (socklen_t *) &c_addr_len);
+            if (client_sock < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                break;
+            }
+            if (client_sock < 0 && (errno == EMFILE || errno == ENFILE || errno == ECONNABORTED)) {
+                // The client waits in the backlog until sessions close descriptors
+                perror("Sever accept");
+                is_accept_paused = true;
+                break;
+            }
             if (client_sock < 0) {
                 perror("Sever accept");
                 exit(0);
             }
 
-            int uid = user_table.create_user(client_sock, c_addr);
+            int uid = -1;
 
-            if (uid < 0) {
+            if (!rate_space::admit_login(c_addr)) {
+                // Rejected before any user state is created
+                close(client_sock);
+            } else if ((uid = user_table.create_user(client_sock, c_addr)) < 0) {
                 cerr << "Online users are up to limit (" << USER_LIMIT << ")" << endl;
                 close(client_sock);
             } else {
-                FD_SET(client_sock, &afds);
                 UserInfo *client = user_table.get_user_by_id(uid);
 
                 welcome(client);
                 login_prompt(client);
                 command_prompt(client);
-
-                if (nfds < client_sock) {
-                    nfds = client_sock;
-                }
+                start_session(client);
 
                 #if 0
                 // user_table.show_table();
-                cout << "Online users: " << user_table.table.size() << endl;
+                cout << "Online users: " << user_table.size() << endl;
                 #endif
             }
         }
         
-        // Check if there are sockets are ready to be read
-        for(auto &elem: user_table.table) {
-            int fd = elem.second->get_sockfd();
+        // Resume sessions whose socket or child is ready
+        session_space::resume_ready(pollset);
 
-            if (fd != listen_sock && FD_ISSET(fd, &rfds)) {
-                int n = handle_client(fd);
+        // One sendmsg per user for everything queued in this round
+        flush_all_outbox(false);
 
-                if (n == BUILT_IN_EXIT) {
-                    // User leave
-                    FD_CLR(fd, &afds);
-                }
-            }
-        }
+        // Command output, a quota per user
+        forward_relays(pollset);
 
         // Clean the exit users
         if (user_table.del_queue.size() > 0) {
             user_table.del_process(user_pipes);
             #if 0
-            cout << "Online users: " << user_table.table.size() << endl;
+            cout << "Online users: " << user_table.size() << endl;
             #endif
         }
     }
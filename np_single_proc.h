@@ -1,6 +1,21 @@
 #ifndef NP_SINGLE_PROC
 #define NP_SINGLE_PROC
 #include <regex>
+#include "np_core.h"
+#include "np_trace.h"
+#include "np_cache.h"
+#include "np_limits.h"
+#include "np_number_pipe.h"
+#include "np_redirect.h"
+#include "np_builtin.h"
+#include "np_ratelimit.h"
+#include "np_telnet.h"
+#include "np_compress.h"
+#include "np_relay.h"
+#include "np_journal.h"
+#include "np_format.h"
+#include "np_zygote.h"
+#include "np_batch.h"
 #include <fcntl.h>
 #include <stdio.h>
 #include <sys/socket.h>
@@ -17,9 +32,20 @@
 #include <sstream>
 #include <string>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <algorithm>
 #include <vector>
 #include <cctype>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <limits.h>
+#include <memory>
+#include <deque>
+#include <coroutine>
+#include <sys/syscall.h>
 
 using namespace std;
 
@@ -27,26 +53,16 @@ using namespace std;
 #define BUILT_IN_EXIT   99
 #define BUILT_IN_TRUE   1
 #define BUILT_IN_FALSE  0
+#ifndef USER_LIMIT
 #define USER_LIMIT      30
+#endif
 #define DEFAULT_FD  -1
+#define HANDOFF_FD_CHUNK    128     // Less than SCM_MAX_FD
+#define HANDOFF_ACK         'k'
+#define ACCEPT_RETRY_MS     100     // Wait of the listen socket after EMFILE
+#define ACCEPT_BATCH        64      // Connections accepted per round of the event loop
 
-typedef struct mypipe {
-    int in;
-    int out;
-} Pipe;
-
-typedef struct my_number_pipe {
-    int in;
-    int out;
-    int number;
-} NumberPipe;
-
-typedef struct my_command {
-    string cmd;           // Cut by number|error pipe
-    vector<string> cmds;  // Split by pipe
-    int number;           // For number pipe
-    int in_fd, out_fd;    // For user pipe
-} Command;
+typedef shared_ptr<const string> MsgBuffer;   // Immutable, shared by all receivers
 
 typedef struct my_user_pipe {
     int src_uid;
@@ -61,33 +77,60 @@ namespace user_space {
         static int UID;
 
         int id, sock;
-        string name;
-        sockaddr_in addr;
+        UserDisplay display;        // Name and address as messages show them
+        sockaddr_storage addr;
         map<string, string> env;
 
     public:
         vector<Pipe> pipes;
-        vector<NumberPipe> number_pipes;
+        NumberPipeWheel number_pipes;
+        deque<MsgBuffer> outbox;    // Flushed with one writev per loop
+        size_t outbox_offset = 0;   // Bytes of outbox.front() already sent
+        bool is_closed = false;     // Left, waiting for del_process
+        string inbuf;               // Received bytes not yet cut into lines
+        TelnetState telnet;         // See np_telnet.h
+        int compress_fd = -1;       // Output through np_compress.h, once asked for
+        vector<Relay> relays;       // Output of its commands, see np_relay.h
+        RelayStats relay_stats;
+        int relay_out = -1;         // Write end handed to the commands being forked
+        bool is_relay_blocked = false;  // Socket full, wait until writable
+        coroutine_handle<> session; // The session coroutine, see run_session
+        int capture_fd = -1;        // Output captured for the command cache
+        int batch_fd = -1;          // Output of the script line being spawned, see np_batch.h
+        bool is_batch_open = false; // Between batch and the end of its run, holds the handoff
+        string capture_key;
+        long capture_start_ns;
+        string cgroup;              // See np_limits.h
+        struct rusage usage = {};   // Of the waited commands, without cgroup
+        TokenBucket command_bucket = {};
+        TokenBucket msg_bucket = {};    // yell and tell bytes
+        vector<int> sync_fds;       // Redirected outputs to fdatasync, see np_redirect.h
 
         UserInfo() {}
-        UserInfo(int id, int sock, string name, sockaddr_in addr) {
+        UserInfo(int id, int sock, string name, const sockaddr_storage &addr) {
             this->id   = id;
             this->sock = sock;
-            this->name = name;
             this->addr = addr;
+            format_space::init_display(&this->display, id, name, addr);
             this->env = {{"PATH", "bin:."}};
+            this->cgroup = "np_single_" + to_string(getpid()) + "_" + to_string(id);
         }
 
         /* Member methods */
         int get_id()         { return this->id;  }
         int get_sockfd()     { return this->sock;  }
-        string get_name()    { return this->name; }
-        string get_ip_addr() { return string(inet_ntoa(this->addr.sin_addr));  }
-        int get_port()       { return ntohs(this->addr.sin_port); }
+        int get_outfd()      { return (this->compress_fd >= 0) ? this->compress_fd : this->sock; }
+        int get_child_outfd() {
+            if (this->batch_fd >= 0) return this->batch_fd;
+            return (this->relay_out >= 0) ? this->relay_out : this->get_outfd();
+        }
+        const string &get_name() { return this->display.name; }
+        const UserDisplay &get_display() { return this->display; }
+        const sockaddr_storage &get_addr() { return this->addr; }
         map<string, string> get_env() { return this->env; }
 
         void set_name(string new_name) {
-            this->name = new_name;
+            format_space::set_name(&this->display, this->id, new_name);
         }
 
         void set_env(string key, string val) {
@@ -98,7 +141,7 @@ namespace user_space {
             cout << "User Info" << endl
                 << "\tuid: " << this->get_id() << endl
                 << "\tname: " << this->get_name() << endl
-                << "addr: " << this->get_ip_addr() << ":" << this->get_port() << endl;
+                << "addr: " << this->display.addr << endl;
         }
     };
     
@@ -106,50 +149,75 @@ namespace user_space {
 
     /* User Table */
     class UserTable {
+    private:
+        set<int> free_uids;                         // Smallest uid first
+        unordered_map<int, int> sock_index;         // sockfd: uid
+        unordered_multimap<string, int> name_index; // name: uid
+
+        void index_name(string name, int uid) {
+            name_index.insert(pair<string, int>(name, uid));
+        }
+
+        void unindex_name(string name, int uid) {
+            auto range = name_index.equal_range(name);
+            for (auto iter = range.first; iter != range.second; ++iter) {
+                if (iter->second == uid) {
+                    name_index.erase(iter);
+                    break;
+                }
+            }
+        }
+
     public:
-        map<int, UserInfo *> table; // uid: user
+        vector<UserInfo *> slots;   // uid: user, slot 0 is unused
         vector<int> del_queue;
 
         UserTable() {
-            this->table = {};
+            this->slots.assign(USER_LIMIT + 1, NULL);
+            for (int x = 1; x <= USER_LIMIT; x++) {
+                this->free_uids.insert(x);
+            }
         }
 
-        int create_user(int sock, sockaddr_in addr) {
+        int create_user(int sock, const sockaddr_storage &addr) {
             static string default_name = string("(no name)");
             int uid = -1;
 
-            if (this->table.size() <= USER_LIMIT) {
-                for (int x = 1; x <= USER_LIMIT; x++) {
-                    if (!this->has_user(x)) {
-                        UserInfo *user = new UserInfo(x, sock, default_name, addr);
-                        this->add_user(user);
-                        uid = x;
-                        break;
-                    }
-                }
+            if (!this->free_uids.empty()) {
+                uid = *this->free_uids.begin();
+                UserInfo *user = new UserInfo(uid, sock, default_name, addr);
+                this->add_user(user);
             }
 
             return uid;
         }
 
         void add_user(UserInfo *user) {
-            // user_table[user.get_id()] = user;
-            pair<int, UserInfo *> p(user->get_id(), user);
-            this->table.insert(p);
+            int uid = user->get_id();
+
+            this->slots[uid] = user;
+            this->free_uids.erase(uid);
+            this->sock_index[user->get_sockfd()] = uid;
+            this->index_name(user->get_name(), uid);
+            limit_space::create_session(user->cgroup);
+        }
+
+        void set_name(UserInfo *user, string new_name) {
+            this->unindex_name(user->get_name(), user->get_id());
+            user->set_name(new_name);
+            this->index_name(new_name, user->get_id());
+        }
+
+        size_t size() {
+            return USER_LIMIT - this->free_uids.size();
         }
 
         bool has_user(int id) {
-            map<int, UserInfo *>::iterator iter = this->table.find(id);
-            return (iter != this->table.end());
+            return id > 0 && id <= USER_LIMIT && this->slots[id] != NULL;
         }
 
         bool has_user(string name) {
-            for (auto &elem: this->table) {
-                if (elem.second->get_name().compare(name) == 0) {
-                    return true;
-                }
-            }
-            return false;
+            return this->name_index.find(name) != this->name_index.end();
         }
 
         void put_user_to_del_queue(int id) {
@@ -158,51 +226,50 @@ namespace user_space {
 
         void del_process(vector<UserPipe> &user_pipes) {
             for (auto uid: this->del_queue) {
+                UserInfo *user = this->slots[uid];
                 #if 0
                 cerr << "Delete Process: uid = " << uid << endl;
                 #endif
 
                 // Clean unread message
-                for (int x=0; x < user_pipes.size(); ++x) {
+                for (int x=0; x < (int)user_pipes.size(); ++x) {
                     if (uid == user_pipes[x].dst_uid) {
                         user_pipes.erase(user_pipes.begin() + x);
                         --x;
                     }
                 }
                 // Delete user
-                delete this->table[uid];
-                this->table.erase(uid);
+                if (user->session) {
+                    user->session.destroy();
+                }
+                this->sock_index.erase(user->get_sockfd());
+                this->unindex_name(user->get_name(), uid);
+                limit_space::remove_session(user->cgroup);
+                redirect_space::sync(user->sync_fds);
+                this->slots[uid] = NULL;
+                this->free_uids.insert(uid);
+                delete user;
             }
             this->del_queue.clear();
         }
 
         UserInfo *get_user_by_id(int id) {
-            return this->table[id];
+            return this->has_user(id) ? this->slots[id] : NULL;
         }
 
         UserInfo *get_user_by_sockfd(int sockfd) {
-            int tid;
-            for (auto &elem: this->table) {
-                if (elem.second->get_sockfd() == sockfd) {
-                    tid = elem.first;
-                }
-            }
-            return this->table[tid];
+            auto iter = this->sock_index.find(sockfd);
+            return (iter != this->sock_index.end()) ? this->slots[iter->second] : NULL;
         }
 
         UserInfo *get_user_by_name(string peer) {
-            int tid;
-            for (auto &elem: this->table) {
-                if (elem.second->get_name().compare(peer) == 0) {
-                    tid = elem.first;
-                }
-            }
-            return this->table[tid];
+            auto iter = this->name_index.find(peer);
+            return (iter != this->name_index.end()) ? this->slots[iter->second] : NULL;
         }
 
         void show_table() {
-            for (auto &elem: this->table) {
-                elem.second->show();
+            for (auto user: this->slots) {
+                if (user) user->show();
             }
         }
     };
@@ -211,20 +278,77 @@ namespace user_space {
     /* User Table End */
 }
 
+/* Poll Set */
+/*
+ * Descriptors the event loop waits on, rebuilt every round. poll has no
+ * FD_SETSIZE limit, so sessions may hold descriptors past 1024. A
+ * descriptor watched twice is merged into one entry.
+ */
+class PollSet {
+private:
+    vector<struct pollfd> fds;
+    vector<int> slot;           // fd: index in fds, -1 if not watched
+
+    struct pollfd *find(int fd) {
+        return (fd < (int)this->slot.size() && this->slot[fd] >= 0) ? &this->fds[this->slot[fd]] : NULL;
+    }
+
+public:
+    void clear() {
+        for (auto &pfd: this->fds) {
+            this->slot[pfd.fd] = -1;
+        }
+        this->fds.clear();
+    }
+
+    void watch(int fd, short events) {
+        if (fd >= (int)this->slot.size()) {
+            this->slot.resize(fd + 1, -1);
+        }
+        if (this->slot[fd] >= 0) {
+            this->fds[this->slot[fd]].events |= events;
+            return;
+        }
+        this->slot[fd] = this->fds.size();
+        this->fds.push_back({fd, events, 0});
+    }
+
+    int wait(int timeout_ms) {
+        return poll(this->fds.data(), this->fds.size(), timeout_ms);
+    }
+
+    bool is_readable(int fd) {
+        // A hang up or an error is read as EOF by the session
+        struct pollfd *pfd = this->find(fd);
+        return pfd && (pfd->revents & (POLLIN | POLLHUP | POLLERR));
+    }
+
+    bool is_writable(int fd) {
+        struct pollfd *pfd = this->find(fd);
+        return pfd && (pfd->revents & (POLLOUT | POLLHUP | POLLERR));
+    }
+};
+
 /* Function Prototype */
 // Handler
 void child_handler(int sig);
 void interrupt_handler(int sig);
 
 // Sockeet
-int get_listen_socket(const char *port);
 
 // User
 void load_user_config(user_space::UserInfo *me);
 
 // Network IO
-string read_msg(int sockfd);
+int recv_msg(user_space::UserInfo *me);
+bool next_line(user_space::UserInfo *me, string &line);
+void write_msg(int sockfd, string &msg);
 void sendout_msg(int sockfd, string &msg);
+void enqueue_msg(user_space::UserInfo *user, MsgBuffer buf);
+void flush_outbox(user_space::UserInfo *user, bool is_blocking);
+void flush_all_outbox(bool is_blocking);
+void watch_relays(PollSet &pollset);
+void forward_relays(PollSet &pollset);
 
 void broadcast(string msg);
 void login_prompt();
@@ -236,38 +360,48 @@ void welcome(user_space::UserInfo *me);
 void my_setenv(user_space::UserInfo *me, string var, string value);
 void my_printenv(user_space::UserInfo *me, string var);
 void my_exit(user_space::UserInfo *me);
+void my_compress(user_space::UserInfo *me);
 void who(user_space::UserInfo *me);
+void usage(user_space::UserInfo *me);
+bool admit_msg(user_space::UserInfo *me, string &msg);
 void tell(int id, string msg);
 void yell(string msg);
 void name_cmd(string name);
 int handle_builtin(user_space::UserInfo *me, string cmd);
 // Built-in Command End
 
-bool is_white_char(string cmd);
 void clean_user_pipe();
 int search_user_pipe(int src_uid, int dst_uid, int *up_idx);
 int create_user_pipe(user_space::UserInfo *me, int dst_uid);
 void check_user_pipe(string cmd, bool *in, bool *out);
 bool handle_input_user_pipe(user_space::UserInfo *me, string cmd, int *up_idx);
 bool handle_output_user_pipe(user_space::UserInfo *me, string cmd, int *up_idx);
-void decrement_number_pipes(vector<NumberPipe> &number_pipes);
 
-vector<string> parse_normal_pipe(string input);
-vector<Command> parse_number_pipe(string input);
 void parse_user_pipe(user_space::UserInfo *me, vector<Command> &commands);
 
 void execute_command(user_space::UserInfo *me, vector<string> args);
-int main_executor(user_space::UserInfo *me, Command &command);
-int handle_command(user_space::UserInfo *me, string input);
-
-int run_shell(user_space::UserInfo *me, string msg);
-int handle_client(int sockfd);
+bool check_cache(user_space::UserInfo *me, Command &command);
+void finish_capture(user_space::UserInfo *me, int status);
+void finish_batch_job(user_space::UserInfo *me, BatchJob &job, const string &line, int *line_status);
+int main_executor(user_space::UserInfo *me, Command &command, pid_t *wait_pid, int *wait_pidfd);
+void start_session(user_space::UserInfo *me);
+
+// Handoff
+void put_string(ostream &os, string str);
+string get_string(istream &is);
+bool send_fds(int channel, vector<int> &fds);
+bool recv_fds(int channel, vector<int> &fds, size_t total);
+string serialize_state(int listen_sock, vector<int> &fds);
+int deserialize_state(string state, vector<int> &fds);
+void handoff_process(const char *prog, const char *port, int listen_sock);
+int resume_process(int channel);
 
 /* Global Variables */
 vector<UserPipe> user_pipes;
 regex up_in_pattern("[<][1-9]\\d?\\d?\\d?[0]?");
 regex up_out_pattern("[>][1-9]\\d?\\d?\\d?[0]?");
 string original_command;
+vector<string> server_env;  // Environment at boot, for the handoff
 
 /* Function Definition */
 void load_user_config(user_space::UserInfo *me) {
@@ -280,27 +414,23 @@ void load_user_config(user_space::UserInfo *me) {
 }
 
 void login_prompt(user_space::UserInfo *me) {
-    ostringstream oss;
-    string msg;
+    FormatBuffer<> msg;
 
     // Create message
-    oss << "*** User '" << me->get_name() << "' entered from " << me->get_ip_addr() << ":" << me->get_port() << ". ***" << endl;
-    msg = oss.str();
+    msg.add("*** User '").add(me->get_name()).add("' entered from ").add(me->get_display().addr).add(". ***\n");
 
     // Broadcast
-    broadcast(msg);
+    broadcast(msg.str());
 }
 
 void logout_prompt(user_space::UserInfo *me) {
-    ostringstream oss;
-    string msg;
+    FormatBuffer<> msg;
 
     // Create message
-    oss << "*** User '" << me->get_name() << "' left. ***" << endl;
-    msg = oss.str();
+    msg.add("*** User '").add(me->get_name()).add("' left. ***\n");
 
     // Broadcast
-    broadcast(msg);
+    broadcast(msg.str());
 }
 
 void command_prompt(user_space::UserInfo *me) {
@@ -320,28 +450,50 @@ void welcome(user_space::UserInfo *me) {
     sendout_msg(me->get_sockfd(), msg);
 }
 
-string read_msg(int sockfd) {
-    static int cmd_counter = 0;
+int recv_msg(user_space::UserInfo *me) {
+    // Append whatever is available, lines are cut by next_line
     char buf[MAX_BUF_SIZE];
-    bzero(buf, MAX_BUF_SIZE);
 
-    if (read(sockfd, buf, MAX_BUF_SIZE) < 0) {
+    if (me->telnet.eof) {
+        return 0;
+    }
+    int n = read(me->get_sockfd(), buf, MAX_BUF_SIZE);
+
+    if (n < 0) {
         perror("Read Message.");
-        return "";
+    } else if (n > 0) {
+        // Negotiation replies leave with the next flush of the outbox
+        string reply;
+        telnet_space::filter(&me->telnet, buf, n, me->inbuf, reply);
+        if (!reply.empty()) {
+            enqueue_msg(me, make_shared<const string>(reply));
+        }
+        if (me->telnet.local[TELNET_OPT_COMPRESS2]) my_compress(me);
+    }
+
+    return n;
+}
+
+bool next_line(user_space::UserInfo *me, string &line) {
+    size_t pos = me->inbuf.find('\n');
+
+    if (pos == string::npos) {
+        return false;
     }
 
-    string msg(buf);
-    msg.erase(remove(msg.begin(), msg.end(), '\n'), msg.end());
-    msg.erase(remove(msg.begin(), msg.end(), '\r'), msg.end());
+    line = me->inbuf.substr(0, pos);
+    me->inbuf.erase(0, pos + 1);
     #if 0
+    static int cmd_counter = 0;
     ++cmd_counter;
-    printf("(%d) Recv (%ld): %s\n", cmd_counter, msg.length(), msg.c_str());
+    printf("(%d) Recv (%ld): %s\n", cmd_counter, line.length(), line.c_str());
     #endif
 
-    return msg;
+    return true;
 }
 
-void sendout_msg(int sockfd, string &msg) {
+void write_msg(int sockfd, string &msg) {
+    // Write immediately, used by forked children which have no event loop
     int n = write(sockfd, msg.c_str(), msg.length());
     if (n < 0) {
         perror("Sendout Message");
@@ -349,9 +501,82 @@ void sendout_msg(int sockfd, string &msg) {
     }
 }
 
+void sendout_msg(int sockfd, string &msg) {
+    TRACE_SPAN("sendout_msg");
+    user_space::UserInfo *user = user_space::user_table.get_user_by_sockfd(sockfd);
+
+    if (user) {
+        enqueue_msg(user, make_shared<const string>(msg));
+    } else {
+        write_msg(sockfd, msg);
+    }
+}
+
+void enqueue_msg(user_space::UserInfo *user, MsgBuffer buf) {
+    if (!user->is_closed) {
+        user->outbox.push_back(buf);
+    }
+}
+
+void flush_outbox(user_space::UserInfo *user, bool is_blocking) {
+    // Non-blocking flushes leave the rest queued for the next writable round
+    struct iovec iov[IOV_MAX];
+    struct msghdr mh;
+
+    while (!user->outbox.empty()) {
+        int cnt = 0;
+        ssize_t n;
+
+        for (auto iter = user->outbox.begin(); iter != user->outbox.end() && cnt < IOV_MAX; ++iter, ++cnt) {
+            size_t offset = (cnt == 0) ? user->outbox_offset : 0;
+            iov[cnt].iov_base = (void *)((*iter)->c_str() + offset);
+            iov[cnt].iov_len  = (*iter)->length() - offset;
+        }
+
+        bzero(&mh, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = cnt;
+        n = sendmsg(user->get_outfd(), &mh, MSG_NOSIGNAL | (is_blocking ? 0 : MSG_DONTWAIT));
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!is_blocking) return;
+            // A relayed socket is non-blocking, wait for room
+            struct pollfd pfd = {user->get_outfd(), POLLOUT, 0};
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            // Peer is gone, its session ends on the next read
+            perror("Sendout Message");
+            user->outbox.clear();
+            user->outbox_offset = 0;
+            return;
+        }
+
+        // Drop fully sent buffers, remember where a partial write stopped
+        n += user->outbox_offset;
+        while (!user->outbox.empty() && (size_t)n >= user->outbox.front()->length()) {
+            n -= user->outbox.front()->length();
+            user->outbox.pop_front();
+        }
+        user->outbox_offset = n;
+    }
+}
+
+void flush_all_outbox(bool is_blocking) {
+    for (auto user: user_space::user_table.slots) {
+        if (user && !user->outbox.empty()) flush_outbox(user, is_blocking);
+    }
+}
+
 void broadcast(string msg) {
-    for (auto &elem: user_space::user_table.table) {
-        sendout_msg(elem.second->get_sockfd(), msg);
+    TRACE_SPAN("broadcast");
+    MsgBuffer buf = make_shared<const string>(msg);
+
+    for (auto user: user_space::user_table.slots) {
+        if (user) enqueue_msg(user, buf);
     }
 }
 
@@ -378,30 +603,65 @@ void my_printenv(user_space::UserInfo *me, string var) {
 void my_exit(user_space::UserInfo *me) {
     user_space::user_table.put_user_to_del_queue(me->get_id());
     logout_prompt(me);
+    flush_outbox(me, true);
     close(me->get_sockfd());
+    if (me->compress_fd >= 0) close(me->compress_fd);
+    while (!me->relays.empty()) {
+        // Writers still running get SIGPIPE, as they would from the socket
+        relay_space::close_relay(me->relays, 0, &me->relay_stats);
+    }
+    journal_space::flush();
+    me->is_closed = true;
 }
 
-void who(user_space::UserInfo *me) {
-    ostringstream oss;
-    string tab("\t"), is_me("<-me"), msg;
+void my_compress(user_space::UserInfo *me) {
+    // What is queued so far leaves uncompressed
+    if (me->compress_fd >= 0) return;
 
-    // Create Message
-    oss << "<ID>\t<nickname>\t<IP:port>\t<indicate me>" << endl;
-    for (auto& elem: user_space::user_table.table) {
-        oss << elem.second->get_id() << tab
-            << elem.second->get_name() << tab
-            << elem.second->get_ip_addr() << ":" << elem.second->get_port() << tab
-            << ((elem.second->get_id() == me->get_id()) ? is_me : "")
-            << endl;
+    flush_outbox(me, true);
+    me->compress_fd = compress_space::spawn(me->get_sockfd());
+    if (me->compress_fd >= 0 && relay_space::enabled) {
+        fcntl(me->compress_fd, F_SETFL, O_NONBLOCK);
     }
-    msg = oss.str();
+}
+
+void usage(user_space::UserInfo *me) {
+    string msg = limit_space::usage(me->cgroup, &me->usage);
 
-    // Send out Message
+    if (relay_space::enabled) msg += relay_space::usage(&me->relay_stats);
     sendout_msg(me->get_sockfd(), msg);
 }
 
+void who(user_space::UserInfo *me) {
+    // The cached rows are queued as they are, flush_outbox sends them with one sendmsg
+    static const MsgBuffer header  = make_shared<const string>(format_space::WHO_HEADER);
+    static const MsgBuffer is_me   = make_shared<const string>(format_space::WHO_ME);
+    static const MsgBuffer newline = make_shared<const string>("\n");
+
+    enqueue_msg(me, header);
+    for (auto user: user_space::user_table.slots) {
+        if (!user) continue;
+        enqueue_msg(me, user->get_display().row);
+        enqueue_msg(me, (user == me) ? is_me : newline);
+    }
+}
+
+bool admit_msg(user_space::UserInfo *me, string &msg) {
+    if (rate_space::admit_msg(&me->msg_bucket, msg.length())) {
+        return true;
+    }
+
+    string err("*** Error: too many messages, please slow down. ***\n");
+    sendout_msg(me->get_sockfd(), err);
+    return false;
+}
+
 void tell(user_space::UserInfo *me, string id_or_name, string msg) {
-    ostringstream oss;
+    FormatBuffer<> fmt;
+
+    if (!admit_msg(me, msg)) {
+        return;
+    }
 
     if (isdigit(id_or_name.c_str()[0])) {
         int id = atoi(id_or_name.c_str());
@@ -410,15 +670,15 @@ void tell(user_space::UserInfo *me, string id_or_name, string msg) {
             user_space::UserInfo *target_user = user_space::user_table.get_user_by_id(id);
 
             // Create message
-            oss << "*** " << me->get_name() << " told you ***: " << msg << endl;
-            msg = oss.str();
+            fmt.add("*** ").add(me->get_name()).add(" told you ***: ").add(msg).add('\n');
+            msg = fmt.str();
 
             // Send out message
             sendout_msg(target_user->get_sockfd(), msg);
         } else {
             // User is not exist
-            oss << "*** Error: user #" << id << " does not exist yet. ***" << endl;
-            msg = oss.str();
+            fmt.add("*** Error: user #").num(id).add(" does not exist yet. ***\n");
+            msg = fmt.str();
 
             sendout_msg(me->get_sockfd(), msg);
         }
@@ -427,8 +687,8 @@ void tell(user_space::UserInfo *me, string id_or_name, string msg) {
             user_space::UserInfo *target_user = user_space::user_table.get_user_by_name(id_or_name);
 
             // Create message
-            oss << "*** " << me->get_name() << " told you ***: " << msg << endl;
-            msg = oss.str();
+            fmt.add("*** ").add(me->get_name()).add(" told you ***: ").add(msg).add('\n');
+            msg = fmt.str();
 
             // Send out message
             sendout_msg(target_user->get_sockfd(), msg);
@@ -437,94 +697,77 @@ void tell(user_space::UserInfo *me, string id_or_name, string msg) {
 }
 
 void yell(user_space::UserInfo *me, string msg) {
-    ostringstream oss;
-    
+    FormatBuffer<> fmt;
+
+    if (!admit_msg(me, msg)) {
+        return;
+    }
+
     // Create message
-    oss << "*** " << me->get_name() << " yelled ***: " << msg << endl;
-    msg = oss.str();
+    fmt.add("*** ").add(me->get_name()).add(" yelled ***: ").add(msg).add('\n');
 
     // Broadcast message
-    broadcast(msg);
+    broadcast(fmt.str());
 }
 
 void name_cmd(user_space::UserInfo *me, string name) {
-    ostringstream oss;
+    FormatBuffer<> fmt;
     string msg;
 
     // Check name
-    for (auto &elem: user_space::user_table.table) {
-        if (name.compare(elem.second->get_name()) == 0) {
-            // The name is already exist
-            oss << "*** User '" << name << "' already exists. ***" << endl;
-            msg = oss.str();
-            sendout_msg(me->get_sockfd(), msg);
-            return;
-        }
+    if (user_space::user_table.has_user(name)) {
+        // The name is already exist
+        fmt.add("*** User '").add(name).add("' already exists. ***\n");
+        msg = fmt.str();
+        sendout_msg(me->get_sockfd(), msg);
+        return;
     }
 
     // Change name and broadcast message
-    me->set_name(name);
-    oss << "*** User from " << me->get_ip_addr() << ":" << me->get_port() << " is named '" << name << "'. ***" << endl;
-    msg = oss.str();
+    user_space::user_table.set_name(me, name);
+    fmt.add("*** User from ").add(me->get_display().addr).add(" is named '").add(name).add("'. ***\n");
 
-    broadcast(msg);
+    broadcast(fmt.str());
 }
 
 int handle_builtin(user_space::UserInfo *me, string cmd) {
-    istringstream iss(cmd);
-    string prog;
+    BuiltinCall call;
 
-    getline(iss, prog, ' ');
-
-    if (prog == "setenv") {
-        string var, value;
-
-        getline(iss, var, ' ');
-        getline(iss, value, ' ');
-        my_setenv(me, var, value);
+    if (!builtin_space::parse(cmd, call)) {
+        return BUILT_IN_FALSE;
+    }
 
+    switch (call.id) {
+    case BUILTIN_setenv:
+        my_setenv(me, string(call.args[0]), string(call.args[1]));
         return BUILT_IN_TRUE;
-    } else if (prog == "printenv") {
-        string var;
-
-        getline(iss, var, ' ');
-        my_printenv(me, var);
-
+    case BUILTIN_printenv:
+        my_printenv(me, string(call.args[0]));
         return BUILT_IN_TRUE;
-    } else if (prog == "exit") {
+    case BUILTIN_exit:
         my_exit(me);
-
         return BUILT_IN_EXIT;
-    } else if (prog == "who") {
+    case BUILTIN_who:
         who(me);
-
         return BUILT_IN_TRUE;
-    } else if (prog == "tell") {
-        string id, msg;
-
-        getline(iss, id, ' ');
-        getline(iss, msg);
-
-        tell(me, id, msg);
-
+    case BUILTIN_usage:
+        usage(me);
         return BUILT_IN_TRUE;
-    } else if (prog == "yell") {
-        string msg;
-
-        getline(iss, msg);
-        yell(me, msg);
-
+    case BUILTIN_compress:
+        my_compress(me);
         return BUILT_IN_TRUE;
-    } else if (prog == "name") {
-        string new_name;
-        
-        getline(iss, new_name, ' ');
-        name_cmd(me, new_name);
-
+    case BUILTIN_tell:
+        tell(me, string(call.args[0]), string(call.args[1]));
         return BUILT_IN_TRUE;
+    case BUILTIN_yell:
+        yell(me, string(call.args[0]));
+        return BUILT_IN_TRUE;
+    case BUILTIN_name:
+        name_cmd(me, string(call.args[0]));
+        return BUILT_IN_TRUE;
+    default:
+        return BUILT_IN_FALSE;
     }
-
-    return BUILT_IN_FALSE;
 }
 // Built-in Command End
 
@@ -540,64 +783,18 @@ void child_handler(int sig) {
     return;
 }
 
-int get_listen_socket(const char *port) {
-    struct sockaddr_in s_addr;
-    int listen_sock;
-    int status_code;
-
-    // Init variable
-    bzero((char *)&s_addr, sizeof(s_addr));
-
-    // Init server address
-    s_addr.sin_family = AF_INET;
-    s_addr.sin_addr.s_addr = INADDR_ANY;
-    s_addr.sin_port = htons((u_short)atoi(port));
-
-    // Create socket
-    listen_sock = socket(s_addr.sin_family, SOCK_STREAM, 0);
-    if (listen_sock < 0) {
-        perror("Server create socket");
-        exit(0);
-    }
-
-    // Socket setting
-    int optval = 1;
-    status_code = setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
-    if (status_code < 0) {
-        perror("Set socket option");
-        exit(0);
-    }
-
-    // Bind socket
-    status_code = bind(listen_sock, (struct sockaddr *) &s_addr, sizeof(s_addr));
-    if (status_code < 0) {
-        perror("Server bind");
-        exit(0);
-    }
-
-    // Listen socket
-    status_code = listen(listen_sock, 5);
-    if (status_code < 0) {
-        perror("Server listen");
-        exit(0);
-    }
-
-    return listen_sock;
-}
-
 bool fd_is_valid(int fd) {
     return fcntl(fd, F_GETFD) != -1 || errno != EBADF;
 }
 
-void debug_number_pipes(vector<NumberPipe> number_pipes) {
+void debug_number_pipes(NumberPipeWheel &number_pipes) {
     if (number_pipes.size() > 0) {    
         cerr << "Number Pipes" << endl;
-        for (size_t i = 0; i < number_pipes.size(); i++) {
-            cerr << "\tIndex: "  << i 
-                 << "\tNumber: " << number_pipes[i].number
-                 << "\tIn: "     << number_pipes[i].in << "\tValid: " << (fd_is_valid(number_pipes[i].in) ? "True" : "False")
-                 << "\tOut: "    << number_pipes[i].out << "\tValid: " << (fd_is_valid(number_pipes[i].out) ? "True" : "False") << endl;
-        }
+        number_pipes.for_each([](long distance, int in, int out) {
+            cerr << "\tNumber: " << distance
+                 << "\tIn: "     << in << "\tValid: " << (fd_is_valid(in) ? "True" : "False")
+                 << "\tOut: "    << out << "\tValid: " << (fd_is_valid(out) ? "True" : "False") << endl;
+        });
     }
 }
 
@@ -615,7 +812,7 @@ void debug_pipes(vector<Pipe> pipes) {
 void debug_user_pipes() {
     if (user_pipes.size() > 0) {
         cerr << "User Pipe:" << endl;
-        for (int x=0; x < user_pipes.size(); ++x) {
+        for (int x=0; x < (int)user_pipes.size(); ++x) {
             cerr << "\tSrc: "     << user_pipes[x].src_uid
                  << "\tDst: "     << user_pipes[x].dst_uid
                  << "\tIn: "      << user_pipes[x].pipe.in
@@ -625,15 +822,6 @@ void debug_user_pipes() {
     }
 }
 
-bool is_white_char(string cmd) {
-    for (size_t i = 0; i < cmd.length(); i++) {
-        if(isspace(cmd[i]) == 0) {
-            return false;
-        }
-    }
-    return true;
-}
-
 void clean_user_pipe() {
     vector<int> index;
 
@@ -648,7 +836,7 @@ void clean_user_pipe() {
 int search_user_pipe(int src_uid, int dst_uid, int *up_idx){
     int result = -1;
 
-    for (int x=0; x < user_pipes.size(); ++x) {
+    for (int x=0; x < (int)user_pipes.size(); ++x) {
         if (user_pipes[x].src_uid == src_uid && user_pipes[x].dst_uid == dst_uid) {
             result = x;
             break;
@@ -660,8 +848,12 @@ int search_user_pipe(int src_uid, int dst_uid, int *up_idx){
 }
 
 int create_user_pipe(user_space::UserInfo *me, int dst_uid) {
+    // -1 with errno set when out of descriptors
     int pipefd[2];
-    pipe(pipefd);
+
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        return -1;
+    }
 
     UserPipe up;
     up.src_uid  = me->get_id();
@@ -676,6 +868,7 @@ int create_user_pipe(user_space::UserInfo *me, int dst_uid) {
 }
 
 void handle_user_pipe(user_space::UserInfo *me, string cmd, bool *in, bool *out, bool *in_err, bool *out_err, int *in_idx, int *out_idx) {
+    TRACE_SPAN("handle_user_pipe");
     smatch result;
 
     *in  = regex_search(cmd, result, up_in_pattern);
@@ -786,6 +979,17 @@ bool handle_output_user_pipe(user_space::UserInfo *me, string cmd, int *up_idx)
         }
     }
 
+    if (!error) {
+        // Create user pipe, nobody is told of a pipe that could not be made
+        *up_idx = create_user_pipe(me, dst_uid);
+        if (*up_idx < 0) {
+            msg = "*** Error: " + string(strerror(errno)) + ". ***\n";
+            sendout_msg(me->get_sockfd(), msg);
+
+            error = true;
+        }
+    }
+
     if (!error) {
         // Broadcast Message
         dst_user = user_space::user_table.get_user_by_id(dst_uid);
@@ -795,170 +999,153 @@ bool handle_output_user_pipe(user_space::UserInfo *me, string cmd, int *up_idx)
         msg = oss.str();
 
         broadcast(msg);
-
-        // Create user pipe
-        *up_idx = create_user_pipe(me, dst_uid);
     }
 
     return error;
 }
 
-void decrement_number_pipes(vector<NumberPipe> &number_pipes) {
-    for (size_t i = 0; i < number_pipes.size(); i++) {
-        --number_pipes[i].number;
-    }
-}
-
-vector<string> parse_normal_pipe(string input) {
-    vector<string> cmds;
-    string pipe_symbol("| ");
-    int pos;
-
-    // Parse pipe
-    while ((pos = input.find(pipe_symbol)) != string::npos) {
-        cmds.push_back(input.substr(0, pos));
-        input.erase(0, pos + pipe_symbol.length());
+void execute_command(user_space::UserInfo *me, vector<string> args) {
+    #if 0
+    cerr << "Execute Command Args: ";
+    for (size_t i = 0; i < args.size(); i++) {
+        cerr << args[i] << " ";
     }
-    cmds.push_back(input);
-
-    // Remove space
-    for (size_t i = 0; i < cmds.size(); i++) {
-        int head = 0, tail = cmds[i].length() - 1;
+    cerr << endl;
+    #endif
 
-        while(cmds[i][head] == ' ') ++head;
-        while(cmds[i][tail] == ' ') --tail;
+    // Execute Command, redirection is already stripped and applied
+    signal(SIGPIPE, SIG_DFL);
+    exec_args(args);
 
-        if (head != 0 || tail != cmds[i].length() - 1) {
-            cmds[i] = cmds[i].substr(head, tail + 1);
-        }
-    }
+    ostringstream oss;
+    string msg;
 
-    return cmds;
+    oss << "Unknown command: [" << args[0] << "]." << endl;
+    msg = oss.str();
+    write_msg(me->get_child_outfd(), msg);
+    exit(1);
 }
 
-vector<Command> parse_number_pipe(string input) {
+bool check_cache(user_space::UserInfo *me, Command &command) {
     /*
-     *    "removetag test.html |2 ls | number |1"
-     * -> ["removetag test.html |2", "ls | number |1"]
+     * Return true if the cached output was sent. On a cacheable miss the
+     * final stage is captured into me->capture_fd and stored by
+     * finish_capture once it exits.
      */
-    vector<Command> lines;
-    regex pattern("[|!][1-9]\\d?\\d?[0]?");
-    smatch result;
-
-    while(regex_search(input, result, pattern)) {
-        Command command;
-        string tmp;
-        tmp = input.substr(0, result.position() + result.length());
+    vector<vector<string>> stages;
+    string key;
 
-        command.cmd = input.substr(0, result.position() + result.length());
-        command.number = atoi(input.substr(result.position() + 1, result.length() - 1).c_str());
-        input.erase(0, result.position() + result.length());
-
-        lines.push_back(command);
+    if (!cache_space::enabled || command.number != 0 || me->batch_fd >= 0) {
+        // A hit would be sent ahead of the batch output before it
+        return false;
     }
-
-    if (input.length() != 0) {
-        Command command{cmd: input};
-        
-        lines.push_back(command);
+    if (me->number_pipes.current()) {
+        // Input from a previous line
+        return false;
     }
 
-    if (lines.size() == 0) {
-        // Normal Pipe
-        Command command{cmd: input};
+    for (size_t i = 0; i < command.cmds.size(); i++) {
+        vector<string> args;
 
-        lines.push_back(command);
+        for (auto &arg: split_args(command.cmds[i])) {
+            // Redirection and user pipes have side effects
+            if (arg.find_first_of("<>|!") != string::npos) return false;
+            args.push_back(arg);
+        }
+        stages.push_back(args);
     }
 
-    // Split by pipe
-    for (size_t i = 0; i < lines.size(); i++) {
-        lines[i].cmds = parse_normal_pipe(lines[i].cmd); 
+    if (!cache_space::make_key(stages, key)) {
+        return false;
     }
 
-    // Debug
-    #if 0
-    for (size_t i = 0; i < lines.size(); i++) {
-        cerr << "Line " << i << ": " << lines[i].cmd << endl;
-        cerr << "\tCommand: " << lines[i].cmd << endl;
-        cerr << "\tCommand Size: " << lines[i].cmds.size() << endl;
-        cerr << "\tNumber: " << lines[i].number << endl;
+    CacheEntry *entry = cache_space::lookup(key);
+    if (entry) {
+        TRACE_SPAN("cache_hit");
+        enqueue_msg(me, make_shared<const string>(entry->output));
+        return true;
     }
-    #endif
-        
-    return lines;
-}
 
-void execute_command(user_space::UserInfo *me, vector<string> args) {
-    int fd;
-    bool need_file_redirection = false;
-    const char *prog = args[0].c_str();
-    const char **c_args = new const char* [args.size()+1];  // Reserve one location for NULL
+    me->capture_fd = cache_space::open_capture();
+    me->capture_key = key;
+    me->capture_start_ns = trace_space::now_ns();
 
-    #if 0
-    cerr << "Execute Command Args: ";
-    for (size_t i = 0; i < args.size(); i++) {
-        cerr << args[i] << " ";
-    }
-    cerr << endl;
-    #endif
+    return false;
+}
 
-    /* Parse Arguments */
-    for (size_t i = 0; i < args.size(); i++) {
-        if (args[i] == ">") {
-            need_file_redirection = true;
-            fd = open(args[i+1].c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-            args.pop_back();  // Remove file name
-            args.pop_back();  // Remove redirect symbol
-            break;
-        }
-        c_args[i] = args[i].c_str();
-    }
-    c_args[args.size()] = NULL;
+void finish_capture(user_space::UserInfo *me, int status) {
+    string output = cache_space::read_capture(me->capture_fd);
 
-    // Check if need file redirection
-    if (need_file_redirection) {
-        dup2(fd, STDOUT_FILENO);
-        close(fd);
+    enqueue_msg(me, make_shared<const string>(output));
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        cache_space::store(me->capture_key, output, trace_space::now_ns() - me->capture_start_ns);
     }
 
-    // Execute Command
-    if (execvp(prog, (char **)c_args) == -1) {
-        ostringstream oss;
-        string msg;
+    close(me->capture_fd);
+    me->capture_fd = -1;
+    me->capture_key.clear();
+}
 
-        oss << "Unknown command: [" << args[0] << "]." << endl;
-        msg = oss.str();
-        sendout_msg(me->get_sockfd(), msg);
-        exit(1);
+void finish_batch_job(user_space::UserInfo *me, BatchJob &job, const string &line, int *line_status) {
+    // In script order, once the final process has exited
+    if (job.capture_fd >= 0) {
+        string output = cache_space::read_capture(job.capture_fd);
+
+        if (!output.empty()) enqueue_msg(me, make_shared<const string>(output));
+        close(job.capture_fd);
+    }
+    if (job.is_line_end) {
+        journal_space::record(me->get_id(), line, *line_status, job.start_ns);
+        *line_status = JOURNAL_NO_STATUS;
+        command_prompt(me);
     }
 }
 
-int main_executor(user_space::UserInfo *me, Command &command) {
+int main_executor(user_space::UserInfo *me, Command &command, pid_t *wait_pid, int *wait_pidfd) {
+    // The final process is not waited here, its pid is handed back in wait_pid,
+    // with a pidfd if the zygote spawned it, so the session coroutine can
+    // suspend until it exits
     /* Pre-Process */
-    decrement_number_pipes(me->number_pipes);
+    me->number_pipes.advance();
     if (command.cmds.size() == 1) {
         int code = handle_builtin(me, command.cmds[0]);
         if (code != BUILT_IN_FALSE) {
             return code;
         }
     }
+    if (check_cache(me, command)) {
+        return 0;
+    }
     #if 0
     cerr << "Handle " << command.cmd << endl;
     #endif
 
+    // Open redirected files first, nothing is forked if one fails
+    vector<Redirection> redirs;
+    string error;
+
+    if (!redirect_space::open_all(command.cmds, redirs, error)) {
+        sendout_msg(me->get_sockfd(), error);
+        return 0;
+    }
+
+    // Commands write to a relay of the event loop instead of the socket
+    if (relay_space::enabled && me->batch_fd < 0) {
+        me->relay_out = relay_space::open(me->relays, &me->relay_stats, me->get_outfd());
+    }
+
     vector<string> args;
     string error_pipe_symbol = "!", pipe_symbol = "|";
-    string arg;
     bool is_error_pipe = false, is_number_pipe = false;
+    PendingPipe *number_pipe_out = NULL;
     bool is_input_user_pipe = false, is_output_user_pipe = false;
     bool is_input_user_pipe_error = false, is_output_user_pipe_error = false;
     
     // Handle a command per loop
     for (size_t i = 0; i < command.cmds.size(); i++) {
-        istringstream iss(command.cmds[i]);
         vector<string> args;
         pid_t pid;
-        int pipefd[2];
+        int pidfd = DEFAULT_FD;
         int input_user_pipe_idx  = -1;
         int output_user_pipe_idx = -1;
         bool is_first_cmd = false, is_final_cmd = false;
@@ -979,11 +1166,9 @@ int main_executor(user_space::UserInfo *me, Command &command) {
         cerr << "*** Parse Command: " << command.cmds[i] << endl;
         #endif
 
-        while (getline(iss, arg, ' ')) {
+        for (auto &arg: split_args(command.cmds[i])) {
             bool ignore_arg = false;
 
-            if (is_white_char(arg)) continue;
-
             if (regex_search(arg, in_result, up_in_pattern)) {
                 ignore_arg = true;
                 // is_input_user_pipe_error = handle_input_user_pipe(me, arg, &input_user_pipe_idx);
@@ -1001,28 +1186,14 @@ int main_executor(user_space::UserInfo *me, Command &command) {
             if (is_final_cmd) {
                 if ((is_number_pipe = (arg.find("|") != string::npos)) ||
                     (is_error_pipe  = (arg.find("!") != string::npos))) {
-                    bool is_add = false;
                     ignore_arg = true;
 
-                    for (int x=0; x < me->number_pipes.size(); ++x) {
-                        // Same number means that using the same pipe
-                        if (me->number_pipes[x].number == command.number) {
-                            me->number_pipes.push_back(NumberPipe{
-                                in:     me->number_pipes[x].in,
-                                out:    me->number_pipes[x].out,
-                                number: command.number
-                            });
-                            is_add = true;
-                            break;
-                        }
-                    }
-                    // No match, Create a new pipe
-                    if (!is_add) {
-                        pipe(pipefd);
-                        me->number_pipes.push_back(NumberPipe{
-                            in: pipefd[0],
-                            out: pipefd[1],
-                            number: command.number});
+                    // Same number means that using the same pipe
+                    number_pipe_out = me->number_pipes.get(command.number);
+                    if (number_pipe_out == NULL) {
+                        // Out of descriptors, the output is dropped as for a failed user pipe
+                        string msg = "*** Error: " + string(strerror(errno)) + ". ***\n";
+                        sendout_msg(me->get_sockfd(), msg);
                     }
                     #if 0
                     debug_number_pipes(me->number_pipes);
@@ -1035,17 +1206,27 @@ int main_executor(user_space::UserInfo *me, Command &command) {
                 args.push_back(arg);
             }
         }
+        redirect_space::strip(args);
         /* Parse Command to Args End */
 
         /* Create Normal Pipe */
-        if (!is_error_pipe && !is_number_pipe && !is_output_user_pipe) {
-            if(!is_final_cmd && command.cmds.size() > 1) {
-                pipe(pipefd);
-                me->pipes.push_back(Pipe{in: pipefd[0], out: pipefd[1]});
-                #if 0
-                debug_pipes(me->pipes);
-                #endif
+        if (!is_final_cmd) {
+            if (!open_stage_pipe(me->pipes, error)) {
+                // The stages forked so far see the end of their input
+                sendout_msg(me->get_sockfd(), error);
+                if (input_user_pipe_idx != -1) {
+                    close(user_pipes[input_user_pipe_idx].pipe.in);
+                    close(user_pipes[input_user_pipe_idx].pipe.out);
+                    user_pipes[input_user_pipe_idx].is_done = true;
+                    clean_user_pipe();
+                }
+                me->number_pipes.release_current();
+                redirect_space::close_all(redirs);
+                break;
             }
+            #if 0
+            debug_pipes(me->pipes);
+            #endif
         }
 
         #if 0
@@ -1059,11 +1240,68 @@ int main_executor(user_space::UserInfo *me, Command &command) {
              << "\tout:" << output_user_pipe_idx << endl;
         #endif
 
+        /* Standard descriptors of the child, DEFAULT_FD keeps the server's */
+        int source = DEFAULT_FD, sink = DEFAULT_FD;
+        int dev_null = DEFAULT_FD;
+        auto null_fd = [&]() {
+            if (dev_null < 0) dev_null = open("/dev/null", O_RDWR | O_CLOEXEC);
+            return dev_null;
+        };
+
+        // Input from number pipe or user pipe
+        if (PendingPipe *number_pipe_in = me->number_pipes.current()) {
+            source = number_pipe_in->in;
+        }
+        if (is_first_cmd && is_input_user_pipe) {
+            source = is_input_user_pipe_error ? null_fd() : user_pipes[input_user_pipe_idx].pipe.in;
+        }
+
+        // Output to number pipe, user pipe, or socket or relay
+        if ((is_number_pipe || is_error_pipe) && number_pipe_out == NULL) {
+            sink = null_fd();
+        } else if (is_number_pipe || is_error_pipe) {
+            sink = number_pipe_out->out;
+        } else if (is_output_user_pipe) {
+            sink = is_output_user_pipe_error ? null_fd() : user_pipes[output_user_pipe_idx].pipe.out;
+        } else {
+            // Or to the capture of the command cache
+            sink = (me->capture_fd >= 0) ? me->capture_fd : me->get_child_outfd();
+        }
+
+        StageIO io = wire_stage(me->pipes, i, command.cmds.size(), source, sink, is_error_pipe);
+        int *stdio = io.fd;
+
+        // STDERR -> socket or relay
+        if (stdio[STDERR_FILENO] < 0) {
+            stdio[STDERR_FILENO] = me->get_child_outfd();
+        }
+        #if 0
+        cerr << "Stage " << i << " (in) " << stdio[STDIN_FILENO] << " (out) " << stdio[STDOUT_FILENO] << endl;
+        #endif
+
+        // Redirected files take precedence over pipes
+        if (redirs[i].in >= 0)  stdio[STDIN_FILENO]  = redirs[i].in;
+        if (redirs[i].out >= 0) stdio[STDOUT_FILENO] = redirs[i].out;
+
+        // Pending messages must reach the socket before the child writes
+        if (me->batch_fd < 0) {
+            flush_outbox(me, true);
+        }
+
         // cerr << "Start Fork" << endl;
-        do {
-            pid = fork();
-            usleep(5000);
-        } while (pid < 0);
+        pid = -1;
+        if (zygote_space::enabled) {
+            TRACE_SPAN("zygote_spawn");
+            pid = zygote_space::spawn(args, stdio, me->get_child_outfd(), me->cgroup, &pidfd);
+        }
+        if (pid < 0) {
+            TRACE_SPAN("fork");
+            do {
+                // Back off only when the process table is full
+                pid = fork();
+                if (pid < 0) usleep(5000);
+            } while (pid < 0);
+        }
 
         if (pid > 0) {
             /* Parent Process */
@@ -1074,26 +1312,16 @@ int main_executor(user_space::UserInfo *me, Command &command) {
             #endif
             /* Close Pipe */
             // Normal Pipe
-            if (i != 0) {
-                // cerr << "Parent Close pipe: " << i-1 << endl;
-                close(me->pipes[i-1].in);
-                close(me->pipes[i-1].out);
+            close_stage_pipe(me->pipes, i);
+            if (dev_null >= 0) {
+                close(dev_null);
             }
 
-            // Number Pipe
-            for (int x=0; x < me->number_pipes.size(); ++x) {
-                if (me->number_pipes[x].number == 0) {
-                    #if 0
-                    cerr << "Parent Close number pipe: " << x << endl;
-                    #endif
-                    close(me->number_pipes[x].in);
-                    close(me->number_pipes[x].out);
+            // Number Pipe, the first process has taken it
+            me->number_pipes.release_current();
 
-                    // Remove number pipe
-                    me->number_pipes.erase(me->number_pipes.begin() + x);
-                    --x;
-                }
-            }
+            // Redirected files
+            redirect_space::release(redirs[i], me->sync_fds);
 
             // User Pipe
             if (input_user_pipe_idx != -1) {
@@ -1104,15 +1332,11 @@ int main_executor(user_space::UserInfo *me, Command &command) {
             }
 
             if (is_final_cmd && !(is_number_pipe || is_error_pipe) && !is_output_user_pipe) {
-                // Final process, wait
-                #if 0
-                cerr << "Parent Wait Start" << endl;
-                #endif
-                int st;
-                waitpid(pid, &st, 0);
-                #if 0
-                cerr << "Parent Wait End: " << st << endl;
-                #endif
+                // Final process, wait in session
+                *wait_pid = pid;
+                *wait_pidfd = pidfd;
+            } else if (pidfd >= 0) {
+                close(pidfd);
             }
         } else {
             /* Child Process */
@@ -1130,204 +1354,714 @@ int main_executor(user_space::UserInfo *me, Command &command) {
             #endif
 
             /* Duplicate pipe */
-            // STDERR -> socket
-            dup2(me->get_sockfd(), STDERR_FILENO);
-
-            if (is_first_cmd) {
-                // Receive input from number pipe
-                for (size_t x = 0; x < me->number_pipes.size(); x++) {
-                    if (me->number_pipes[x].number == 0) {
-                        dup2(me->number_pipes[x].in, STDIN_FILENO);
-                        #if 0
-                        cerr << "First Number Pipe (in) " << me->number_pipes[x].in << " to stdin" << endl;
-                        #endif
-                        break;
-                    }
-                }
+            apply_stage(io);
 
-                // Setup output of normal pipe
-                if (me->pipes.size() > 0) {
-                    dup2(me->pipes[i].out, STDOUT_FILENO);
-                    #if 0
-                    cerr << "First Normal Pipe (out) " << me->pipes[i].out << " to stdout" << endl;
-                    #endif
-                }
+            /* Close pipe */
+            // Normal and number pipes and /dev/null are close-on-exec
+            for (int x=0; x < (int)user_pipes.size(); ++x) {
+                close(user_pipes[x].pipe.in);
+                close(user_pipes[x].pipe.out);
+            }
 
-                // Recv from user pipe
-                if (is_input_user_pipe) {
-                    if (is_input_user_pipe_error) {
-                        int dev_null = open("/dev/null", O_RDWR);
-                        dup2(dev_null, STDIN_FILENO);
-                        close(dev_null);
-                        #if 0
-                        cerr << "Set up user pipe input to null" << endl;
-                        #endif
-                    } else {
-                        dup2(user_pipes[input_user_pipe_idx].pipe.in, STDIN_FILENO);
-                        #if 0
-                        cerr << "Set up user pipe input to " << user_pipes[input_user_pipe_idx].pipe.in << endl;
-                        #endif
-                    }
+            limit_space::apply(me->cgroup);
+            execute_command(me, args);
+        }
+    }
+    close_pipes(me->pipes);
+    if (me->relay_out >= 0) {
+        // The session waits for the relay too if it waits for the final process
+        close(me->relay_out);
+        me->relay_out = -1;
+        me->relays.back().is_waited = (*wait_pid > 0);
+    }
+    return 0;
+}
 
-                }
+/* Session Coroutine */
+/*
+ * Every user session is a coroutine: wait for a line, parse it, spawn the
+ * pipeline and wait for the final process, then send the prompt. Waiting
+ * suspends the coroutine and the event loop in main() resumes it once the
+ * socket is readable or the child has exited (via pidfd), so a long-running
+ * command only blocks its own session.
+ */
+namespace session_space {
+    map<int, coroutine_handle<>> read_waiters;  // sockfd: session
+    map<int, coroutine_handle<>> exit_waiters;  // pidfd: session
+    map<int, coroutine_handle<>> relay_waiters; // uid: session
+
+    struct Task {
+        struct promise_type {
+            Task get_return_object() { return Task{coroutine_handle<promise_type>::from_promise(*this)}; }
+            suspend_never initial_suspend() { return {}; }
+            suspend_always final_suspend() noexcept { return {}; }  // Destroyed in del_process
+            void return_void() {}
+            void unhandled_exception() { terminate(); }
+        };
+
+        coroutine_handle<promise_type> handle;
+    };
+
+    struct ReadReady {
+        int fd;
+
+        bool await_ready() { return false; }
+        void await_suspend(coroutine_handle<> h) { read_waiters[fd] = h; }
+        void await_resume() {}
+    };
+
+    struct ChildExit {
+        pid_t pid;
+        struct rusage *usage;   // Accumulates the rusage of the child
+        int pidfd;              // -1 to open one here
+        int status;
+        long start_ns;
+
+        bool await_ready() {
+            start_ns = trace_space::now_ns();
+            if (pidfd < 0) pidfd = syscall(SYS_pidfd_open, pid, 0);
+            if (pidfd < 0) {
+                // No pidfd support, fall back to a blocking wait
+                reap();
+                return true;
             }
+            return false;
+        }
+        void await_suspend(coroutine_handle<> h) { exit_waiters[pidfd] = h; }
+        void reap() {
+            struct rusage ru;
+
+            if (wait4(pid, &status, 0, &ru) > 0) {
+                limit_space::add_rusage(usage, &ru);
+            }
+        }
+        int await_resume() {
+            if (pidfd >= 0) {
+                reap();
+                close(pidfd);
+            }
+            trace_space::record("waitpid", start_ns, trace_space::now_ns());
+            return status;
+        }
+    };
 
-            // Setup input and output of normal pipe
-            if (!is_first_cmd && !is_final_cmd) {
-                if (me->pipes.size() > 0) {
-                    dup2(me->pipes[i-1].in, STDIN_FILENO);
-                    dup2(me->pipes[i].out, STDOUT_FILENO);
+    bool has_waited_relay(user_space::UserInfo *me) {
+        for (auto &relay: me->relays) {
+            if (relay.is_waited) return true;
+        }
+        return false;
+    }
+
+    struct RelayDone {
+        user_space::UserInfo *me;
+
+        bool await_ready() { return !has_waited_relay(me); }
+        void await_suspend(coroutine_handle<> h) { relay_waiters[me->get_id()] = h; }
+        void await_resume() {}
+    };
+
+    bool is_idle() {
+        // No session is in the middle of a command, and no output is in flight
+        if (!exit_waiters.empty() || !relay_waiters.empty()) return false;
+        for (auto user: user_space::user_table.slots) {
+            // A batch script lives in its coroutine, so it cannot be handed over
+            if (user && (!user->relays.empty() || user->is_batch_open)) return false;
+        }
+        return true;
+    }
+
+    void watch(PollSet &pollset) {
+        for (auto &elem: read_waiters) {
+            pollset.watch(elem.first, POLLIN);
+        }
+        for (auto &elem: exit_waiters) {
+            pollset.watch(elem.first, POLLIN);
+        }
+    }
+
+    void resume_ready(PollSet &pollset) {
+        vector<coroutine_handle<>> ready;
+
+        // Collect first, resumed sessions register new waiters
+        for (auto waiters: {&read_waiters, &exit_waiters}) {
+            for (auto iter = waiters->begin(); iter != waiters->end(); ) {
+                if (pollset.is_readable(iter->first)) {
+                    ready.push_back(iter->second);
+                    iter = waiters->erase(iter);
+                } else {
+                    ++iter;
                 }
-                #if 0
-                cerr << "Internal (in) " << me->pipes[i-1].in << " to stdin"  << endl;
-                cerr << "Internal (out) " << me->pipes[i].out << " to stdout" << endl;
-                #endif
-                // TODO: user pipe in the middle ??
             }
+        }
 
-            if (is_final_cmd) {
-                if (is_number_pipe) {
-                    /* Number Pipe */
-                    #if 0
-                    cerr << "Final Number Pipe" << endl;
-                    #endif
-                    
-                    // Setup Input
-                    if (me->pipes.size() > 0) {
-                        // Receive from previous command via normal pipe
-                        dup2(me->pipes[i-1].in, STDIN_FILENO);
-                        #if 0
-                        cerr << "Final number Pipe (in) (from normal pip) " << me->pipes[i-1].in << " to stdin" << endl;
-                        #endif
-                    }
-                    
-                    // Setup Output
-                    for (size_t x = 0; x < me->number_pipes.size(); x++) {
-                        if (me->number_pipes[x].number == command.number) {
-                            dup2(me->number_pipes[x].out, STDOUT_FILENO);
-                            close(me->number_pipes[x].out);
-                            #if 0
-                            cerr << "Final Number Pipe (out) " << me->number_pipes[x].out << " to stdout" << endl;
-                            #endif
-                            break;
-                        }
-                    }
-                } else if (is_error_pipe) {
-                    #if 0
-                    cerr << "Final Error Pipe" << endl;
-                    #endif
-                    /* Error Pipe */
-                    /* Setup Input */
-                    if (me->pipes.size() > 0) {
-                        dup2(me->pipes[i-1].in, STDIN_FILENO);
+        for (auto h: ready) {
+            h.resume();
+        }
+    }
+}
+
+session_space::Task run_session(user_space::UserInfo *me) {
+    while (true) {
+        vector<Command> lines;
+        string input;
+        int code = 0;
+        int last_status = JOURNAL_NO_STATUS;
+        long start_ns;
+
+        // Get input message, one line at a time even if the client sent more
+        while (!next_line(me, input)) {
+            if (!me->telnet.eof) {
+                co_await session_space::ReadReady{me->get_sockfd()};
+            }
+            if (recv_msg(me) <= 0) {
+                // Connection closed without exit, or Ctrl-D
+                my_exit(me);
+                co_return;
+            }
+        }
+        trace_space::current_tid = me->get_id();
+        start_ns = trace_space::now_ns();
+
+        string slow_down("*** Error: too many commands, please slow down. ***\n");
+        bool is_admitted = (input.size() == 0 || rate_space::admit_command(&me->command_bucket));
+
+        if (!is_admitted) {
+            // Dropped before parsing, so number pipes do not count it
+            sendout_msg(me->get_sockfd(), slow_down);
+            // A dropped batch still reads its script, or its lines would run one by one
+            if (!batch_space::is_batch(input)) input.clear();
+        }
+
+        if (input.size() != 0 && batch_space::is_batch(input)) {
+            /* Batch script, see np_batch.h */
+            vector<string> script;
+            vector<BatchStep> steps;
+            deque<BatchJob> jobs;
+            bool is_too_long = false, is_alone = false;
+            bool is_batch_admitted = is_admitted;
+
+            me->is_batch_open = true;
+            while (true) {
+                string line;
+
+                while (!next_line(me, line)) {
+                    if (!me->telnet.eof) {
+                        co_await session_space::ReadReady{me->get_sockfd()};
                     }
-                    /* Setup Output and Error */
-                    for (size_t x = 0; x < me->number_pipes.size(); x++) {
-                        if (me->number_pipes[x].number == command.number) {
-                            dup2(me->number_pipes[x].out, STDOUT_FILENO);
-                            dup2(me->number_pipes[x].out, STDERR_FILENO);
-                            break;
-                        }
+                    if (recv_msg(me) <= 0) {
+                        my_exit(me);
+                        co_return;
                     }
-                } else if (is_output_user_pipe) {
-                    #if 0
-                    cerr << "Final User Pipe" << endl;
-                    #endif
+                }
+                if (line == BATCH_END) break;
+                // Every line costs what it would typed alone, one over the limit drops the script
+                if (is_admitted && line.size() != 0 && !rate_space::admit_command(&me->command_bucket)) {
+                    is_admitted = false;
+                }
+                if (script.size() < BATCH_MAX_LINES) {
+                    script.push_back(line);
+                } else {
+                    is_too_long = true;
+                }
+            }
+            if (is_too_long) {
+                string err("*** Error: a batch is limited to " + to_string(BATCH_MAX_LINES) + " lines. ***\n");
+                sendout_msg(me->get_sockfd(), err);
+                script.clear();
+            }
+            if (!is_admitted) {
+                if (is_batch_admitted) sendout_msg(me->get_sockfd(), slow_down);
+                script.clear();
+            }
+            {
+                TRACE_SPAN("batch_plan");
+                steps = batch_space::plan(script);
+            }
 
-                    if (me->pipes.size() > 0) {
-                        // Set input
-                        dup2(me->pipes[i-1].in, STDIN_FILENO);
-                    }
+            for (size_t i = 0; i <= steps.size() && code != BUILT_IN_EXIT; i++) {
+                // Past the last step, every job is collected
+                int mode = (i < steps.size()) ? steps[i].mode : BATCH_SERIAL;
 
-                    // Set output
-                    if (is_output_user_pipe_error) {
-                        int dev_null = open("/dev/null", O_RDWR);
-                        dup2(dev_null, STDOUT_FILENO);
-                        close(dev_null);
-                    } else {
-                        dup2(user_pipes[output_user_pipe_idx].pipe.out, STDOUT_FILENO);
+                // In script order, until a slot is free or nothing runs next to this one
+                while (!jobs.empty() && (mode != BATCH_PARALLEL || is_alone || jobs.size() >= BATCH_WINDOW)) {
+                    BatchJob &job = jobs.front();
+
+                    if (job.pid > 0) {
+                        int status = co_await session_space::ChildExit{job.pid, &me->usage, job.pidfd};
+                        last_status = journal_space::exit_code(status);
+                        co_await session_space::RelayDone{me};
+                        trace_space::current_tid = me->get_id();
+                        redirect_space::sync(me->sync_fds);
                     }
+                    finish_batch_job(me, job, script[job.line], &last_status);
+                    jobs.pop_front();
+                }
+                is_alone = false;
+                if (i == steps.size()) break;
 
-                } else {
-                    #if 0
-                    cerr << "Final Normal Pipe" << endl;
-                    #endif
-                    /* Normal Pipe*/
-                    if (me->pipes.size() > 0) {
-                        dup2(me->pipes[i-1].in, STDIN_FILENO);
-                        #if 0
-                        cerr << "Set input from " << me->pipes[i-1].in << " to stdin" << endl;
-                        #endif
+                BatchStep &step = steps[i];
+                BatchJob job = {step.line, -1, -1, -1, trace_space::now_ns(), step.is_line_end};
+
+                if (!step.command.cmds.empty()) {
+                    original_command = script[step.line];
+                    load_user_config(me);
+                    if (step.mode == BATCH_PARALLEL) {
+                        job.capture_fd = me->batch_fd = cache_space::open_capture();
+                    }
+                    {
+                        TRACE_SPAN("command");
+                        code = main_executor(me, step.command, &job.pid, &job.pidfd);
                     }
+                    me->batch_fd = -1;
+                }
+                if (code == BUILT_IN_EXIT) {
+                    journal_space::record(me->get_id(), script[step.line], last_status, job.start_ns);
+                    break;
+                }
+                jobs.push_back(job);
+                is_alone = (step.mode == BATCH_SERIAL);
+            }
+            me->is_batch_open = false;
+            // Its lines are journaled one by one
+            input.clear();
+        }
 
-                    // Redirect to socket
-                    dup2(me->get_sockfd(), STDOUT_FILENO);
-                    #if 0
-                    cerr << "Set output to socket " << me->get_sockfd() << endl;
-                    #endif
+        if (input.size() != 0) {
+            {
+                TRACE_SPAN("parse_number_pipe");
+                lines = parse_number_pipe(input);
+            }
+
+            for (size_t i = 0; i < lines.size(); i++) {
+                pid_t wait_pid = -1;
+                int wait_pidfd = -1;
+
+                // Other sessions may have run while this one was suspended
+                original_command = input;
+                load_user_config(me);
+
+                {
+                    TRACE_SPAN("command");
+                    code = main_executor(me, lines[i], &wait_pid, &wait_pidfd);
+                }
+
+                if (wait_pid > 0) {
+                    int status = co_await session_space::ChildExit{wait_pid, &me->usage, wait_pidfd};
+                    last_status = journal_space::exit_code(status);
+                    co_await session_space::RelayDone{me};
+                    trace_space::current_tid = me->get_id();
+
+                    if (me->capture_fd >= 0) {
+                        finish_capture(me, status);
+                    }
+                    redirect_space::sync(me->sync_fds);
                 }
             }
+        }
 
-            /* Close pipe */
-            for (int ci = 0; ci < me->pipes.size(); ci++) {
-                close(me->pipes[ci].in);
-                close(me->pipes[ci].out);
+        if (input.size() != 0) {
+            journal_space::record(me->get_id(), input, last_status, start_ns);
+        }
+        if (code == BUILT_IN_EXIT) {
+            journal_space::flush();
+            co_return;
+        }
+        command_prompt(me);
+    }
+}
+
+void start_session(user_space::UserInfo *me) {
+    me->session = run_session(me).handle;
+}
+
+void watch_relays(PollSet &pollset) {
+    // A relay is watched until its socket fills up, then the socket is
+    for (auto user: user_space::user_table.slots) {
+        // Behind queued messages, the outbox flush wakes the loop
+        if (!user || user->relays.empty() || !user->outbox.empty()) continue;
+
+        if (user->is_relay_blocked) {
+            pollset.watch(user->get_outfd(), POLLOUT);
+            continue;
+        }
+        for (auto &relay: user->relays) {
+            pollset.watch(relay.fd, POLLIN);
+        }
+    }
+}
+
+void forward_relays(PollSet &pollset) {
+    /*
+     * Up to RELAY_QUOTA bytes per user, the first user moves one slot each
+     * round. Queued messages go first, so the relay never overtakes them.
+     */
+    static size_t first = 0;
+    auto &slots = user_space::user_table.slots;
+    vector<coroutine_handle<>> ready;
+
+    first = (first + 1) % slots.size();
+    for (size_t x = 0; x < slots.size(); x++) {
+        user_space::UserInfo *user = slots[(first + x) % slots.size()];
+
+        if (!user || user->relays.empty() || !user->outbox.empty()) continue;
+        if (user->is_relay_blocked && !pollset.is_writable(user->get_outfd())) continue;
+
+        bool is_writable = user->is_relay_blocked;
+        size_t quota = RELAY_QUOTA;
+
+        user->is_relay_blocked = false;
+        for (size_t i = 0; i < user->relays.size() && quota > 0; ) {
+            if (!is_writable && !pollset.is_readable(user->relays[i].fd)) {
+                ++i;
+                continue;
             }
-            for (int ci = 0; ci < me->number_pipes.size(); ci++) {
-                close(me->number_pipes[ci].in);
-                close(me->number_pipes[ci].out);
+
+            int state = relay_space::forward(user->relays[i].fd, user->get_outfd(), &quota, &user->relay_stats);
+            if (state == RELAY_DONE) {
+                relay_space::close_relay(user->relays, i, &user->relay_stats);
+                continue;
             }
-            for (int x=0; x < user_pipes.size(); ++x) {
-                close(user_pipes[x].pipe.in);
-                close(user_pipes[x].pipe.out);
+            if (state == RELAY_BLOCKED) {
+                user->is_relay_blocked = true;
+                break;
             }
+            ++i;
+        }
 
-            execute_command(me, args);
+        auto iter = session_space::relay_waiters.find(user->get_id());
+        if (iter != session_space::relay_waiters.end() && !session_space::has_waited_relay(user)) {
+            ready.push_back(iter->second);
+            session_space::relay_waiters.erase(iter);
         }
     }
-    me->pipes.clear();
-    return 0;
+
+    for (auto h: ready) {
+        h.resume();
+    }
+}
+/* Session Coroutine End */
+
+/* Handoff */
+/*
+ * Graceful restart: the running server forks and execs a new binary with
+ * "--resume <fd>", then passes the listening socket, client sockets and all
+ * pending pipes over a Unix socket (SCM_RIGHTS) together with a serialized
+ * UserTable and user_pipes. Connected users keep their session, down to
+ * unread input, telnet options and rate limits. It waits until no session is
+ * running a command or a batch.
+ */
+void put_string(ostream &os, string str) {
+    os << str.length() << ":" << str << " ";
 }
 
-int handle_command(user_space::UserInfo *me, string input) {
-    vector<Command> lines;
-    int code;
+string get_string(istream &is) {
+    size_t len;
+    char colon;
+    string str;
 
-    lines = parse_number_pipe(input);
+    is >> len >> colon;
+    str.resize(len);
+    is.read(&str[0], len);
 
-    for (size_t i = 0; i < lines.size(); i++) {
-        code = main_executor(me, lines[i]);
+    return str;
+}
+
+bool send_fds(int channel, vector<int> &fds) {
+    for (size_t x = 0; x < fds.size(); x += HANDOFF_FD_CHUNK) {
+        int n = min((size_t)HANDOFF_FD_CHUNK, fds.size() - x);
+        char dummy = 0;
+        char control[CMSG_SPACE(sizeof(int) * HANDOFF_FD_CHUNK)];
+        struct iovec iov = {&dummy, 1};
+        struct msghdr mh;
+        struct cmsghdr *cmsg;
+
+        bzero(&mh, sizeof(mh));
+        bzero(control, sizeof(control));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+        memcpy(CMSG_DATA(cmsg), &fds[x], sizeof(int) * n);
+
+        if (sendmsg(channel, &mh, 0) < 0) {
+            perror("Handoff send fds");
+            return false;
+        }
     }
 
-    return code;
+    return true;
 }
 
-int run_shell(user_space::UserInfo *me, string input) {
-    if (input.size() == 0) {
-        return 0;
+bool recv_fds(int channel, vector<int> &fds, size_t total) {
+    while (fds.size() < total) {
+        int n = min((size_t)HANDOFF_FD_CHUNK, total - fds.size());
+        char dummy;
+        char control[CMSG_SPACE(sizeof(int) * HANDOFF_FD_CHUNK)];
+        struct iovec iov = {&dummy, 1};
+        struct msghdr mh;
+        struct cmsghdr *cmsg;
+
+        bzero(&mh, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+
+        if (recvmsg(channel, &mh, MSG_WAITALL) <= 0) {
+            perror("Handoff recv fds");
+            return false;
+        }
+
+        cmsg = CMSG_FIRSTHDR(&mh);
+        if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+            cerr << "Handoff recv fds: missing SCM_RIGHTS" << endl;
+            return false;
+        }
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int x = 0; x < n; ++x) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + x * sizeof(int), sizeof(int));
+            fds.push_back(fd);
+        }
+    }
+
+    return true;
+}
+
+string serialize_state(int listen_sock, vector<int> &fds) {
+    /*
+     * File descriptors are written as indexes into fds. Number pipes with
+     * the same target share one pipe, so each fd is only sent once.
+     */
+    ostringstream oss;
+    map<int, int> fd_index;
+    auto index_of = [&](int fd) {
+        if (fd_index.find(fd) == fd_index.end()) {
+            fd_index[fd] = fds.size();
+            fds.push_back(fd);
+        }
+        return fd_index[fd];
+    };
+
+    oss << index_of(listen_sock) << " " << user_space::user_table.size() << " ";
+    for (auto user: user_space::user_table.slots) {
+        if (!user) continue;
+        const sockaddr_storage &addr = user->get_addr();
+        map<string, string> env = user->get_env();
+
+        oss << user->get_id() << " " << index_of(user->get_sockfd()) << " "
+            << ((user->compress_fd >= 0) ? index_of(user->compress_fd) : -1) << " ";
+        put_string(oss, user->get_name());
+        put_string(oss, string((const char *)&addr, sizeof(addr)));
+        // The session keeps its cgroup and usage totals across the handoff
+        put_string(oss, user->cgroup);
+        put_string(oss, string((const char *)&user->usage, sizeof(user->usage)));
+        // Lines typed ahead, the telnet negotiation and the rate limits carry on too
+        put_string(oss, user->inbuf);
+        oss << user->telnet.state << " " << (int)user->telnet.verb << " "
+            << user->telnet.local << " " << user->telnet.remote << " "
+            << user->telnet.width << " " << user->telnet.height << " " << user->telnet.eof << " ";
+        put_string(oss, user->telnet.sub);
+        put_string(oss, string((const char *)&user->command_bucket, sizeof(user->command_bucket)));
+        put_string(oss, string((const char *)&user->msg_bucket, sizeof(user->msg_bucket)));
+        put_string(oss, string((const char *)&user->relay_stats, sizeof(user->relay_stats)));
+
+        oss << env.size() << " ";
+        for (auto &elem: env) {
+            put_string(oss, elem.first);
+            put_string(oss, elem.second);
+        }
+
+        oss << user->number_pipes.size() << " ";
+        user->number_pipes.for_each([&](long distance, int in, int out) {
+            oss << distance << " " << index_of(in) << " " << index_of(out) << " ";
+        });
+    }
+
+    oss << user_pipes.size() << " ";
+    for (auto &up: user_pipes) {
+        oss << up.src_uid << " " << up.dst_uid << " "
+            << index_of(up.pipe.in) << " " << index_of(up.pipe.out) << " " << up.is_done << " ";
+    }
+
+    return oss.str();
+}
+
+int deserialize_state(string state, vector<int> &fds) {
+    istringstream iss(state);
+    int listen_idx;
+    size_t n_users, n_up;
+
+    iss >> listen_idx >> n_users;
+    for (size_t x = 0; x < n_users; ++x) {
+        int uid, sock_idx, compress_idx;
+        size_t n_env, n_np;
+        string name;
+        sockaddr_storage addr;
+        string addr_bytes, cgroup, usage_bytes;
+        string command_bytes, msg_bytes, relay_bytes;
+        int verb;
+
+        bzero(&addr, sizeof(addr));
+        iss >> uid >> sock_idx >> compress_idx;
+        name = get_string(iss);
+        addr_bytes = get_string(iss);
+        memcpy(&addr, addr_bytes.data(), min(addr_bytes.size(), sizeof(addr)));
+        cgroup = get_string(iss);
+        usage_bytes = get_string(iss);
+
+        user_space::UserInfo *user = new user_space::UserInfo(uid, fds[sock_idx], name, addr);
+        user->cgroup = cgroup;
+        memcpy(&user->usage, usage_bytes.data(), min(usage_bytes.size(), sizeof(user->usage)));
+        user->inbuf = get_string(iss);
+        iss >> user->telnet.state >> verb >> user->telnet.local >> user->telnet.remote
+            >> user->telnet.width >> user->telnet.height >> user->telnet.eof;
+        user->telnet.verb = verb;
+        user->telnet.sub = get_string(iss);
+        command_bytes = get_string(iss);
+        msg_bytes = get_string(iss);
+        relay_bytes = get_string(iss);
+        memcpy(&user->command_bucket, command_bytes.data(), min(command_bytes.size(), sizeof(user->command_bucket)));
+        memcpy(&user->msg_bucket, msg_bytes.data(), min(msg_bytes.size(), sizeof(user->msg_bucket)));
+        memcpy(&user->relay_stats, relay_bytes.data(), min(relay_bytes.size(), sizeof(user->relay_stats)));
+        user->compress_fd = (compress_idx >= 0) ? fds[compress_idx] : -1;
+
+        iss >> n_env;
+        for (size_t y = 0; y < n_env; ++y) {
+            string key = get_string(iss);
+            string val = get_string(iss);
+            user->set_env(key, val);
+        }
+
+        iss >> n_np;
+        for (size_t y = 0; y < n_np; ++y) {
+            int number, in_idx, out_idx;
+
+            iss >> number >> in_idx >> out_idx;
+            user->number_pipes.put(number, fds[in_idx], fds[out_idx]);
+        }
+
+        user_space::user_table.add_user(user);
+    }
+
+    iss >> n_up;
+    for (size_t x = 0; x < n_up; ++x) {
+        UserPipe up;
+        int in_idx, out_idx;
+
+        iss >> up.src_uid >> up.dst_uid >> in_idx >> out_idx >> up.is_done;
+        up.pipe.in  = fds[in_idx];
+        up.pipe.out = fds[out_idx];
+        user_pipes.push_back(up);
     }
-    // Load user config
-    load_user_config(me);
 
-    // Hanld input command
-    return handle_command(me, input);
+    return fds[listen_idx];
 }
 
-int handle_client(int sockfd) {
-    // Get user
-    user_space::UserInfo *client = user_space::user_table.get_user_by_sockfd(sockfd);
+void handoff_process(const char *prog, const char *port, int listen_sock) {
+    struct timeval start, end;
+    int sv[2];
+    pid_t pid;
 
-    // Get input message
-    string input = read_msg(sockfd);
-    original_command = input;
+    gettimeofday(&start, NULL);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("Handoff socketpair");
+        return;
+    }
 
-    // Run shell
-    int code = run_shell(client, input);
-    if (code != BUILT_IN_EXIT) {
-        command_prompt(client);
+    pid = fork();
+    if (pid < 0) {
+        perror("Handoff fork");
+        close(sv[0]);
+        close(sv[1]);
+        return;
     }
 
-    return code;
+    if (pid == 0) {
+        /* Child, become the new server */
+        string channel = to_string(sv[1]);
+        int max_fd = sysconf(_SC_OPEN_MAX);
+
+        // Everything else is passed explicitly over the channel
+        for (int fd = STDERR_FILENO + 1; fd < max_fd; ++fd) {
+            if (fd != sv[1]) {
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+        }
+        // The settings of the server, environ holds the last user's
+        clearenv();
+        for (auto &var: server_env) {
+            putenv((char *)var.c_str());
+        }
+        execlp(prog, prog, port, "--resume", channel.c_str(), (char *)NULL);
+        perror("Handoff exec");
+        exit(1);
+    }
+
+    /* Parent, hand everything over */
+    flush_all_outbox(true);
+    vector<int> fds;
+    string state = serialize_state(listen_sock, fds);
+    size_t header[2] = {state.length(), fds.size()};
+    char ack = 0;
+
+    close(sv[1]);
+    if (!write_all(sv[0], (char *)header, sizeof(header)) ||
+        !write_all(sv[0], state.c_str(), state.length()) ||
+        !send_fds(sv[0], fds) ||
+        read(sv[0], &ack, 1) != 1 || ack != HANDOFF_ACK) {
+        cerr << "Handoff failed, keep serving" << endl;
+        close(sv[0]);
+        return;
+    }
+
+    gettimeofday(&end, NULL);
+    cerr << "Handoff " << user_space::user_table.size() << " users to pid " << pid << " in "
+         << (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec) << " us" << endl;
+
+    // The new server owns all sockets now
+    journal_space::flush();
+    exit(0);
+}
+
+int resume_process(int channel) {
+    size_t header[2];
+    vector<int> fds;
+    string state;
+    int listen_sock;
+    char ack = HANDOFF_ACK;
+
+    if (read(channel, header, sizeof(header)) != sizeof(header)) {
+        perror("Resume read header");
+        exit(0);
+    }
+
+    state.resize(header[0]);
+    for (size_t got = 0; got < header[0]; ) {
+        int n = read(channel, &state[got], header[0] - got);
+        if (n <= 0) {
+            perror("Resume read state");
+            exit(0);
+        }
+        got += n;
+    }
+
+    if (!recv_fds(channel, fds, header[1])) {
+        exit(0);
+    }
+
+    listen_sock = deserialize_state(state, fds);
+    write(channel, &ack, 1);
+    close(channel);
+
+    return listen_sock;
 }
+/* Handoff End */
 
-#endif
\ No newline at end of file
+#endif
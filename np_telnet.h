@@ -0,0 +1,277 @@
+#ifndef NP_TELNET_H
+#define NP_TELNET_H
+
+#include <stdint.h>
+#include <string.h>
+#include <bitset>
+#include <string>
+
+using namespace std;
+
+/*
+ * Telnet protocol layer
+ *
+ * Every byte received from a client goes through filter() before it reaches
+ * the line buffer of the connection. Clean runs of printable text are found
+ * eight bytes at a time and appended at once, and only the bytes around a
+ * control character or an IAC go through the state machine. Negotiation is
+ * answered, never started, so nc and other raw clients see no IAC at all:
+ *
+ *   SGA       accepted in both directions
+ *   NAWS      accepted, the window size is kept in the state
+ *   LINEMODE  accepted in EDIT mode, the client still sends whole lines
+ *   COMPRESS2 accepted, the server then starts np_compress.h for the session
+ *   others    refused
+ *
+ * Replies are appended to a string that the caller sends with its next
+ * output, so negotiation costs no extra read or write. CR LF, CR NUL and a
+ * bare CR all end a line, BS/DEL and IAC EC/EL edit the pending line, other
+ * control bytes are dropped, and Ctrl-D at the start of a line is EOF.
+ */
+#define TELNET_IAC          255
+#define TELNET_DONT         254
+#define TELNET_DO           253
+#define TELNET_WONT         252
+#define TELNET_WILL         251
+#define TELNET_SB           250
+#define TELNET_EL           248
+#define TELNET_EC           247
+#define TELNET_AYT          246
+#define TELNET_SE           240
+#define TELNET_OPT_SGA      3
+#define TELNET_OPT_NAWS     31
+#define TELNET_OPT_LINEMODE 34
+#define TELNET_OPT_COMPRESS2 86
+#define TELNET_LM_MODE      1
+#define TELNET_LM_EDIT      1
+#define TELNET_CTRL_D       4
+#define TELNET_SB_LIMIT     64      // Longer subnegotiations are truncated
+
+enum { TELNET_DATA, TELNET_CR, TELNET_CMD, TELNET_OPT, TELNET_SUB, TELNET_SUB_IAC };
+
+typedef struct telnet_state {
+    int state = TELNET_DATA;
+    unsigned char verb = 0;         // WILL, WONT, DO or DONT waiting for its option
+    bitset<256> local, remote;      // Options enabled on the server and on the client
+    string sub;                     // Subnegotiation being received
+    unsigned short width = 0;       // From NAWS, 0 if unknown
+    unsigned short height = 0;
+    bool eof = false;               // Ctrl-D at the start of a line
+} TelnetState;
+
+namespace telnet_space {
+    const uint64_t ONES  = 0x0101010101010101ULL;
+    const uint64_t HIGHS = 0x8080808080808080ULL;
+
+    size_t clean_prefix(const char *buf, size_t len) {
+        // Length of the leading run of bytes in 0x20..0x7e or 0x80..0xfe
+        size_t x = 0;
+
+        for (; x + 8 <= len; x += 8) {
+            uint64_t w;
+            memcpy(&w, buf + x, 8);
+
+            uint64_t control = (w - ONES * 0x20) & ~w;     // High bit set for bytes < 0x20
+            uint64_t del = w ^ (ONES * 0x7f);
+            uint64_t iac = ~w;
+            del = (del - ONES) & ~del;                      // Zero bytes of w ^ 0x7f
+            iac = (iac - ONES) & ~iac;                      // Zero bytes of ~w
+
+            if ((control | del | iac) & HIGHS) break;
+        }
+        for (; x < len; x++) {
+            unsigned char c = buf[x];
+            if (c < 0x20 || c == 0x7f || c == TELNET_IAC) break;
+        }
+        return x;
+    }
+
+    bool at_line_start(const string &line_buf) {
+        return line_buf.empty() || line_buf.back() == '\n';
+    }
+
+    void erase_char(string &line_buf) {
+        if (!at_line_start(line_buf)) line_buf.pop_back();
+    }
+
+    void erase_line(string &line_buf) {
+        while (!at_line_start(line_buf)) line_buf.pop_back();
+    }
+
+    void reply(string &out, unsigned char verb, unsigned char opt) {
+        out += (char)TELNET_IAC;
+        out += (char)verb;
+        out += (char)opt;
+    }
+
+    bool is_supported(unsigned char opt) {
+        return opt == TELNET_OPT_SGA || opt == TELNET_OPT_NAWS || opt == TELNET_OPT_LINEMODE;
+    }
+
+    void negotiate(TelnetState *st, unsigned char opt, string &out) {
+        // Only a change of state is answered, so two peers cannot loop
+        switch (st->verb) {
+        case TELNET_WILL:
+            if (st->remote[opt]) break;
+            if (!is_supported(opt)) {
+                reply(out, TELNET_DONT, opt);
+                break;
+            }
+            st->remote[opt] = true;
+            reply(out, TELNET_DO, opt);
+            if (opt == TELNET_OPT_LINEMODE) {
+                const char mode[] = {(char)TELNET_IAC, (char)TELNET_SB, TELNET_OPT_LINEMODE,
+                                     TELNET_LM_MODE, TELNET_LM_EDIT, (char)TELNET_IAC, (char)TELNET_SE};
+                out.append(mode, sizeof(mode));
+            }
+            break;
+        case TELNET_WONT:
+            if (st->remote[opt]) {
+                st->remote[opt] = false;
+                reply(out, TELNET_DONT, opt);
+            }
+            break;
+        case TELNET_DO:
+            if (st->local[opt]) break;
+            if (opt == TELNET_OPT_SGA || opt == TELNET_OPT_COMPRESS2) {
+                st->local[opt] = true;
+                reply(out, TELNET_WILL, opt);
+            } else {
+                reply(out, TELNET_WONT, opt);
+            }
+            break;
+        case TELNET_DONT:
+            if (st->local[opt]) {
+                st->local[opt] = false;
+                reply(out, TELNET_WONT, opt);
+            }
+            break;
+        }
+    }
+
+    void subnegotiate(TelnetState *st) {
+        const unsigned char *p = (const unsigned char *)st->sub.data();
+
+        if (st->sub.size() >= 5 && p[0] == TELNET_OPT_NAWS) {
+            st->width  = (p[1] << 8) | p[2];
+            st->height = (p[3] << 8) | p[4];
+        }
+        st->sub.clear();
+    }
+
+    void command(TelnetState *st, unsigned char c, string &line_buf, string &out) {
+        // The byte after IAC
+        st->state = TELNET_DATA;
+        switch (c) {
+        case TELNET_IAC:
+            line_buf += (char)TELNET_IAC;   // Escaped 0xff is data
+            break;
+        case TELNET_WILL: case TELNET_WONT: case TELNET_DO: case TELNET_DONT:
+            st->verb = c;
+            st->state = TELNET_OPT;
+            break;
+        case TELNET_SB:
+            st->sub.clear();
+            st->state = TELNET_SUB;
+            break;
+        case TELNET_EC:
+            erase_char(line_buf);
+            break;
+        case TELNET_EL:
+            erase_line(line_buf);
+            break;
+        case TELNET_AYT:
+            out += "\r\n[Yes]\r\n";
+            break;
+        default:
+            // NOP, GA, DM, BRK, IP, AO and stray SE
+            break;
+        }
+    }
+
+    void data(TelnetState *st, unsigned char c, string &line_buf) {
+        // A control byte in the data stream
+        switch (c) {
+        case '\r':
+            line_buf += '\n';
+            st->state = TELNET_CR;
+            break;
+        case '\n':
+        case '\t':
+            line_buf += (char)c;
+            break;
+        case '\b':
+        case 0x7f:
+            erase_char(line_buf);
+            break;
+        case TELNET_CTRL_D:
+            if (at_line_start(line_buf)) st->eof = true;
+            break;
+        default:
+            break;
+        }
+    }
+
+    void filter(TelnetState *st, const char *buf, size_t len, string &line_buf, string &out) {
+        /*
+         * Append the data of buf to line_buf and the replies to out. Stops
+         * at EOF, the rest of the connection is not read.
+         */
+        size_t x = 0;
+
+        while (x < len && !st->eof) {
+            unsigned char c = buf[x];
+
+            if (st->state == TELNET_DATA) {
+                size_t run = clean_prefix(buf + x, len - x);
+                if (run > 0) {
+                    line_buf.append(buf + x, run);
+                    x += run;
+                    continue;
+                }
+                if (c == TELNET_IAC) {
+                    st->state = TELNET_CMD;
+                } else {
+                    data(st, c, line_buf);
+                }
+                ++x;
+                continue;
+            }
+
+            ++x;
+            switch (st->state) {
+            case TELNET_CR:
+                // CR LF and CR NUL are one end of line
+                st->state = TELNET_DATA;
+                if (c != '\n' && c != '\0') --x;
+                break;
+            case TELNET_CMD:
+                command(st, c, line_buf, out);
+                break;
+            case TELNET_OPT:
+                negotiate(st, c, out);
+                st->state = TELNET_DATA;
+                break;
+            case TELNET_SUB:
+                if (c == TELNET_IAC) {
+                    st->state = TELNET_SUB_IAC;
+                } else if (st->sub.size() < TELNET_SB_LIMIT) {
+                    st->sub += (char)c;
+                }
+                break;
+            case TELNET_SUB_IAC:
+                if (c == TELNET_SE) {
+                    subnegotiate(st);
+                    st->state = TELNET_DATA;
+                } else {
+                    // IAC IAC inside a subnegotiation is a 0xff byte
+                    if (st->sub.size() < TELNET_SB_LIMIT) st->sub += (char)c;
+                    st->state = TELNET_SUB;
+                }
+                break;
+            }
+        }
+    }
+}
+
+#endif
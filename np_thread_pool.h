@@ -0,0 +1,1044 @@
+#ifndef NP_THREAD_POOL_H
+#define NP_THREAD_POOL_H
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "np_core.h"
+#include "np_trace.h"
+#include "np_limits.h"
+#include "np_number_pipe.h"
+#include "np_redirect.h"
+#include "np_builtin.h"
+#include "np_ratelimit.h"
+#include "np_telnet.h"
+#include "np_compress.h"
+#include "np_journal.h"
+#include "np_format.h"
+
+using namespace std;
+
+/*
+ * Thread-per-core model, `np_multi_proc port --threads [workers]`
+ *
+ * A fixed pool of worker threads, one per core by default, each runs an
+ * epoll loop over the sessions the accepting thread hands it. Users and user
+ * pipes are plain in-process state under one mutex, so there is no shared
+ * memory, FIFO or signal: a message is written to the receiver's socket by
+ * whichever worker produced it. Every descriptor is close-on-exec, so a
+ * command forked by one worker never holds the pipes or sockets of another
+ * session, and every child is reaped through a pidfd in its worker's loop.
+ *
+ * Messages are queued in the receiver's outbox and sent without waiting.
+ * The socket stays blocking for the commands writing into it, so the sends
+ * use MSG_DONTWAIT, and what the socket does not take is left to the
+ * receiver's worker on EPOLLOUT. A client that stops reading only grows its
+ * own outbox, and its next command waits until the outbox has drained.
+ */
+#define THREAD_MAX_EVENTS   64
+#define THREAD_MAX_BUF_SIZE 15000
+#define THREAD_USER_LIMIT   30
+#define THREAD_BUILT_IN_EXIT    99
+#define THREAD_BUILT_IN_TRUE    1
+#define THREAD_BUILT_IN_FALSE   0
+
+namespace thread_space {
+    class Worker;
+
+    typedef shared_ptr<const string> MsgBuffer;   // Shared by all receivers, NULL marks the compress switch
+
+    class Session {
+    public:
+        int id, sock;
+        UserDisplay display;        // Name, ip:port and who row, guarded by state_lock
+        sockaddr_storage addr;
+        map<string, string> env = {{"PATH", "bin:."}};
+
+        // Owned by the worker of the session
+        string inbuf;               // Received bytes not yet cut into lines
+        TelnetState telnet;         // See np_telnet.h
+        deque<Command> pending;     // Rest of the line, split by number pipes
+        string input;               // The line being run, for user pipe messages
+        bool in_line = false;       // Prompt is due once pending drains
+        long start_ns = 0;          // When input was read
+        int status = JOURNAL_NO_STATUS;     // Of the last waited process
+        int wait_pidfd = -1;        // Final process of the running command
+        NumberPipeWheel number_pipes;
+        struct rusage usage = {};
+        string cgroup;              // See np_limits.h
+        TokenBucket command_bucket = {};
+        TokenBucket msg_bucket = {};
+        vector<int> sync_fds;       // See np_redirect.h
+
+        // Written by any worker under out_lock
+        mutex out_lock;
+        bool is_closed = false;
+        int compress_fd = -1;       // Output through np_compress.h, once asked for
+        deque<MsgBuffer> outbox;    // Not yet taken by the socket
+        size_t outbox_offset = 0;   // Bytes of outbox.front() already sent
+        Worker *owner = NULL;       // Set once the socket is watched
+        bool is_reading = true;     // Input is watched, not while a command runs
+
+        Session(int id, int sock, const sockaddr_storage &addr) {
+            this->id   = id;
+            this->sock = sock;
+            this->addr = addr;
+            format_space::init_display(&this->display, id, "(no name)", addr);
+            this->cgroup = "np_thread_" + to_string(getpid()) + "_" + to_string(id);
+        }
+
+        ~Session() {
+            // Last reference, no worker can write to the descriptor any more
+            close(this->sock);
+            if (this->compress_fd >= 0) close(this->compress_fd);
+        }
+
+        int get_outfd() {
+            return (this->compress_fd >= 0) ? this->compress_fd : this->sock;
+        }
+    };
+
+    typedef struct child_waiter {
+        shared_ptr<Session> session;
+        pid_t pid;
+    } ChildWaiter;
+
+    class Worker {
+    public:
+        int epfd;
+        int notify[2];                              // Wakes the worker for new connections
+        mutex lock;                                 // Guards incoming
+        vector<pair<int, sockaddr_storage>> incoming;
+        unordered_map<int, shared_ptr<Session>> sockets;    // sockfd: session
+        unordered_map<int, ChildWaiter> children;           // pidfd: child
+        thread th;
+    };
+
+    /* Shared state, guarded by state_lock */
+    mutex state_lock;
+    shared_ptr<Session> users[THREAD_USER_LIMIT + 1];  // uid: session, slot 0 is unused
+    map<pair<int, int>, Pipe> user_pipes;               // (src, dst): pipe
+    const regex up_in_pattern("[<][1-9]\\d?\\d?\\d?[0]?");
+    const regex up_out_pattern("[>][1-9]\\d?\\d?\\d?[0]?");
+
+    thread_local Worker *self = NULL;   // Worker running on this thread
+
+    /* Network IO */
+    void watch(int fd, uint32_t events, int op);
+
+    void rearm(Session *s) {
+        // With out_lock held, from any worker
+        uint32_t events = s->is_reading ? EPOLLIN : 0;
+        struct epoll_event ev = {};
+
+        if (s->owner == NULL) {
+            return;
+        }
+        if (!s->outbox.empty() && s->compress_fd < 0) events |= EPOLLOUT;
+        ev.events = events;
+        ev.data.fd = s->sock;
+        epoll_ctl(s->owner->epfd, EPOLL_CTL_MOD, s->sock, &ev);
+
+        if (s->compress_fd >= 0) {
+            ev.events = s->outbox.empty() ? 0 : EPOLLOUT;
+            ev.data.fd = s->compress_fd;
+            epoll_ctl(s->owner->epfd, EPOLL_CTL_MOD, s->compress_fd, &ev);
+        }
+    }
+
+    void flush(Session *s) {
+        // With out_lock held, sends what the socket takes now
+        struct iovec iov[IOV_MAX];
+        struct msghdr mh = {};
+
+        while (!s->outbox.empty()) {
+            int cnt = 0;
+            ssize_t n;
+
+            if (!s->outbox.front()) {
+                // Compression starts here, on the worker of the session
+                if (self != s->owner) return;
+                s->outbox.pop_front();
+                s->compress_fd = compress_space::spawn_thread(s->sock);
+                if (s->compress_fd >= 0) {
+                    watch(s->compress_fd, 0, EPOLL_CTL_ADD);
+                    self->sockets[s->compress_fd] = self->sockets[s->sock];
+                }
+                continue;
+            }
+            for (auto iter = s->outbox.begin(); iter != s->outbox.end() && *iter && cnt < IOV_MAX; ++iter, ++cnt) {
+                size_t offset = (cnt == 0) ? s->outbox_offset : 0;
+                iov[cnt].iov_base = (void *)((*iter)->c_str() + offset);
+                iov[cnt].iov_len  = (*iter)->length() - offset;
+            }
+
+            mh.msg_iov = iov;
+            mh.msg_iovlen = cnt;
+            n = sendmsg(s->get_outfd(), &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            if (n < 0) {
+                // Peer is gone, its session ends on the next read
+                s->outbox.clear();
+                s->outbox_offset = 0;
+                return;
+            }
+
+            // Drop fully sent buffers, remember where a partial write stopped
+            n += s->outbox_offset;
+            while (!s->outbox.empty() && s->outbox.front() && (size_t)n >= s->outbox.front()->length()) {
+                n -= s->outbox.front()->length();
+                s->outbox.pop_front();
+            }
+            s->outbox_offset = n;
+        }
+    }
+
+    void send_to(Session *s, MsgBuffer buf) {
+        // Never waits for the receiver, the rest is sent by its worker
+        lock_guard<mutex> guard(s->out_lock);
+
+        if (s->is_closed) {
+            return;
+        }
+        s->outbox.push_back(buf);
+        if (s->outbox.size() == 1) {
+            flush(s);
+            if (!s->outbox.empty()) rearm(s);
+        }
+    }
+
+    void send_to(Session *s, const string &msg) {
+        send_to(s, make_shared<const string>(msg));
+    }
+
+    bool has_output(Session *s) {
+        lock_guard<mutex> guard(s->out_lock);
+        return !s->outbox.empty();
+    }
+
+    void set_reading(Session *s, bool is_reading) {
+        lock_guard<mutex> guard(s->out_lock);
+        s->is_reading = is_reading;
+        rearm(s);
+    }
+
+    vector<shared_ptr<Session>> online() {
+        vector<shared_ptr<Session>> sessions;
+        lock_guard<mutex> guard(state_lock);
+
+        for (int x = 1; x <= THREAD_USER_LIMIT; ++x) {
+            if (users[x]) sessions.push_back(users[x]);
+        }
+        return sessions;
+    }
+
+    void broadcast(const string &msg) {
+        // Queued outside state_lock, one buffer for every receiver
+        MsgBuffer buf = make_shared<const string>(msg);
+
+        for (auto &s: online()) {
+            send_to(s.get(), buf);
+        }
+    }
+
+    void command_prompt(Session *me) {
+        send_to(me, "% ");
+    }
+
+    void welcome(Session *me) {
+        send_to(me, "****************************************\n"
+                    "** Welcome to the information server. **\n"
+                    "****************************************\n");
+    }
+
+    /* Login and Logout */
+    void watch(int fd, uint32_t events, int op) {
+        struct epoll_event ev = {};
+
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(self->epfd, op, fd, &ev) < 0) {
+            perror("epoll_ctl");
+        }
+    }
+
+    void login(int sock, const sockaddr_storage &addr) {
+        shared_ptr<Session> me;
+
+        {
+            lock_guard<mutex> guard(state_lock);
+            for (int x = 1; x <= THREAD_USER_LIMIT && !me; ++x) {
+                if (!users[x]) me = users[x] = make_shared<Session>(x, sock, addr);
+            }
+        }
+        if (!me) {
+            cerr << "Online users are up to limit (" << THREAD_USER_LIMIT << ")" << endl;
+            close(sock);
+            return;
+        }
+        limit_space::create_session(me->cgroup);
+        self->sockets[sock] = me;
+        {
+            // Others may have queued messages since the slot was taken
+            lock_guard<mutex> guard(me->out_lock);
+            watch(sock, 0, EPOLL_CTL_ADD);
+            me->owner = self;
+            rearm(me.get());
+        }
+
+        welcome(me.get());
+        broadcast("*** User '" + me->display.name + "' entered from " + me->display.addr + ". ***\n");
+        command_prompt(me.get());
+    }
+
+    void close_session(shared_ptr<Session> me) {
+        // The descriptor is closed with the last reference, see ~Session. A
+        // compressed session is closed by its compressor once the rest is sent.
+        if (me->compress_fd < 0) shutdown(me->sock, SHUT_RDWR);
+        watch(me->sock, 0, EPOLL_CTL_DEL);
+        self->sockets.erase(me->sock);
+        if (me->compress_fd >= 0) {
+            watch(me->compress_fd, 0, EPOLL_CTL_DEL);
+            self->sockets.erase(me->compress_fd);
+        }
+    }
+
+    void logout(shared_ptr<Session> me) {
+        string name;
+
+        journal_space::flush();
+
+        {
+            lock_guard<mutex> guard(state_lock);
+            name = me->display.name;
+        }
+        broadcast("*** User '" + name + "' left. ***\n");
+
+        {
+            lock_guard<mutex> guard(state_lock);
+            users[me->id] = NULL;
+            for (auto iter = user_pipes.begin(); iter != user_pipes.end(); ) {
+                if (iter->first.first == me->id || iter->first.second == me->id) {
+                    close(iter->second.in);
+                    close(iter->second.out);
+                    iter = user_pipes.erase(iter);
+                } else {
+                    ++iter;
+                }
+            }
+        }
+
+        bool is_drained;
+        {
+            // Nothing more is queued, what is left is sent before the close
+            lock_guard<mutex> guard(me->out_lock);
+            me->is_closed = true;
+            me->is_reading = false;
+            is_drained = me->outbox.empty();
+            rearm(me.get());
+        }
+        if (is_drained) close_session(me);
+        limit_space::remove_session(me->cgroup);
+        redirect_space::sync(me->sync_fds);
+    }
+
+    /* Built-in Command */
+    bool admit_msg(Session *me, const string &msg) {
+        if (rate_space::admit_msg(&me->msg_bucket, msg.length())) {
+            return true;
+        }
+        send_to(me, "*** Error: too many messages, please slow down. ***\n");
+        return false;
+    }
+
+    void my_printenv(Session *me, string var) {
+        auto iter = me->env.find(var);
+
+        if (iter != me->env.end()) {
+            send_to(me, iter->second + "\n");
+        }
+    }
+
+    void who(Session *me) {
+        FormatBuffer<> fmt;
+        {
+            lock_guard<mutex> guard(state_lock);
+
+            fmt.add(format_space::WHO_HEADER);
+            for (int x = 1; x <= THREAD_USER_LIMIT; ++x) {
+                Session *user = users[x].get();
+                if (!user) continue;
+                fmt.add(*user->display.row).add((user == me) ? format_space::WHO_ME : "\n");
+            }
+        }
+        send_to(me, fmt.str());
+    }
+
+    void usage(Session *me) {
+        send_to(me, limit_space::usage(me->cgroup, &me->usage));
+    }
+
+    void my_compress(Session *me) {
+        // Switched behind the messages queued so far, they leave uncompressed
+        lock_guard<mutex> guard(me->out_lock);
+
+        if (me->compress_fd < 0 && !me->is_closed && find(me->outbox.begin(), me->outbox.end(), nullptr) == me->outbox.end()) {
+            me->outbox.push_back(nullptr);
+            flush(me);
+            rearm(me);
+        }
+    }
+
+    void tell(Session *me, string id_or_name, string msg) {
+        shared_ptr<Session> target;
+        string name;
+
+        if (!admit_msg(me, msg)) {
+            return;
+        }
+
+        {
+            lock_guard<mutex> guard(state_lock);
+            if (isdigit(id_or_name.c_str()[0])) {
+                int id = atoi(id_or_name.c_str());
+                if (id > 0 && id <= THREAD_USER_LIMIT) target = users[id];
+            } else {
+                for (int x = 1; x <= THREAD_USER_LIMIT && !target; ++x) {
+                    if (users[x] && users[x]->display.name == id_or_name) target = users[x];
+                }
+            }
+            name = me->display.name;
+        }
+
+        if (target) {
+            send_to(target.get(), "*** " + name + " told you ***: " + msg + "\n");
+        } else if (isdigit(id_or_name.c_str()[0])) {
+            send_to(me, "*** Error: user #" + to_string(atoi(id_or_name.c_str())) + " does not exist yet. ***\n");
+        }
+    }
+
+    void yell(Session *me, string msg) {
+        string name;
+
+        if (!admit_msg(me, msg)) {
+            return;
+        }
+        {
+            lock_guard<mutex> guard(state_lock);
+            name = me->display.name;
+        }
+        broadcast("*** " + name + " yelled ***: " + msg + "\n");
+    }
+
+    void name_cmd(Session *me, string name) {
+        bool is_taken = false;
+
+        {
+            // Checked and set at once, two users cannot take the same name
+            lock_guard<mutex> guard(state_lock);
+            for (int x = 1; x <= THREAD_USER_LIMIT && !is_taken; ++x) {
+                is_taken = users[x] && users[x]->display.name == name;
+            }
+            if (!is_taken) format_space::set_name(&me->display, me->id, name);
+        }
+
+        if (is_taken) {
+            send_to(me, "*** User '" + name + "' already exists. ***\n");
+        } else {
+            broadcast("*** User from " + me->display.addr + " is named '" + name + "'. ***\n");
+        }
+    }
+
+    int handle_builtin(shared_ptr<Session> &me, string cmd) {
+        BuiltinCall call;
+
+        if (!builtin_space::parse(cmd, call)) {
+            return THREAD_BUILT_IN_FALSE;
+        }
+
+        switch (call.id) {
+        case BUILTIN_setenv:
+            me->env[string(call.args[0])] = string(call.args[1]);
+            return THREAD_BUILT_IN_TRUE;
+        case BUILTIN_printenv:
+            my_printenv(me.get(), string(call.args[0]));
+            return THREAD_BUILT_IN_TRUE;
+        case BUILTIN_exit:
+            journal_space::record(me->id, me->input, JOURNAL_NO_STATUS, me->start_ns);
+            logout(me);
+            return THREAD_BUILT_IN_EXIT;
+        case BUILTIN_who:
+            who(me.get());
+            return THREAD_BUILT_IN_TRUE;
+        case BUILTIN_usage:
+            usage(me.get());
+            return THREAD_BUILT_IN_TRUE;
+        case BUILTIN_compress:
+            my_compress(me.get());
+            return THREAD_BUILT_IN_TRUE;
+        case BUILTIN_tell:
+            tell(me.get(), string(call.args[0]), string(call.args[1]));
+            return THREAD_BUILT_IN_TRUE;
+        case BUILTIN_yell:
+            yell(me.get(), string(call.args[0]));
+            return THREAD_BUILT_IN_TRUE;
+        case BUILTIN_name:
+            name_cmd(me.get(), string(call.args[0]));
+            return THREAD_BUILT_IN_TRUE;
+        default:
+            return THREAD_BUILT_IN_FALSE;
+        }
+    }
+    /* Built-in Command End */
+
+    /* User Pipe */
+    int open_null() {
+        return open("/dev/null", O_RDWR | O_CLOEXEC);
+    }
+
+    int take_user_pipe(Session *me, const string &cmd, Pipe *taken) {
+        /*
+         * Input of `<N`, the pipe leaves the table and both ends are closed
+         * by the caller once the reader is forked. Returns the descriptor
+         * for stdin, /dev/null on error.
+         */
+        smatch result;
+        int src_uid;
+        string msg, error;
+
+        regex_search(cmd, result, up_in_pattern);
+        src_uid = atoi(cmd.substr(result.position() + 1, result.length() - 1).c_str());
+
+        {
+            lock_guard<mutex> guard(state_lock);
+            auto iter = user_pipes.find({src_uid, me->id});
+
+            if (src_uid > THREAD_USER_LIMIT || !users[src_uid]) {
+                error = "*** Error: user #" + to_string(src_uid) + " does not exist yet. ***\n";
+            } else if (iter == user_pipes.end()) {
+                error = "*** Error: the pipe #" + to_string(src_uid) + "->#" + to_string(me->id) + " does not exist yet. ***\n";
+            } else {
+                *taken = iter->second;
+                user_pipes.erase(iter);
+                msg = "*** " + me->display.name + " (#" + to_string(me->id) + ") just received from "
+                    + users[src_uid]->display.name + " (#" + to_string(src_uid) + ") by '" + me->input + "' ***\n";
+            }
+        }
+
+        if (!error.empty()) {
+            send_to(me, error);
+            return open_null();
+        }
+        broadcast(msg);
+        return taken->in;
+    }
+
+    int make_user_pipe(Session *me, const string &cmd, int *null_fd) {
+        // Output of `>N`, the table keeps both ends until the receiver takes them
+        smatch result;
+        int dst_uid, pipefd[2];
+        string msg, error;
+
+        regex_search(cmd, result, up_out_pattern);
+        dst_uid = atoi(cmd.substr(result.position() + 1, result.length() - 1).c_str());
+
+        {
+            lock_guard<mutex> guard(state_lock);
+
+            if (dst_uid > THREAD_USER_LIMIT || !users[dst_uid]) {
+                error = "*** Error: user #" + to_string(dst_uid) + " does not exist yet. ***\n";
+            } else if (user_pipes.count({me->id, dst_uid})) {
+                error = "*** Error: the pipe #" + to_string(me->id) + "->#" + to_string(dst_uid) + " already exists. ***\n";
+            } else if (pipe2(pipefd, O_CLOEXEC) < 0) {
+                error = "*** Error: " + string(strerror(errno)) + ". ***\n";
+            } else {
+                user_pipes[{me->id, dst_uid}] = Pipe{pipefd[0], pipefd[1]};
+                msg = "*** " + me->display.name + " (#" + to_string(me->id) + ") just piped '" + me->input + "' to "
+                    + users[dst_uid]->display.name + " (#" + to_string(dst_uid) + ") ***\n";
+            }
+        }
+
+        if (!error.empty()) {
+            send_to(me, error);
+            return *null_fd = open_null();
+        }
+        broadcast(msg);
+        return pipefd[1];
+    }
+    /* User Pipe End */
+
+    /* Executor */
+    typedef struct exec_plan {
+        // Built before fork, another thread may hold the allocator or the environment lock then
+        vector<string> paths;       // args[0] searched in the session PATH, in order
+        vector<string> env;         // KEY=VALUE
+        vector<char *> argv, envp;
+        string unknown;             // Unknown command message
+        string procs;               // See limit_space::procs_path
+    } ExecPlan;
+
+    void plan_exec(Session *me, vector<string> &args, ExecPlan &plan) {
+        for (auto &elem: me->env) {
+            plan.env.push_back(elem.first + "=" + elem.second);
+        }
+        for (auto &str: plan.env) {
+            plan.envp.push_back((char *)str.c_str());
+        }
+        plan.envp.push_back(NULL);
+        for (auto &arg: args) {
+            plan.argv.push_back((char *)arg.c_str());
+        }
+        plan.argv.push_back(NULL);
+        plan.procs = limit_space::procs_path(me->cgroup);
+
+        if (args.empty()) {
+            return;
+        }
+        plan.unknown = "Unknown command: [" + args[0] + "].\n";
+        if (args[0].find('/') != string::npos) {
+            plan.paths.push_back(args[0]);
+            return;
+        }
+        // As execvp, with the session PATH instead of the server's
+        auto iter = me->env.find("PATH");
+        string path = (iter != me->env.end()) ? iter->second : "/bin:/usr/bin";
+        size_t start = 0, end;
+
+        do {
+            end = path.find(':', start);
+            string dir = path.substr(start, end - start);
+            plan.paths.push_back((dir.empty() ? "." : dir) + "/" + args[0]);
+            start = end + 1;
+        } while (end != string::npos);
+    }
+
+    void run_child(Session *me, ExecPlan &plan, int in_fd, int out_fd, bool is_error_pipe, Redirection &redir) {
+        // Only system calls from here, see ExecPlan
+        dup2(me->get_outfd(), STDERR_FILENO);
+        if (in_fd >= 0)     dup2(in_fd, STDIN_FILENO);
+        if (out_fd >= 0)    dup2(out_fd, STDOUT_FILENO);
+        if (is_error_pipe)  dup2(out_fd, STDERR_FILENO);
+        redirect_space::apply(redir);
+        limit_space::apply_procs(plan.procs.c_str());
+
+        for (auto &path: plan.paths) {
+            execve(path.c_str(), plan.argv.data(), plan.envp.data());
+        }
+        if (write(me->get_outfd(), plan.unknown.data(), plan.unknown.size()) < 0) {}
+        // Do not run the atexit handlers of the server
+        _exit(1);
+    }
+
+    void watch_child(shared_ptr<Session> &me, pid_t pid, bool is_final) {
+        int pidfd = syscall(SYS_pidfd_open, pid, 0);    // Close-on-exec
+
+        if (pidfd < 0) {
+            // No pidfd support, wait the final process here and leave the rest
+            // to the kernel once the server exits
+            if (is_final) {
+                int status;
+                struct rusage ru;
+                if (wait4(pid, &status, 0, &ru) > 0) {
+                    limit_space::add_rusage(&me->usage, &ru);
+                    me->status = journal_space::exit_code(status);
+                }
+            }
+            return;
+        }
+        self->children[pidfd] = ChildWaiter{me, pid};
+        watch(pidfd, EPOLLIN, EPOLL_CTL_ADD);
+        if (is_final) {
+            me->wait_pidfd = pidfd;
+            // Input waits until the command is done, as in the other servers
+            set_reading(me.get(), false);
+        }
+    }
+
+    int execute(shared_ptr<Session> &me, Command &command) {
+        me->number_pipes.advance();
+        if (command.cmds.size() == 1) {
+            int code = handle_builtin(me, command.cmds[0]);
+            if (code != THREAD_BUILT_IN_FALSE) {
+                return code;
+            }
+        }
+
+        // Open redirected files first, nothing is forked if one fails
+        vector<Redirection> redirs;
+        string error;
+
+        if (!redirect_space::open_all(command.cmds, redirs, error)) {
+            send_to(me.get(), error);
+            return 0;
+        }
+
+        int prev_in = -1;   // Read end of the previous normal pipe
+
+        for (size_t i = 0; i < command.cmds.size(); i++) {
+            bool is_first_cmd = (i == 0), is_final_cmd = (i == command.cmds.size() - 1);
+            bool is_number_pipe = false, is_error_pipe = false, is_output_user_pipe = false;
+            vector<string> args;
+            int in_fd = -1, out_fd = -1, next_in = -1;
+            int up_null = -1;               // /dev/null for a failed output user pipe
+            Pipe up_in = {-1, -1};          // Taken input user pipe
+            smatch result;
+            pid_t pid;
+
+            /* Parse Command to Args */
+            for (auto &arg: split_args(command.cmds[i])) {
+                if (regex_search(arg, result, up_in_pattern) || regex_search(arg, result, up_out_pattern)) continue;
+                if (is_final_cmd && ((is_number_pipe = (arg.find("|") != string::npos)) ||
+                                     (is_error_pipe  = (arg.find("!") != string::npos)))) continue;
+                args.push_back(arg);
+            }
+            redirect_space::strip(args);
+
+            /* Wire Input */
+            if (is_first_cmd) {
+                if (PendingPipe *number_pipe_in = me->number_pipes.current()) {
+                    in_fd = number_pipe_in->in;
+                }
+                if (regex_search(command.cmds[i], result, up_in_pattern)) {
+                    in_fd = take_user_pipe(me.get(), command.cmds[i], &up_in);
+                    if (up_in.in < 0) up_in.in = in_fd;     // /dev/null, closed with it
+                }
+            } else {
+                in_fd = prev_in;
+            }
+
+            /* Wire Output */
+            if (!is_final_cmd) {
+                int pipefd[2];
+                if (pipe2(pipefd, O_CLOEXEC) < 0) {
+                    // Nothing more is forked, the stages before see the end of their output
+                    send_to(me.get(), "*** Error: " + string(strerror(errno)) + ". ***\n");
+                    if (prev_in >= 0)   close(prev_in);
+                    if (up_in.in >= 0)  close(up_in.in);
+                    if (up_in.out >= 0) close(up_in.out);
+                    me->number_pipes.release_current();
+                    redirect_space::close_all(redirs);
+                    return 0;
+                }
+                out_fd = pipefd[1];
+                next_in = pipefd[0];
+            } else if (is_number_pipe || is_error_pipe) {
+                PendingPipe *number_pipe_out = me->number_pipes.get(command.number);
+
+                if (number_pipe_out) {
+                    out_fd = number_pipe_out->out;
+                } else {
+                    // Out of descriptors, the output is dropped as for a failed user pipe
+                    send_to(me.get(), "*** Error: " + string(strerror(errno)) + ". ***\n");
+                    out_fd = up_null = open_null();
+                }
+            } else if (regex_search(command.cmds[i], result, up_out_pattern)) {
+                is_output_user_pipe = true;
+                out_fd = make_user_pipe(me.get(), command.cmds[i], &up_null);
+            } else {
+                out_fd = me->get_outfd();
+            }
+
+            ExecPlan plan;
+            plan_exec(me.get(), args, plan);
+            {
+                TRACE_SPAN("fork");
+                do {
+                    pid = fork();
+                    if (pid < 0) usleep(5000);
+                } while (pid < 0);
+            }
+
+            if (pid == 0) {
+                run_child(me.get(), plan, in_fd, out_fd, is_error_pipe, redirs[i]);
+            }
+
+            /* Parent Process */
+            if (prev_in >= 0)       close(prev_in);
+            if (!is_final_cmd)      close(out_fd);
+            if (up_in.in >= 0)      close(up_in.in);
+            if (up_in.out >= 0)     close(up_in.out);
+            if (up_null >= 0)       close(up_null);
+            prev_in = next_in;
+
+            // Number pipe, the first process has taken it
+            me->number_pipes.release_current();
+            redirect_space::release(redirs[i], me->sync_fds);
+
+            watch_child(me, pid, is_final_cmd && !(is_number_pipe || is_error_pipe) && !is_output_user_pipe);
+        }
+        return 0;
+    }
+
+    bool next_line(Session *me, string &line) {
+        size_t pos = me->inbuf.find('\n');
+
+        if (pos == string::npos) {
+            return false;
+        }
+        line = me->inbuf.substr(0, pos);
+        me->inbuf.erase(0, pos + 1);
+        return true;
+    }
+
+    void advance(shared_ptr<Session> me) {
+        // Run buffered lines until one waits for its final process
+        trace_space::current_tid = me->id;
+        while (!me->is_closed && me->wait_pidfd < 0) {
+            string line;
+
+            if (!me->pending.empty()) {
+                if (has_output(me.get())) {
+                    // Messages before the command reach the client first, on_writable resumes
+                    return;
+                }
+                Command command = me->pending.front();
+                me->pending.pop_front();
+
+                TRACE_SPAN("command");
+                if (execute(me, command) == THREAD_BUILT_IN_EXIT) {
+                    return;
+                }
+                continue;
+            }
+            if (me->in_line) {
+                me->in_line = false;
+                journal_space::record(me->id, me->input, me->status, me->start_ns);
+                command_prompt(me.get());
+            }
+            if (!next_line(me.get(), line)) {
+                if (me->telnet.eof) {
+                    // Ctrl-D after the lines before it have run
+                    logout(me);
+                }
+                return;
+            }
+
+            if (line.size() != 0 && !rate_space::admit_command(&me->command_bucket)) {
+                // Dropped before parsing, so number pipes do not count it
+                send_to(me.get(), "*** Error: too many commands, please slow down. ***\n");
+                line.clear();
+            }
+            if (line.size() == 0) {
+                command_prompt(me.get());
+                continue;
+            }
+
+            TRACE_SPAN("parse_number_pipe");
+            for (auto &command: parse_number_pipe(line)) {
+                me->pending.push_back(command);
+            }
+            me->input = line;
+            me->in_line = true;
+            me->start_ns = trace_space::now_ns();
+            me->status = JOURNAL_NO_STATUS;
+        }
+    }
+
+    /* Event Loop */
+    void on_readable(shared_ptr<Session> me) {
+        char buf[THREAD_MAX_BUF_SIZE];
+        ssize_t n = recv(me->sock, buf, sizeof(buf), MSG_DONTWAIT);
+
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        if (n <= 0) {
+            // Connection closed without exit
+            logout(me);
+            return;
+        }
+        string reply;
+        telnet_space::filter(&me->telnet, buf, n, me->inbuf, reply);
+        if (!reply.empty()) {
+            send_to(me.get(), reply);
+        }
+        if (me->telnet.local[TELNET_OPT_COMPRESS2]) my_compress(me.get());
+        advance(me);
+    }
+
+    void on_writable(shared_ptr<Session> me) {
+        bool is_drained;
+        {
+            lock_guard<mutex> guard(me->out_lock);
+            flush(me.get());
+            is_drained = me->outbox.empty();
+            rearm(me.get());
+        }
+
+        if (!is_drained) {
+            return;
+        }
+        if (me->is_closed) {
+            close_session(me);
+        } else {
+            advance(me);
+        }
+    }
+
+    void on_socket(int fd, uint32_t events) {
+        // The client socket, or the compressor in front of it
+        shared_ptr<Session> me = self->sockets[fd];
+
+        if (events & EPOLLOUT || (events & (EPOLLERR | EPOLLHUP) && (fd != me->sock || me->is_closed))) {
+            on_writable(me);
+        }
+        if (fd == me->sock && events & (EPOLLIN | EPOLLERR | EPOLLHUP) && !me->is_closed) {
+            on_readable(me);
+        }
+    }
+
+    void on_child_exit(int pidfd) {
+        ChildWaiter waiter = self->children[pidfd];
+        shared_ptr<Session> me = waiter.session;
+        struct rusage ru;
+        int status;
+        pid_t pid = wait4(waiter.pid, &status, WNOHANG, &ru);
+
+        if (pid == 0) {
+            // Stale event of a reused descriptor
+            return;
+        }
+        if (pid > 0) {
+            limit_space::add_rusage(&me->usage, &ru);
+        }
+        watch(pidfd, 0, EPOLL_CTL_DEL);
+        close(pidfd);
+        self->children.erase(pidfd);
+
+        if (me->wait_pidfd == pidfd) {
+            me->wait_pidfd = -1;
+            if (pid > 0) me->status = journal_space::exit_code(status);
+            redirect_space::sync(me->sync_fds);
+            if (!me->is_closed) {
+                set_reading(me.get(), true);
+                advance(me);
+            }
+        }
+    }
+
+    void on_notify() {
+        vector<pair<int, sockaddr_storage>> incoming;
+        char buf[64];
+
+        while (read(self->notify[0], buf, sizeof(buf)) > 0) {}
+        {
+            lock_guard<mutex> guard(self->lock);
+            incoming.swap(self->incoming);
+        }
+        for (auto &elem: incoming) {
+            login(elem.first, elem.second);
+        }
+    }
+
+    void worker_loop(Worker *worker) {
+        struct epoll_event events[THREAD_MAX_EVENTS];
+
+        self = worker;
+        while (true) {
+            // The journal batch of this worker is written once due
+            int n = epoll_wait(self->epfd, events, THREAD_MAX_EVENTS, journal_space::flush_timeout_ms());
+
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("epoll_wait");
+                exit(0);
+            }
+            journal_space::tick();
+            for (int x = 0; x < n; ++x) {
+                int fd = events[x].data.fd;
+
+                if (fd == self->notify[0]) {
+                    on_notify();
+                } else if (self->children.count(fd)) {
+                    on_child_exit(fd);
+                } else if (self->sockets.count(fd)) {
+                    on_socket(fd, events[x].events);
+                }
+            }
+        }
+    }
+
+    void serve(const char *port, int workers) {
+        int listen_sock = get_listen_socket(port);
+        vector<Worker *> pool;
+        size_t next = 0;
+
+        fcntl(listen_sock, F_SETFD, FD_CLOEXEC);
+        if (workers <= 0) workers = 1;
+
+        for (int x = 0; x < workers; ++x) {
+            Worker *worker = new Worker();
+            struct epoll_event ev = {};
+
+            worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+            if (worker->epfd < 0 || pipe2(worker->notify, O_CLOEXEC | O_NONBLOCK) < 0) {
+                perror("Create worker");
+                exit(0);
+            }
+            ev.events = EPOLLIN;
+            ev.data.fd = worker->notify[0];
+            epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->notify[0], &ev);
+
+            worker->th = thread(worker_loop, worker);
+            pool.push_back(worker);
+        }
+
+        while (true) {
+            struct sockaddr_storage c_addr;
+            socklen_t c_addr_len = sizeof(c_addr);
+            int client_sock = accept4(listen_sock, (struct sockaddr *) &c_addr, &c_addr_len, SOCK_CLOEXEC);
+
+            if (client_sock < 0) {
+                if (errno == EINTR) continue;
+                perror("Sever accept");
+                exit(0);
+            }
+            if (!rate_space::admit_login(c_addr)) {
+                // Rejected before any session is created
+                close(client_sock);
+                continue;
+            }
+
+            // Round robin, the worker creates the session on its own thread
+            Worker *worker = pool[next++ % pool.size()];
+            {
+                lock_guard<mutex> guard(worker->lock);
+                worker->incoming.push_back({client_sock, c_addr});
+            }
+            if (write(worker->notify[1], "", 1) < 0 && errno != EAGAIN) {
+                perror("Notify worker");
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef NP_TRACE_H
+#define NP_TRACE_H
+
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <atomic>
+
+using namespace std;
+
+/*
+ * Per-process command tracing
+ *
+ * Spans are recorded into a fixed ring, so the memory cost is bounded and the
+ * oldest spans are overwritten once the ring is full. Send TRACE_SIGNAL to a
+ * server process to dump its ring to trace_<pid>.json, which can be opened by
+ * chrome://tracing or ui.perfetto.dev. For np_multi_proc every user has its
+ * own process, the server forwards the signal to each of them by pid. Do not
+ * signal the process group, the commands users run are in it and would die
+ * of a SIGUSR2 they never handle.
+ */
+#define TRACE_ENABLE        1
+#define TRACE_RING_SIZE     4096    // Must be power of 2
+#define TRACE_SIGNAL        SIGUSR2
+#define TRACE_LINE_SIZE     256
+
+typedef struct trace_span {
+    atomic<unsigned long> seq;  // 2 * index + 2 once written, odd while being written
+    const char *name;   // Must be a string literal
+    long start_ns;
+    long dur_ns;
+    int tid;            // uid of the session, 0 for the server itself
+} TraceSpan;
+
+namespace trace_space {
+    TraceSpan ring[TRACE_RING_SIZE];
+    atomic<unsigned long> head(0);
+    thread_local int current_tid = 0;  // Per worker thread of np_multi_proc --threads
+    long span_overhead_ns = 0;
+
+    long now_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000L + ts.tv_nsec;
+    }
+
+    void record(const char *name, long start_ns, long end_ns) {
+        // Threads share the ring, a slot reused while being read is skipped by dump
+        unsigned long x = head.fetch_add(1, memory_order_relaxed);
+        TraceSpan *span = &ring[x & (TRACE_RING_SIZE - 1)];
+
+        span->seq.store(2 * x + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        span->name     = name;
+        span->start_ns = start_ns;
+        span->dur_ns   = end_ns - start_ns;
+        span->tid      = current_tid;
+        span->seq.store(2 * x + 2, memory_order_release);
+    }
+
+    class Span {
+    private:
+        const char *name;
+        long start_ns;
+
+    public:
+        Span(const char *name) {
+            this->name = name;
+            this->start_ns = now_ns();
+        }
+        ~Span() {
+            record(this->name, this->start_ns, now_ns());
+        }
+    };
+
+    class TraceLine {
+    public:
+        // Formats without snprintf, which is not async-signal-safe
+        char buf[TRACE_LINE_SIZE];
+        int len = 0;
+
+        TraceLine &add(const char *str) {
+            while (*str && this->len < TRACE_LINE_SIZE) this->buf[this->len++] = *str++;
+            return *this;
+        }
+
+        TraceLine &num(unsigned long value) {
+            char digits[24];
+            int n = 0;
+
+            do {
+                digits[n++] = '0' + value % 10;
+                value /= 10;
+            } while (value > 0);
+            while (n > 0 && this->len < TRACE_LINE_SIZE) this->buf[this->len++] = digits[--n];
+            return *this;
+        }
+
+        TraceLine &usec(long ns) {
+            // Nanoseconds as microseconds with three decimals
+            char frac[4] = {(char)('0' + ns / 100 % 10), (char)('0' + ns / 10 % 10), (char)('0' + ns % 10), 0};
+            return this->num(ns / 1000).add(".").add(frac);
+        }
+    };
+
+    void dump(int sig) {
+        // Invoked as signal handler, only use write() on a stack buffer
+        TraceLine path, line;
+        int fd;
+        pid_t pid = getpid();
+        unsigned long end = head.load(memory_order_relaxed);
+        unsigned long begin = (end > TRACE_RING_SIZE) ? end - TRACE_RING_SIZE : 0;
+        bool is_first = true;
+
+        path.add("trace_").num(pid).add(".json");
+        path.buf[path.len] = '\0';
+        fd = open(path.buf, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd < 0) {
+            return;
+        }
+
+        line.add("{\"otherData\":{\"span_overhead_ns\":").num(span_overhead_ns)
+            .add(",\"dropped\":").num(begin).add("},\"traceEvents\":[\n");
+        write(fd, line.buf, line.len);
+
+        for (unsigned long x = begin; x < end; ++x) {
+            TraceSpan *span = &ring[x & (TRACE_RING_SIZE - 1)];
+            unsigned long seq = span->seq.load(memory_order_acquire);
+            TraceSpan copy;
+
+            if (seq != 2 * x + 2) continue;     // Still being written, or already reused
+            copy.name     = span->name;
+            copy.start_ns = span->start_ns;
+            copy.dur_ns   = span->dur_ns;
+            copy.tid      = span->tid;
+            atomic_thread_fence(memory_order_acquire);
+            if (span->seq.load(memory_order_relaxed) != seq) continue;
+
+            line.len = 0;
+            line.add(is_first ? "" : ",").add("{\"name\":\"").add(copy.name)
+                .add("\",\"ph\":\"X\",\"ts\":").usec(copy.start_ns).add(",\"dur\":").usec(copy.dur_ns)
+                .add(",\"pid\":").num(pid).add(",\"tid\":").num(copy.tid).add("}\n");
+            write(fd, line.buf, line.len);
+            is_first = false;
+        }
+
+        write(fd, "]}\n", 3);
+        close(fd);
+    }
+
+    void init() {
+        // Measure the cost of one span so it can be subtracted when reading the trace
+        const int rounds = 1000;
+        long start = now_ns();
+
+        for (int x = 0; x < rounds; ++x) {
+            record("calibrate", now_ns(), now_ns());
+        }
+        span_overhead_ns = (now_ns() - start) / rounds;
+        head.store(0, memory_order_relaxed);
+
+        signal(TRACE_SIGNAL, dump);
+    }
+}
+
+#define TRACE_CONCAT_(a, b)  a##b
+#define TRACE_CONCAT(a, b)   TRACE_CONCAT_(a, b)
+
+#if TRACE_ENABLE
+#define TRACE_SPAN(name)    trace_space::Span TRACE_CONCAT(trace_span_, __LINE__)(name)
+#else
+#define TRACE_SPAN(name)
+#endif
+
+#endif
@@ -0,0 +1,283 @@
+#ifndef NP_ZYGOTE_H
+#define NP_ZYGOTE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/sched.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "np_core.h"
+#include "np_trace.h"
+#include "np_limits.h"
+
+using namespace std;
+
+/*
+ * Spawn helper (zygote)
+ *
+ * A command forked from np_single_proc copies the page tables of a server
+ * that grows with its users, so every stage costs more the busier the
+ * server is. With NP_ZYGOTE=on the server forks a helper at boot, before
+ * any user exists, and has it spawn the commands instead. A request over a
+ * seqpacket socketpair carries argv, the environment and the session
+ * cgroup, with the standard descriptors of the child and the one to report
+ * an unknown command to as SCM_RIGHTS. The reply carries the pid and a
+ * pidfd of the child.
+ *
+ * Children are cloned with CLONE_PARENT, so they are the server's children
+ * as if it had forked them: the session waits for them and collects their
+ * rusage as before. The helper leaves once the server closes its end.
+ */
+#define ZYGOTE_ENV          "NP_ZYGOTE"
+#define ZYGOTE_MSG_SIZE     (64 * 1024)     // Request bytes, a longer one is forked by the server
+
+typedef struct zygote_request {
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t stdio_mask;    // Bit n set if a descriptor for fd n is sent
+    uint32_t length;        // Of the strings
+} ZygoteRequest;            // argv, envp and the cgroup follow, each ends with a NUL
+
+typedef struct zygote_reply {
+    pid_t pid;              // -1 if it failed
+    int error;              // errno of the failure
+} ZygoteReply;              // The pidfd is attached on success
+
+namespace zygote_space {
+    bool enabled = false;
+    int channel = -1;
+    pid_t zygote_pid = -1;
+    unsigned long spawns = 0;
+    long spawn_ns = 0;      // Round trips of the server
+
+    bool send_msg(int fd, const void *buf, size_t len, const int *fds, int n_fds) {
+        struct msghdr msg = {};
+        struct iovec iov = {(void *)buf, len};
+        char control[CMSG_SPACE(sizeof(int) * 4)];
+
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (n_fds > 0) {
+            memset(control, 0, sizeof(control));
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+            memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n_fds);
+        }
+
+        while (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+            if (errno != EINTR) return false;
+        }
+        return true;
+    }
+
+    ssize_t recv_msg(int fd, void *buf, size_t len, int *fds, int *n_fds) {
+        // Received descriptors are close-on-exec
+        struct msghdr msg = {};
+        struct iovec iov = {buf, len};
+        char control[CMSG_SPACE(sizeof(int) * 4)];
+        ssize_t n;
+
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        while ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0) {
+            if (errno != EINTR) return -1;
+        }
+
+        *n_fds = 0;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                *n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *n_fds);
+            }
+        }
+        return n;
+    }
+
+    void exec_child(const ZygoteRequest *req, const char *strings, const int *fds) {
+        // In the clone, every received descriptor is close-on-exec
+        vector<string> args;
+        vector<char *> envp;
+        const char *str = strings;
+        int n = 0;
+
+        for (uint32_t x = 0; x < req->argc; ++x, str += strlen(str) + 1) {
+            args.push_back(str);
+        }
+        for (uint32_t x = 0; x < req->envc; ++x, str += strlen(str) + 1) {
+            envp.push_back((char *)str);
+        }
+        envp.push_back(NULL);
+
+        for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; ++fd) {
+            if (req->stdio_mask & (1 << fd)) dup2(fds[n++], fd);
+        }
+        for (int sig = 1; sig < NSIG; sig++) {
+            signal(sig, SIG_DFL);
+        }
+        limit_space::apply(str);
+
+        environ = envp.data();
+        exec_args(args);
+
+        // As execute_command reports it
+        string msg = "Unknown command: [" + args[0] + "].\n";
+        if (write(fds[n], msg.data(), msg.size()) < 0) {}
+        _exit(1);
+    }
+
+    void serve() {
+        static char buf[ZYGOTE_MSG_SIZE];
+        int fds[4], n_fds;
+
+        while (true) {
+            ssize_t n = recv_msg(channel, buf, sizeof(buf), fds, &n_fds);
+            ZygoteRequest *req = (ZygoteRequest *)buf;
+            ZygoteReply reply = {-1, EINVAL};
+            int pidfd = -1;
+
+            if (n <= 0) {
+                // The server is gone
+                _exit(0);
+            }
+
+            if ((size_t)n == sizeof(ZygoteRequest) + req->length &&
+                n_fds == __builtin_popcount(req->stdio_mask) + 1) {
+                struct clone_args args = {};
+
+                args.flags = CLONE_PARENT | CLONE_PIDFD;
+                args.pidfd = (uint64_t)(uintptr_t)&pidfd;
+                reply.pid = syscall(SYS_clone3, &args, sizeof(args));
+                reply.error = errno;
+
+                if (reply.pid == 0) {
+                    exec_child(req, buf + sizeof(ZygoteRequest), fds);
+                }
+            }
+
+            for (int x = 0; x < n_fds; ++x) {
+                close(fds[x]);
+            }
+            send_msg(channel, &reply, sizeof(reply), &pidfd, (reply.pid > 0) ? 1 : 0);
+            if (pidfd >= 0) close(pidfd);
+        }
+    }
+
+    void init() {
+        // Before any user or listen socket exists, the helper holds none of them
+        char *mode = getenv(ZYGOTE_ENV);
+        int sv[2];
+
+        if (mode == NULL || strcmp(mode, "on") != 0) {
+            return;
+        }
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+            perror("Zygote socketpair");
+            return;
+        }
+
+        zygote_pid = fork();
+        if (zygote_pid < 0) {
+            perror("Zygote fork");
+            close(sv[0]);
+            close(sv[1]);
+            return;
+        }
+        if (zygote_pid == 0) {
+            channel = STDERR_FILENO + 1;
+            dup2(sv[1], channel);
+            fcntl(channel, F_SETFD, FD_CLOEXEC);
+            close_range(channel + 1, ~0U, 0);
+            for (int sig = 1; sig < NSIG; sig++) {
+                signal(sig, SIG_DFL);
+            }
+            serve();
+        }
+
+        close(sv[1]);
+        channel = sv[0];
+        enabled = true;
+    }
+
+    pid_t spawn(vector<string> &args, const int stdio[3], int msgfd, const string &cgroup, int *pidfd) {
+        /*
+         * Start a child with the current environment. stdio holds the
+         * descriptors for fd 0 to 2, -1 keeps the server's. Returns -1 if
+         * the server should fork the child itself.
+         */
+        string strings;
+        ZygoteRequest req = {(uint32_t)args.size(), 0, 0, 0};
+        int fds[4], n_fds = 0;
+        long start_ns = trace_space::now_ns();
+
+        for (auto &arg: args) {
+            strings.append(arg).push_back('\0');
+        }
+        for (char **env = environ; *env; ++env) {
+            strings.append(*env).push_back('\0');
+            ++req.envc;
+        }
+        strings.append(cgroup).push_back('\0');
+        req.length = strings.size();
+
+        for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; ++fd) {
+            if (stdio[fd] >= 0) {
+                req.stdio_mask |= 1 << fd;
+                fds[n_fds++] = stdio[fd];
+            }
+        }
+        fds[n_fds++] = msgfd;
+
+        if (sizeof(req) + strings.size() > ZYGOTE_MSG_SIZE) {
+            return -1;
+        }
+        strings.insert(0, (const char *)&req, sizeof(req));
+
+        ZygoteReply reply;
+        int n_recv;
+
+        if (!send_msg(channel, strings.data(), strings.size(), fds, n_fds) ||
+            recv_msg(channel, &reply, sizeof(reply), pidfd, &n_recv) != sizeof(reply)) {
+            perror("Zygote request");
+            enabled = false;
+            return -1;
+        }
+        if (reply.pid < 0) {
+            errno = reply.error;
+            perror("Zygote clone");
+            if (reply.error == ENOSYS || reply.error == EPERM) enabled = false;
+            return -1;
+        }
+        if (n_recv == 0) *pidfd = -1;
+
+        ++spawns;
+        spawn_ns += trace_space::now_ns() - start_ns;
+        return reply.pid;
+    }
+
+    void report() {
+        if (enabled) {
+            cerr << "Zygote: " << spawns << " spawns, "
+                 << ((spawns > 0) ? spawn_ns / spawns / 1000 : 0) << " us per round trip" << endl;
+        }
+    }
+}
+
+#endif